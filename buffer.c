@@ -38,6 +38,10 @@ struct libspectrum_buffer {
   libspectrum_byte* buffer;
   size_t buffer_size;
   size_t bytes_used;
+
+  /* If non-NULL, where libspectrum_buffer_drain() passes the data on to */
+  libspectrum_buffer_sink sink;
+  void *sink_data;
 };
 
 void
@@ -56,12 +60,38 @@ libspectrum_buffer_alloc( void )
   buffer->buffer = NULL;
   buffer->buffer_size = 0;
   buffer->bytes_used = 0;
+  buffer->sink = NULL;
+  buffer->sink_data = NULL;
 
   libspectrum_buffer_reallocate( buffer, 65536 );
 
   return buffer;
 }
 
+libspectrum_buffer*
+libspectrum_buffer_alloc_sink( libspectrum_buffer_sink sink, void *user_data )
+{
+  libspectrum_buffer *buffer = libspectrum_buffer_alloc();
+
+  buffer->sink = sink;
+  buffer->sink_data = user_data;
+
+  return buffer;
+}
+
+libspectrum_error
+libspectrum_buffer_drain( libspectrum_buffer *buffer )
+{
+  libspectrum_error error;
+
+  if( !buffer->sink || !buffer->bytes_used ) return LIBSPECTRUM_ERROR_NONE;
+
+  error = buffer->sink( buffer->buffer, buffer->bytes_used, buffer->sink_data );
+  buffer->bytes_used = 0;
+
+  return error;
+}
+
 void
 libspectrum_buffer_free( libspectrum_buffer *buffer )
 {
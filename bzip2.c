@@ -27,11 +27,65 @@
 
 #include <stdio.h>		/* Needed by bzlib.h < v 1.0.2 */
 #include <stdlib.h>
+#include <string.h>
 
 #include <bzlib.h>
 
 #include "internals.h"
 
+/* When the decompressed length isn't known, the output buffer starts at
+   four times the compressed length, but no smaller than BZIP2_MIN_BUFFER
+   or larger than BZIP2_MAX_BUFFER, and at least doubles each time it
+   runs out */
+#define BZIP2_MIN_BUFFER 65536
+#define BZIP2_MAX_BUFFER ( 4 * 1024 * 1024 )
+
+/* A hint which would mean the data expanding by more than this isn't
+   trusted at all; one which is trusted still starts the buffer no larger
+   than BZIP2_MAX_BUFFER */
+#define BZIP2_MAX_HINT_RATIO 1024
+
+/* Decompressed data is passed to the sink in blocks of this size */
+#define BZIP2_STREAM_BLOCK 65536
+
+/* Decompressed data being collected into one buffer */
+typedef struct bzip2_buffer {
+  libspectrum_byte *data;
+  size_t length, capacity;
+
+  /* Stop once we've got this much, or 0 to get everything */
+  size_t limit;
+
+  /* Fail if we get more than this */
+  size_t allowance;
+  int over_allowance;
+} bzip2_buffer;
+
+/* Decompressed data being passed on to the caller's sink */
+typedef struct bzip2_counter {
+  libspectrum_inflate_sink sink;
+  void *user_data;
+
+  size_t length;
+
+  /* Fail if we get more than this */
+  size_t allowance;
+  int over_allowance;
+} bzip2_counter;
+
+static libspectrum_error
+bzip2_stream( const libspectrum_byte *bzptr, size_t bzlength,
+              libspectrum_inflate_sink sink, void *user_data,
+              int allow_truncated );
+static int
+buffer_sink( const libspectrum_byte *data, size_t length, void *user_data );
+static int
+counter_sink( const libspectrum_byte *data, size_t length, void *user_data );
+static libspectrum_error
+bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
+               libspectrum_byte **outptr, size_t *outlength,
+               size_t capacity, size_t limit );
+
 libspectrum_error
 libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
 			   libspectrum_byte **outptr, size_t *outlength )
@@ -42,6 +96,9 @@ libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
   /* Known length, so we can use the easy method */
   if( *outlength ) {
 
+    error = libspectrum_inflate_check( *outlength );
+    if( error ) return error;
+
     *outptr = libspectrum_new( libspectrum_byte, *outlength );
     length2 = *outlength;
 
@@ -50,91 +107,270 @@ libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
     if( error != BZ_OK ) {
       libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			       "error decompressing bzip data" );
+      libspectrum_free( *outptr );
       return LIBSPECTRUM_ERROR_LOGIC;
     }
 
     *outlength = length2;
 
+    libspectrum_inflate_charge( *outlength );
+
     return LIBSPECTRUM_ERROR_NONE;
 
   } else {			/* Unknown length, have to stream */
 
-    bz_stream stream;
-    libspectrum_byte *ptr; size_t length;
+    return libspectrum_bzip2_inflate_hinted( bzptr, bzlength, outptr,
+					     outlength, 0 );
 
-    length = bzlength;
+  }
+}
 
-    *outptr = libspectrum_new( libspectrum_byte, length );
+/* Decompress data of unknown length, expecting it to be about `size_hint'
+   bytes if that is non-zero. The hint usually comes from the file, so is
+   only used to size the initial buffer */
+libspectrum_error
+libspectrum_bzip2_inflate_hinted( const libspectrum_byte *bzptr,
+                                  size_t bzlength, libspectrum_byte **outptr,
+                                  size_t *outlength, size_t size_hint )
+{
+  size_t capacity;
 
-    /* Use standard memory allocation/free routines */
-    stream.bzalloc = NULL; stream.bzfree = NULL; stream.opaque = NULL;
+  if( size_hint / BZIP2_MAX_HINT_RATIO > bzlength ) size_hint = 0;
+
+  if( size_hint ) {
+    capacity = size_hint < BZIP2_MAX_BUFFER ? size_hint : BZIP2_MAX_BUFFER;
+  } else {
+    /* bzip2 typically manages around 4:1 */
+    capacity = bzlength < BZIP2_MAX_BUFFER / 4 ? 4 * bzlength :
+                                                 BZIP2_MAX_BUFFER;
+    if( capacity < BZIP2_MIN_BUFFER ) capacity = BZIP2_MIN_BUFFER;
+  }
+
+  return bzip2_inflate( bzptr, bzlength, outptr, outlength, capacity, 0 );
+}
+
+/* Decompress no more than the first `*outlength' bytes of the data */
+libspectrum_error
+libspectrum_bzip2_inflate_prefix( const libspectrum_byte *bzptr,
+				  size_t bzlength, libspectrum_byte **outptr,
+				  size_t *outlength )
+{
+  /* A limit of 0 would otherwise mean everything */
+  if( !*outlength ) {
+    *outptr = NULL;
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
+  return bzip2_inflate( bzptr, bzlength, outptr, outlength, *outlength,
+                        *outlength );
+}
+
+/* Decompress data, passing it to `sink' a block at a time as it is
+   produced, so the caller can start work on it before it's all there.
+   Everything passed on counts towards the decompression limit */
+libspectrum_error
+libspectrum_bzip2_inflate_stream( const libspectrum_byte *bzptr,
+                                  size_t bzlength,
+                                  libspectrum_inflate_sink sink,
+                                  void *user_data )
+{
+  bzip2_counter counter;
+  libspectrum_error error;
+
+  counter.sink = sink;
+  counter.user_data = user_data;
+  counter.length = 0;
+  counter.allowance = libspectrum_inflate_allowance();
+  counter.over_allowance = 0;
+
+  error = bzip2_stream( bzptr, bzlength, counter_sink, &counter, 0 );
+  if( !error && counter.over_allowance )
+    error = libspectrum_inflate_check( counter.allowance + 1 );
+  if( error ) return error;
+
+  libspectrum_inflate_charge( counter.length );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Decompress data, passing it to `sink' a block at a time as it is
+   produced. If `allow_truncated' is set, running out of input just ends
+   the data */
+static libspectrum_error
+bzip2_stream( const libspectrum_byte *bzptr, size_t bzlength,
+              libspectrum_inflate_sink sink, void *user_data,
+              int allow_truncated )
+{
+  bz_stream stream;
+  libspectrum_byte *block;
+  size_t produced;
+  int error;
+
+  /* Use standard memory allocation/free routines */
+  stream.bzalloc = NULL; stream.bzfree = NULL; stream.opaque = NULL;
+
+  error = BZ2_bzDecompressInit( &stream, 0, 0 );
+  if( error != BZ_OK ) {
+    switch( error ) {
+
+    case BZ_MEM_ERROR:
+      libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                               "out of memory at %s:%d", __FILE__, __LINE__ );
+      return LIBSPECTRUM_ERROR_MEMORY;
+
+    default:
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_LOGIC,
+        "bzip2_inflate: serious error from BZ2_bzDecompressInit: %d", error
+      );
+      return LIBSPECTRUM_ERROR_LOGIC;
 
-    error = BZ2_bzDecompressInit( &stream, 0, 0 );
-    if( error != BZ_OK ) {
-      switch( error ) {
-
-      case BZ_MEM_ERROR:
-	libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
-				 "out of memory at %s:%d",
-				 __FILE__, __LINE__ );
-	libspectrum_free( *outptr );
-	return LIBSPECTRUM_ERROR_MEMORY;
-
-      default:
-	libspectrum_print_error(
-          LIBSPECTRUM_ERROR_LOGIC,
-	  "bzip2_inflate: serious error from BZ2_bzDecompressInit: %d", error
-	);
-	libspectrum_free( *outptr );
-	return LIBSPECTRUM_ERROR_LOGIC;
-
-      }
     }
+  }
+
+  block = libspectrum_new( libspectrum_byte, BZIP2_STREAM_BLOCK );
+
+  stream.next_in = (char*)bzptr; stream.avail_in = bzlength;
+
+  do {
+
+    stream.next_out = (char*)block; stream.avail_out = BZIP2_STREAM_BLOCK;
+
+    error = BZ2_bzDecompress( &stream );
+    if( error != BZ_OK && error != BZ_STREAM_END ) break;
+
+    produced = BZIP2_STREAM_BLOCK - stream.avail_out;
+    if( produced && sink( block, produced, user_data ) ) {
+      error = BZ_STREAM_END;
+      break;
+    }
+
+    /* Run out of input before the end of the stream */
+    if( error == BZ_OK && !stream.avail_in && stream.avail_out )
+      error = allow_truncated ? BZ_STREAM_END : BZ_UNEXPECTED_EOF;
+
+  } while( error == BZ_OK );
+
+  BZ2_bzDecompressEnd( &stream );
+  libspectrum_free( block );
+
+  switch( error ) {
+
+  case BZ_STREAM_END:
+    return LIBSPECTRUM_ERROR_NONE;
+
+  case BZ_MEM_ERROR:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+                             "out of memory at %s:%d", __FILE__, __LINE__ );
+    return LIBSPECTRUM_ERROR_MEMORY;
+
+  case BZ_UNEXPECTED_EOF:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "bzip2_inflate: data is truncated" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+
+  case BZ_DATA_ERROR:
+  case BZ_DATA_ERROR_MAGIC:
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+                             "bzip2_inflate: corrupt data" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+
+  default:
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_LOGIC,
+      "bzip2_inflate: serious error from BZ2_bzDecompress: %d", error
+    );
+    return LIBSPECTRUM_ERROR_LOGIC;
+
+  }
+}
+
+/* Add a block of decompressed data to a buffer, stopping decompression
+   once the buffer has all that's wanted */
+static int
+buffer_sink( const libspectrum_byte *data, size_t length, void *user_data )
+{
+  bzip2_buffer *buffer = user_data;
+  int full = 0;
+
+  if( buffer->limit && length >= buffer->limit - buffer->length ) {
+    length = buffer->limit - buffer->length;
+    full = 1;
+  }
+
+  if( length > buffer->allowance - buffer->length ) {
+    buffer->over_allowance = 1;
+    return 1;
+  }
+
+  if( length > buffer->capacity - buffer->length ) {
+    buffer->capacity = MAX( 2 * buffer->capacity, buffer->length + length );
+    buffer->data = libspectrum_renew( libspectrum_byte, buffer->data,
+                                      buffer->capacity );
+  }
+
+  memcpy( buffer->data + buffer->length, data, length );
+  buffer->length += length;
+
+  return full;
+}
+
+/* Pass a block of decompressed data on to the caller's sink, unless it
+   takes the data past the decompression limit */
+static int
+counter_sink( const libspectrum_byte *data, size_t length, void *user_data )
+{
+  bzip2_counter *counter = user_data;
+
+  if( length > counter->allowance - counter->length ) {
+    counter->over_allowance = 1;
+    return 1;
+  }
+
+  counter->length += length;
+
+  return counter->sink( data, length, counter->user_data );
+}
+
+/* Decompress data into a buffer which starts at `capacity' bytes and
+   grows geometrically as needed, failing if the data goes past the
+   decompression limit. If `limit' is non-zero, stop after that many bytes
+   instead, accepting truncated data */
+static libspectrum_error
+bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
+               libspectrum_byte **outptr, size_t *outlength,
+               size_t capacity, size_t limit )
+{
+  bzip2_buffer buffer;
+  libspectrum_error error;
+
+  buffer.allowance = limit ? SIZE_MAX : libspectrum_inflate_allowance();
+  buffer.over_allowance = 0;
+  if( capacity > buffer.allowance ) capacity = buffer.allowance;
+
+  buffer.data = libspectrum_new( libspectrum_byte, capacity );
+  buffer.length = 0;
+  buffer.capacity = capacity;
+  buffer.limit = limit;
+
+  error = bzip2_stream( bzptr, bzlength, buffer_sink, &buffer, limit != 0 );
+  if( !error && buffer.over_allowance )
+    error = libspectrum_inflate_check( buffer.allowance + 1 );
+  if( error ) {
+    libspectrum_free( buffer.data );
+    return error;
+  }
+
+  /* Give back any large amount of unused space */
+  if( buffer.length < buffer.capacity - buffer.capacity / 4 )
+    buffer.data = libspectrum_renew( libspectrum_byte, buffer.data,
+                                     buffer.length );
+
+  if( !limit ) libspectrum_inflate_charge( buffer.length );
+
+  *outptr = buffer.data; *outlength = buffer.length;
 
-    stream.next_in = (char*)bzptr; stream.avail_in = bzlength;
-    stream.next_out = (char*)*outptr; stream.avail_out = bzlength;
-
-    while( 1 ) {
-
-      error = BZ2_bzDecompress( &stream );
-
-      switch( error ) {
-
-      case BZ_STREAM_END:	/* Finished decompression */
-	error = BZ2_bzDecompressEnd( &stream );
-	if( error ) {
-	  libspectrum_print_error(
-	    LIBSPECTRUM_ERROR_LOGIC,
-	    "bzip2_inflate: error from BZ2_bzDecompressEnd: %d", error
-	  );
-	  libspectrum_free( *outptr );
-	  return LIBSPECTRUM_ERROR_LOGIC;
-	}
-	*outlength = stream.total_out_lo32;
-	*outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
-	return LIBSPECTRUM_ERROR_NONE;
-
-      case BZ_OK:		/* More output space required */
-
-	length += bzlength;
-	ptr = libspectrum_renew( libspectrum_byte, *outptr, length );
-	*outptr = ptr;
-	stream.next_out = (char*)*outptr + stream.total_out_lo32;
-	stream.avail_out += bzlength;
-	break;
-
-      default:
-	libspectrum_print_error(
-	  LIBSPECTRUM_ERROR_LOGIC,
-	  "bzip2_inflate: serious error from BZ2_bzDecompress: %d", error
-	);
-	BZ2_bzDecompressEnd( &stream );
-	libspectrum_free( *outptr );
-	return LIBSPECTRUM_ERROR_LOGIC;
-      }
-    }				/* Matches while( 1 ) { ... } */
-
-  }				/* Matches if( *outlength ) { ... } */
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 #endif				/* #ifdef HAVE_LIBBZ2 */
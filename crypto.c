@@ -25,7 +25,12 @@
 
 #ifdef HAVE_GCRYPT_H
 
+#include <string.h>
+
 #include <gcrypt.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD_H */
 
 #include "internals.h"
 
@@ -39,12 +44,45 @@ static const char * const signature_format = "(sig-val (dsa (r %m) (s %m)))";
 #define HASH_ALGORITHM GCRY_MD_SHA1
 #define MPI_COUNT 5
 
+/* Parsing a key is expensive, so keep the most recently used public keys
+   around. Secret keys are never cached: the caller expects the secret
+   exponent to be gone once signing has finished */
+#define KEY_CACHE_SIZE 4
+
+typedef struct cached_key_t {
+
+  char *p, *q, *g, *y;		/* Copies of the key parameters */
+  gcry_sexp_t sexp;
+
+  int refcount;			/* One for the cache, one for each user */
+
+} cached_key_t;
+
+static cached_key_t *key_cache[ KEY_CACHE_SIZE ];
+static size_t key_cache_next = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock() pthread_mutex_lock( &key_cache_lock )
+#define unlock() pthread_mutex_unlock( &key_cache_lock )
+#else				/* #ifdef HAVE_PTHREAD_H */
+#define lock()
+#define unlock()
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+struct libspectrum_hash_context {
+  gcry_md_hd_t md;
+};
+
 static libspectrum_error
-get_signature( gcry_mpi_t *r, gcry_mpi_t *s, libspectrum_byte *data,
-	       size_t data_length, libspectrum_rzx_dsa_key *key );
+get_signature( gcry_mpi_t *r, gcry_mpi_t *s, const libspectrum_byte *digest,
+	       size_t digest_length, libspectrum_rzx_dsa_key *key );
 static libspectrum_error
-get_hash( gcry_sexp_t *hash, const libspectrum_byte *data,
-	  size_t data_length );
+get_hash( gcry_sexp_t *hash, const libspectrum_byte *digest,
+	  size_t digest_length );
+static libspectrum_error
+get_key( cached_key_t **cached, libspectrum_rzx_dsa_key *key );
+static void release_key( cached_key_t *cached );
 static libspectrum_error
 create_key( gcry_sexp_t *s_key, libspectrum_rzx_dsa_key *key, int secret_key);
 static void free_mpis( gcry_mpi_t *mpis, size_t n );
@@ -55,14 +93,56 @@ serialise_mpis( libspectrum_byte **signature, size_t *signature_length,
 		gcry_mpi_t r, gcry_mpi_t s );
 
 libspectrum_error
-libspectrum_sign_data( libspectrum_byte **signature, size_t *signature_length,
-		       libspectrum_byte *data, size_t data_length,
-		       libspectrum_rzx_dsa_key *key )
+libspectrum_hash_start( libspectrum_hash_context **context )
+{
+  gcry_error_t error;
+
+  *context = libspectrum_new( libspectrum_hash_context, 1 );
+
+  error = gcry_md_open( &(*context)->md, HASH_ALGORITHM, 0 );
+  if( error ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+			     "libspectrum_hash_start: error opening hash: %s",
+			     gcry_strerror( error ) );
+    libspectrum_free( *context );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+void
+libspectrum_hash_update( libspectrum_hash_context *context,
+                         const libspectrum_byte *data, size_t data_length )
+{
+  gcry_md_write( context->md, data, data_length );
+}
+
+void
+libspectrum_hash_end( libspectrum_hash_context *context,
+                      libspectrum_byte **digest, size_t *digest_length )
+{
+  if( digest ) {
+    *digest_length = gcry_md_get_algo_dlen( HASH_ALGORITHM );
+    *digest = libspectrum_new( libspectrum_byte, *digest_length );
+    memcpy( *digest, gcry_md_read( context->md, HASH_ALGORITHM ),
+            *digest_length );
+  }
+
+  gcry_md_close( context->md );
+  libspectrum_free( context );
+}
+
+libspectrum_error
+libspectrum_sign_digest( libspectrum_byte **signature,
+                         size_t *signature_length,
+                         const libspectrum_byte *digest, size_t digest_length,
+                         libspectrum_rzx_dsa_key *key )
 {
   int error;
   gcry_mpi_t r, s;
 
-  error = get_signature( &r, &s, data, data_length, key );
+  error = get_signature( &r, &s, digest, digest_length, key );
   if( error ) return error;
 
   error = serialise_mpis( signature, signature_length, r, s );
@@ -74,14 +154,14 @@ libspectrum_sign_data( libspectrum_byte **signature, size_t *signature_length,
 }
 
 static libspectrum_error
-get_signature( gcry_mpi_t *r, gcry_mpi_t *s, libspectrum_byte *data,
-	       size_t data_length, libspectrum_rzx_dsa_key *key )
+get_signature( gcry_mpi_t *r, gcry_mpi_t *s, const libspectrum_byte *digest,
+	       size_t digest_length, libspectrum_rzx_dsa_key *key )
 {
   libspectrum_error error;
   gcry_error_t gcrypt_error;
   gcry_sexp_t hash, s_key, s_signature;
 
-  error = get_hash( &hash, data, data_length ); if( error ) return error;
+  error = get_hash( &hash, digest, digest_length ); if( error ) return error;
 
   error = create_key( &s_key, key, 1 );
   if( error ) { gcry_sexp_release( hash ); return error; }
@@ -111,16 +191,11 @@ get_signature( gcry_mpi_t *r, gcry_mpi_t *s, libspectrum_byte *data,
 }
 
 static libspectrum_error
-get_hash( gcry_sexp_t *hash, const libspectrum_byte *data, size_t data_length )
+get_hash( gcry_sexp_t *hash, const libspectrum_byte *digest,
+          size_t digest_length )
 {
   gcry_error_t error;
-  unsigned char *digest; size_t digest_length;
   gcry_mpi_t hash_mpi;
-  
-  digest_length = gcry_md_get_algo_dlen( HASH_ALGORITHM );
-  digest = libspectrum_new( unsigned char, digest_length );
-
-  gcry_md_hash_buffer( HASH_ALGORITHM, digest, data, data_length );
 
   error = gcry_mpi_scan( &hash_mpi, GCRYMPI_FMT_USG, digest, digest_length,
 			 NULL );
@@ -129,12 +204,9 @@ get_hash( gcry_sexp_t *hash, const libspectrum_byte *data, size_t data_length )
 			     "get_hash: error creating hash MPI: %s",
 			     gcry_strerror( error )
     );
-    libspectrum_free( digest );
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 
-  libspectrum_free( digest );
-
   error = gcry_sexp_build( hash, NULL, hash_format, hash_mpi );
   if( error ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
@@ -150,6 +222,98 @@ get_hash( gcry_sexp_t *hash, const libspectrum_byte *data, size_t data_length )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+static int
+key_matches( const char *cached, const char *param )
+{
+  if( !cached || !param ) return cached == param;
+  return !strcmp( cached, param );
+}
+
+static void
+key_free( cached_key_t *cached )
+{
+  libspectrum_free( cached->p ); libspectrum_free( cached->q );
+  libspectrum_free( cached->g ); libspectrum_free( cached->y );
+  gcry_sexp_release( cached->sexp );
+  libspectrum_free( cached );
+}
+
+/* Get the parsed form of the public part of `key', from the cache if
+   possible. The key must be returned with release_key() when finished
+   with */
+static libspectrum_error
+get_key( cached_key_t **cached, libspectrum_rzx_dsa_key *key )
+{
+  libspectrum_error error;
+  gcry_sexp_t sexp;
+  size_t i;
+
+  lock();
+
+  for( i = 0; i < KEY_CACHE_SIZE; i++ ) {
+    cached_key_t *entry = key_cache[i];
+    if( entry && key_matches( entry->p, key->p ) &&
+        key_matches( entry->q, key->q ) && key_matches( entry->g, key->g ) &&
+        key_matches( entry->y, key->y ) ) {
+      entry->refcount++;
+      *cached = entry;
+      unlock();
+      return LIBSPECTRUM_ERROR_NONE;
+    }
+  }
+
+  unlock();
+
+  error = create_key( &sexp, key, 0 );
+  if( error ) return error;
+
+  *cached = libspectrum_new( cached_key_t, 1 );
+  (*cached)->p = libspectrum_safe_strdup( key->p );
+  (*cached)->q = libspectrum_safe_strdup( key->q );
+  (*cached)->g = libspectrum_safe_strdup( key->g );
+  (*cached)->y = libspectrum_safe_strdup( key->y );
+  (*cached)->sexp = sexp;
+  (*cached)->refcount = 2;
+
+  lock();
+
+  /* Evict the oldest entry; it will actually be freed once any current
+     users have finished with it */
+  {
+    cached_key_t *old = key_cache[ key_cache_next ];
+    if( old && !--old->refcount ) key_free( old );
+  }
+  key_cache[ key_cache_next ] = *cached;
+  key_cache_next = ( key_cache_next + 1 ) % KEY_CACHE_SIZE;
+
+  unlock();
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+static void
+release_key( cached_key_t *cached )
+{
+  lock();
+  if( !--cached->refcount ) key_free( cached );
+  unlock();
+}
+
+void
+libspectrum_crypto_cleanup( void )
+{
+  size_t i;
+
+  lock();
+
+  for( i = 0; i < KEY_CACHE_SIZE; i++ ) {
+    if( key_cache[i] && !--key_cache[i]->refcount ) key_free( key_cache[i] );
+    key_cache[i] = NULL;
+  }
+
+  unlock();
+}
+
 static libspectrum_error
 create_key( gcry_sexp_t *s_key, libspectrum_rzx_dsa_key *key,
 	    int secret_key )
@@ -233,6 +397,7 @@ get_mpi( gcry_mpi_t *mpi, gcry_sexp_t sexp, const char *token )
   }
 
   *mpi = gcry_sexp_nth_mpi( pair, 1, GCRYMPI_FMT_USG );
+  gcry_sexp_release( pair );
   if( !(*mpi) ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "get_mpis: couldn't create MPI '%s'", token );
@@ -297,19 +462,41 @@ serialise_mpis( libspectrum_byte **signature, size_t *signature_length,
 libspectrum_error
 libspectrum_verify_signature( libspectrum_signature *signature,
 			      libspectrum_rzx_dsa_key *key )
+{
+  libspectrum_error error;
+  libspectrum_byte *digest; size_t digest_length;
+
+  digest_length = gcry_md_get_algo_dlen( HASH_ALGORITHM );
+  digest = libspectrum_new( libspectrum_byte, digest_length );
+
+  gcry_md_hash_buffer( HASH_ALGORITHM, digest, signature->start,
+                       signature->length );
+
+  error = libspectrum_verify_digest( digest, digest_length, signature->r,
+                                     signature->s, key );
+
+  libspectrum_free( digest );
+
+  return error;
+}
+
+libspectrum_error
+libspectrum_verify_digest( const libspectrum_byte *digest,
+                           size_t digest_length, gcry_mpi_t r, gcry_mpi_t s,
+                           libspectrum_rzx_dsa_key *key )
 {
   libspectrum_error error;
   gcry_error_t gcrypt_error;
-  gcry_sexp_t hash, key_sexp, signature_sexp;
+  gcry_sexp_t hash, signature_sexp;
+  cached_key_t *key_sexp;
 
-  error = get_hash( &hash, signature->start, signature->length );
+  error = get_hash( &hash, digest, digest_length );
   if( error ) return error;
 
-  error = create_key( &key_sexp, key, 0 );
+  error = get_key( &key_sexp, key );
   if( error ) { gcry_sexp_release( hash ); return error; }
 
-  error = gcry_sexp_build( &signature_sexp, NULL, signature_format,
-			   signature->r, signature->s );
+  error = gcry_sexp_build( &signature_sexp, NULL, signature_format, r, s );
 
   if( error ) {
     libspectrum_print_error(
@@ -317,14 +504,14 @@ libspectrum_verify_signature( libspectrum_signature *signature,
       "create_signature: error building signature sexp: %s",
       gcry_strerror( error )
     );
-    gcry_sexp_release( key_sexp ); gcry_sexp_release( hash );
+    release_key( key_sexp ); gcry_sexp_release( hash );
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 
-  gcrypt_error = gcry_pk_verify( signature_sexp, hash, key_sexp );
+  gcrypt_error = gcry_pk_verify( signature_sexp, hash, key_sexp->sexp );
 
   gcry_sexp_release( signature_sexp );
-  gcry_sexp_release( key_sexp ); gcry_sexp_release( hash );
+  release_key( key_sexp ); gcry_sexp_release( hash );
 
   if( gcrypt_error ) {
     if( gcry_err_code( gcrypt_error ) == GPG_ERR_BAD_SIGNATURE ) {
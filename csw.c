@@ -39,6 +39,9 @@ libspectrum_csw_read( libspectrum_tape *tape,
   libspectrum_tape_rle_pulse_block *csw_block;
 
   int compressed;
+#ifdef HAVE_ZLIB_H
+  size_t pulses = 0;
+#endif				/* #ifdef HAVE_ZLIB_H */
 
   size_t signature_length = strlen( csw_signature );
 
@@ -79,6 +82,13 @@ libspectrum_csw_read( libspectrum_tape *tape,
       buffer[3] <<  8 |
       buffer[4] << 16 |
       buffer[5] << 24;
+#ifdef HAVE_ZLIB_H
+    pulses =
+      buffer[6]       |
+      buffer[7] <<  8 |
+      buffer[8] << 16 |
+      (libspectrum_dword)buffer[9] << 24;
+#endif				/* #ifdef HAVE_ZLIB_H */
     compressed = buffer[10] - 1;
 
     if( compressed != 0 && compressed != 1 ) goto csw_bad_compress;
@@ -111,10 +121,10 @@ libspectrum_csw_read( libspectrum_tape *tape,
 #ifdef HAVE_ZLIB_H
     libspectrum_error error;
 
-    csw_block->data = NULL;
-    csw_block->length = 0;
-    error = libspectrum_zlib_inflate( buffer, length, &csw_block->data,
-                                      &csw_block->length );
+    /* Each pulse takes at least one byte */
+    error = libspectrum_zlib_inflate_hinted( buffer, length, &csw_block->data,
+                                             &csw_block->length,
+                                             pulses );
     if( error != LIBSPECTRUM_ERROR_NONE ) return error;
 #else
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
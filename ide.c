@@ -28,8 +28,39 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <time.h>
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif				/* #ifdef HAVE_SYS_TIME_H */
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif				/* #ifdef HAVE_UNISTD_H */
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif				/* #ifdef HAVE_MMAP */
+
 #include "internals.h"
 
+/* Offsets into image files. These are 64 bits wide wherever the platform
+   allows, so images bigger than 2 Gb work on 32-bit hosts as well */
+#if defined( HAVE_PREAD ) && defined( HAVE_PWRITE )
+typedef off_t file_offset;
+#define POSITIONAL_IO 1
+#elif defined( HAVE_FSEEKO )
+typedef off_t file_offset;
+#define seek_file fseeko
+#elif defined( HAVE__FSEEKI64 )
+typedef __int64 file_offset;
+#define seek_file _fseeki64
+#else
+typedef long file_offset;
+#define seek_file fseek
+#endif
+
 typedef enum libspectrum_ide_command {
   
   LIBSPECTRUM_IDE_COMMAND_READ_SECTOR_RETRY = 0x20,
@@ -39,6 +70,9 @@ typedef enum libspectrum_ide_command {
   LIBSPECTRUM_IDE_COMMAND_IDENTIFY_DRIVE_ATA = 0xec,
   LIBSPECTRUM_IDE_COMMAND_IDENTIFY_DRIVE_ATAPI = 0xa1,
   LIBSPECTRUM_IDE_COMMAND_INITIALIZE_DEVICE_PARAMETERS = 0x91,
+  LIBSPECTRUM_IDE_COMMAND_READ_MULTIPLE = 0xc4,
+  LIBSPECTRUM_IDE_COMMAND_WRITE_MULTIPLE = 0xc5,
+  LIBSPECTRUM_IDE_COMMAND_SET_MULTIPLE_MODE = 0xc6,
 
 } libspectrum_ide_command;
 
@@ -81,6 +115,7 @@ typedef enum libspectrum_ide_identityfield {
   LIBSPECTRUM_IDE_IDENTITY_NUM_CYLINDERS = 1,
   LIBSPECTRUM_IDE_IDENTITY_NUM_HEADS = 3,
   LIBSPECTRUM_IDE_IDENTITY_NUM_SECTORS = 6,
+  LIBSPECTRUM_IDE_IDENTITY_MAX_MULTIPLE = 47,
   LIBSPECTRUM_IDE_IDENTITY_CAPABILITIES = 49,
   LIBSPECTRUM_IDE_IDENTITY_FIELD_VALIDITY = 53,
   LIBSPECTRUM_IDE_IDENTITY_CURRENT_CYLINDERS = 54,
@@ -88,11 +123,71 @@ typedef enum libspectrum_ide_identityfield {
   LIBSPECTRUM_IDE_IDENTITY_CURRENT_SECTORS = 56,
   LIBSPECTRUM_IDE_IDENTITY_CURRENT_CAPACITY_LOW = 57,
   LIBSPECTRUM_IDE_IDENTITY_CURRENT_CAPACITY_HI = 58,
+  LIBSPECTRUM_IDE_IDENTITY_CURRENT_MULTIPLE = 59,
   LIBSPECTRUM_IDE_IDENTITY_TOTAL_SECTORS_LOW = 60,
   LIBSPECTRUM_IDE_IDENTITY_TOTAL_SECTORS_HI = 61,
 
 } libspectrum_ide_identityfield;
 
+/* The write cache stores the packed data for each dirty sector in
+   fixed-size slots carved out of larger slabs, indexed by a three level
+   radix tree on the sector number. This keeps lookups cheap and lets
+   commits walk the dirty sectors in ascending order */
+#define CACHE_LEAF_BITS 10
+#define CACHE_MID_BITS 11
+#define CACHE_TOP_BITS 11
+
+#define CACHE_LEAF_SIZE ( 1 << CACHE_LEAF_BITS )
+#define CACHE_MID_SIZE ( 1 << CACHE_MID_BITS )
+#define CACHE_TOP_SIZE ( 1 << CACHE_TOP_BITS )
+
+/* Every slot is big enough for an unpacked sector */
+#define CACHE_SLOT_SIZE 512
+#define CACHE_SLAB_SLOTS 64
+
+/* The maximum number of sectors written in one go by a commit */
+#define CACHE_MAX_RUN 128
+
+typedef struct cache_leaf {
+  libspectrum_byte *sectors[ CACHE_LEAF_SIZE ];
+} cache_leaf;
+
+typedef struct cache_slab {
+  struct cache_slab *next;
+  libspectrum_byte slots[ CACHE_SLAB_SLOTS ][ CACHE_SLOT_SIZE ];
+} cache_slab;
+
+struct libspectrum_ide_cache {
+
+  /* Radix tree: top level -> mid level -> leaf -> sector data */
+  cache_leaf **index[ CACHE_TOP_SIZE ];
+
+  /* Number of dirty sectors */
+  size_t count;
+
+  /* All slabs allocated, most recent first, and how many slots of the
+     most recent one have been handed out */
+  cache_slab *slabs;
+  size_t slab_used;
+
+  /* Slots which have been released; the first bytes of each free slot
+     point to the next one */
+  libspectrum_byte *free_slots;
+
+};
+
+/* The most sectors transferred per block by READ/WRITE MULTIPLE */
+#define IDE_MAX_MULTIPLE 16
+
+/* Copy-on-write overlay files start with a header giving the signature,
+   version, sector size, sector count and the offset of the sector data,
+   followed by a bitmap of the sectors present in the overlay. Sector data
+   is stored at its natural offset so the file stays sparse */
+#define OVERLAY_SIGNATURE "LSOVRLY\x1a"
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_LENGTH 32
+#define OVERLAY_DATA_ALIGNMENT 4096
+
 /* Operations on identity fields.
    For reasons best known to Ramsoft, these (together with the disk
    data itself) are stored in Intel little-endian format rather than
@@ -127,31 +222,87 @@ struct libspectrum_ide_channel {
   /* Channel status */
   libspectrum_ide_phase phase;
   int datacounter;
+
+  /* Sectors per block as set by SET MULTIPLE MODE for each drive, or 0 if
+     multiple mode is disabled */
+  int multiple_count[2];
+
+  /* Most sectors per block for the current command, and number of sectors
+     in the current block */
+  int command_multiple;
+  int block_sectors;
   
-  /* Sector buffer */
-  libspectrum_byte buffer[512];
-  int sector_number;
+  /* Sector buffer, big enough for a whole block */
+  libspectrum_byte buffer[ 512 * IDE_MAX_MULTIPLE ];
+  libspectrum_dword sector_number;
 
   /* One write cache for each drive */
-  GHashTable *cache[2];
+  libspectrum_ide_cache *cache[2];
 
 };
 
+/* Take the drive's lock if a background commit is running; see the
+   description of `flushing' in internals.h */
+#ifdef HAVE_PTHREAD_H
+#define lock_drive( drv ) \
+  do { if( (drv)->flushing ) pthread_mutex_lock( &(drv)->lock ); } while( 0 )
+#define unlock_drive( drv ) \
+  do { if( (drv)->flushing ) pthread_mutex_unlock( &(drv)->lock ); } while( 0 )
+#else				/* #ifdef HAVE_PTHREAD_H */
+#define lock_drive( drv )
+#define unlock_drive( drv )
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
 /* Private function prototypes */
-static gboolean write_to_disk( gpointer key, gpointer value,
-  gpointer user_data );
-static gboolean clear_cache( gpointer key, gpointer value,
-  gpointer user_data GCC_UNUSED );
-static int read_hdf( libspectrum_ide_channel *chn );
-static int write_hdf( libspectrum_ide_channel *chn );
+static libspectrum_byte* cache_lookup( libspectrum_ide_cache *cache,
+  libspectrum_dword sector_number );
+static libspectrum_byte* cache_insert( libspectrum_ide_cache *cache,
+  libspectrum_dword sector_number );
+static void cache_remove( libspectrum_ide_cache *cache,
+  libspectrum_dword sector_number );
+static void cache_clear( libspectrum_ide_cache *cache );
+#ifdef HAVE_PTHREAD_H
+static void cache_merge( libspectrum_ide_cache *dest,
+  libspectrum_ide_cache *src );
+#endif				/* #ifdef HAVE_PTHREAD_H */
+static void commit_cache( libspectrum_ide_drive *drv,
+  libspectrum_ide_cache *cache );
+static int write_run( libspectrum_ide_drive *drv,
+  libspectrum_ide_cache *cache, libspectrum_dword start, size_t count,
+  const libspectrum_byte *buffer );
+static libspectrum_error open_overlay( libspectrum_ide_drive *drv,
+  const char *filename );
+static void close_overlay( libspectrum_ide_drive *drv );
+static int in_overlay( libspectrum_ide_drive *drv,
+  libspectrum_dword sector_number );
+static void write_overlay_map( libspectrum_ide_drive *drv,
+  libspectrum_dword first, libspectrum_dword last );
+static double current_time( void );
+static int read_at( FILE *f, file_offset offset, libspectrum_byte *buffer,
+  size_t length );
+static int write_at( FILE *f, file_offset offset,
+  const libspectrum_byte *buffer, size_t length );
+static void map_hdf( libspectrum_ide_drive *drv );
+static void unmap_hdf( libspectrum_ide_drive *drv );
+static const libspectrum_byte* read_packed_sector(
+  libspectrum_ide_drive *drv, libspectrum_dword sector_number,
+  libspectrum_byte *buffer );
+static int read_hdf( libspectrum_ide_channel *chn, libspectrum_byte *dest );
+static int write_hdf( libspectrum_ide_channel *chn, libspectrum_byte *src );
 static libspectrum_byte read_data( libspectrum_ide_channel *chn );
+static void read_data_done( libspectrum_ide_channel *chn );
 static void write_data( libspectrum_ide_channel *chn,
   libspectrum_byte data );
+static void write_data_done( libspectrum_ide_channel *chn );
 static libspectrum_error seek( libspectrum_ide_channel *chn );
 static void identifydevice( libspectrum_ide_channel *chn );
+static void abort_transfer( libspectrum_ide_channel *chn );
+static void start_block( libspectrum_ide_channel *chn );
 static void readsector( libspectrum_ide_channel *chn );
 static void writesector( libspectrum_ide_channel *chn );
+static void multiple_command( libspectrum_ide_channel *chn, int write );
 static void init_device_params( libspectrum_ide_channel *chn );
+static void set_multiple_mode( libspectrum_ide_channel *chn );
 static void execute_command( libspectrum_ide_channel *chn,
   libspectrum_byte data );
 
@@ -165,13 +316,13 @@ libspectrum_ide_alloc( libspectrum_ide_databus databus )
   channel = libspectrum_new( libspectrum_ide_channel, 1 );
 
   channel->databus = databus;
-  channel->drive[ LIBSPECTRUM_IDE_MASTER ].disk = NULL;
-  channel->drive[ LIBSPECTRUM_IDE_SLAVE  ].disk = NULL;
+  libspectrum_ide_init_drive( &channel->drive[ LIBSPECTRUM_IDE_MASTER ] );
+  libspectrum_ide_init_drive( &channel->drive[ LIBSPECTRUM_IDE_SLAVE  ] );
+  channel->multiple_count[ LIBSPECTRUM_IDE_MASTER ] = 0;
+  channel->multiple_count[ LIBSPECTRUM_IDE_SLAVE  ] = 0;
 
-  channel->cache[ LIBSPECTRUM_IDE_MASTER ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
-  channel->cache[ LIBSPECTRUM_IDE_SLAVE  ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
+  channel->cache[ LIBSPECTRUM_IDE_MASTER ] = libspectrum_ide_cache_alloc();
+  channel->cache[ LIBSPECTRUM_IDE_SLAVE  ] = libspectrum_ide_cache_alloc();
 
   return channel;
 }
@@ -184,8 +335,8 @@ libspectrum_ide_free( libspectrum_ide_channel *chn )
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_SLAVE  );
 
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_MASTER ] );
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_SLAVE  ] );
+  libspectrum_ide_cache_free( chn->cache[ LIBSPECTRUM_IDE_MASTER ] );
+  libspectrum_ide_cache_free( chn->cache[ LIBSPECTRUM_IDE_SLAVE  ] );
   
   /* Free the channel structure */
   libspectrum_free( chn );
@@ -193,15 +344,28 @@ libspectrum_ide_free( libspectrum_ide_channel *chn )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Initialise an empty drive */
+void
+libspectrum_ide_init_drive( libspectrum_ide_drive *drv )
+{
+  drv->disk = NULL;
+  memset( &drv->stats, 0, sizeof( drv->stats ) );
+#ifdef HAVE_PTHREAD_H
+  drv->flushing = NULL;
+#endif				/* #ifdef HAVE_PTHREAD_H */
+}
+
 libspectrum_error
 libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
-                                   const char *filename )
+                                   const char *filename,
+                                   const char *overlay_filename )
 {
   FILE *f;
   size_t l;
+  libspectrum_error error;
 
-  /* Open the file */
-  f = fopen( filename, "rb+" );
+  /* Open the file; it is never written to if there's an overlay */
+  f = fopen( filename, overlay_filename ? "rb" : "rb+" );
   if( !f ) {
     libspectrum_print_error(
       LIBSPECTRUM_ERROR_UNKNOWN,
@@ -238,6 +402,8 @@ libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
   drv->data_offset =
     ( drv->hdf.datastart_hi << 8 ) | ( drv->hdf.datastart_low );
   drv->sector_size = ( drv->hdf.flags & 0x01 ) ? 256 : 512;
+
+  map_hdf( drv );
   
   /* Extract drive geometry from the drive identity command */
   drv->cylinders = GET_WORD(
@@ -246,52 +412,641 @@ libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_HEADS );
   drv->sectors = GET_WORD(
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_SECTORS );
+
+  drv->overlay = NULL;
+  drv->overlay_map = NULL;
+
+  memset( &drv->stats, 0, sizeof( drv->stats ) );
+
+  if( overlay_filename ) {
+    error = open_overlay( drv, overlay_filename );
+    if( error ) {
+      unmap_hdf( drv );
+      fclose( drv->disk );
+      drv->disk = NULL;
+      return error;
+    }
+  }
   
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Open a copy-on-write overlay for a drive, creating it if necessary */
+static libspectrum_error
+open_overlay( libspectrum_ide_drive *drv, const char *filename )
+{
+  libspectrum_byte header[ OVERLAY_HEADER_LENGTH ], *ptr;
+  const libspectrum_byte *cptr;
+  size_t map_length, l;
+  FILE *f;
+
+  drv->overlay_sectors = (libspectrum_dword)drv->cylinders * drv->heads *
+                         drv->sectors;
+  map_length = ( drv->overlay_sectors + 7 ) / 8;
+  drv->overlay_data_offset =
+    ( OVERLAY_HEADER_LENGTH + map_length + OVERLAY_DATA_ALIGNMENT - 1 ) &
+    ~( OVERLAY_DATA_ALIGNMENT - 1 );
+
+  f = fopen( filename, "rb+" );
+  if( !f && errno == ENOENT ) f = fopen( filename, "wb+" );
+  if( !f ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_ide_insert: unable to open overlay file '%s': %s",
+      filename, strerror( errno )
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  drv->overlay_map = libspectrum_new0( libspectrum_byte, map_length );
+
+  l = fread( header, 1, OVERLAY_HEADER_LENGTH, f );
+
+  if( l == 0 && feof( f ) ) {
+
+    /* A new overlay: write the header and an empty sector map */
+    memset( header, 0, OVERLAY_HEADER_LENGTH );
+    memcpy( header, OVERLAY_SIGNATURE, 8 );
+    ptr = &header[8];
+    libspectrum_write_word( &ptr, OVERLAY_VERSION );
+    libspectrum_write_word( &ptr, drv->sector_size );
+    libspectrum_write_dword( &ptr, drv->overlay_sectors );
+    libspectrum_write_dword( &ptr, drv->overlay_data_offset );
+
+    if( fseek( f, 0, SEEK_SET ) ||
+        fwrite( header, 1, OVERLAY_HEADER_LENGTH, f ) !=
+          OVERLAY_HEADER_LENGTH ||
+        fwrite( drv->overlay_map, 1, map_length, f ) != map_length ||
+        fflush( f ) ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_UNKNOWN,
+        "libspectrum_ide_insert: unable to write overlay file '%s'", filename
+      );
+      goto error;
+    }
+
+  } else {
+
+    /* An existing overlay: check it matches this disk */
+    cptr = &header[8];
+    if( l != OVERLAY_HEADER_LENGTH ||
+        memcmp( header, OVERLAY_SIGNATURE, 8 ) ||
+        libspectrum_read_word( &cptr ) != OVERLAY_VERSION ||
+        libspectrum_read_word( &cptr ) != drv->sector_size ||
+        libspectrum_read_dword( &cptr ) != drv->overlay_sectors ||
+        libspectrum_read_dword( &cptr ) != drv->overlay_data_offset ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "libspectrum_ide_insert: '%s' is not an overlay for this disk",
+        filename
+      );
+      fclose( f );
+      libspectrum_free( drv->overlay_map );
+      drv->overlay_map = NULL;
+      return LIBSPECTRUM_ERROR_CORRUPT;
+    }
+
+    if( fread( drv->overlay_map, 1, map_length, f ) != map_length ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_CORRUPT,
+        "libspectrum_ide_insert: unable to read sector map from '%s'",
+        filename
+      );
+      goto error;
+    }
+
+  }
+
+  drv->overlay = f;
+
+  return LIBSPECTRUM_ERROR_NONE;
+
+error:
+  fclose( f );
+  libspectrum_free( drv->overlay_map );
+  drv->overlay_map = NULL;
+  return LIBSPECTRUM_ERROR_UNKNOWN;
+}
+
+static void
+close_overlay( libspectrum_ide_drive *drv )
+{
+  if( !drv->overlay ) return;
+
+  fclose( drv->overlay );
+  drv->overlay = NULL;
+
+  libspectrum_free( drv->overlay_map );
+  drv->overlay_map = NULL;
+}
+
+/* Is this sector stored in the drive's overlay? */
+static int
+in_overlay( libspectrum_ide_drive *drv, libspectrum_dword sector_number )
+{
+  return drv->overlay && sector_number < drv->overlay_sectors &&
+         ( drv->overlay_map[ sector_number >> 3 ] &
+           ( 1 << ( sector_number & 7 ) ) );
+}
+
 /* Insert a hard disk into a drive */
 libspectrum_error
 libspectrum_ide_insert( libspectrum_ide_channel *chn,
 			libspectrum_ide_unit unit,
                         const char *filename )
+{
+  return libspectrum_ide_insert_overlay( chn, unit, filename, NULL );
+}
+
+/* Insert a hard disk into a drive, storing any changes in an overlay
+   file rather than the disk image itself */
+libspectrum_error
+libspectrum_ide_insert_overlay( libspectrum_ide_channel *chn,
+                                libspectrum_ide_unit unit,
+                                const char *filename,
+                                const char *overlay_filename )
 {
   libspectrum_ide_drive *drv = &chn->drive[unit];
 
   libspectrum_ide_eject( chn, unit );
+  chn->multiple_count[ unit ] = 0;
   if ( !filename ) return LIBSPECTRUM_ERROR_NONE;
 
-  return libspectrum_ide_insert_into_drive( drv, filename );
+  return libspectrum_ide_insert_into_drive( drv, filename, overlay_filename );
+}
+
+/* Read `length' bytes from `offset' in `f'. Anything beyond the end of the
+   file reads as zeros, so images need only be as long as the data which
+   has actually been written to them */
+static int
+read_at( FILE *f, file_offset offset, libspectrum_byte *buffer,
+         size_t length )
+{
+#ifdef POSITIONAL_IO
+  ssize_t l;
+
+  while( length ) {
+    l = pread( fileno( f ), buffer, length, offset );
+    if( l < 0 ) {
+      if( errno == EINTR ) continue;
+      return 1;
+    }
+    if( !l ) break;
+    buffer += l; offset += l; length -= l;
+  }
+#else				/* #ifdef POSITIONAL_IO */
+  size_t l;
+
+  if( seek_file( f, offset, SEEK_SET ) ) return 1;
+
+  l = fread( buffer, 1, length, f );
+  if( l != length && ferror( f ) ) return 1;
+  buffer += l; length -= l;
+#endif				/* #ifdef POSITIONAL_IO */
+
+  memset( buffer, 0, length );
+
+  return 0;
+}
+
+/* Write `length' bytes at `offset' in `f'. Writing past the end of the file
+   leaves a hole which the filesystem need not allocate */
+static int
+write_at( FILE *f, file_offset offset, const libspectrum_byte *buffer,
+          size_t length )
+{
+#ifdef POSITIONAL_IO
+  ssize_t l;
+
+  while( length ) {
+    l = pwrite( fileno( f ), buffer, length, offset );
+    if( l < 0 ) {
+      if( errno == EINTR ) continue;
+      return 1;
+    }
+    buffer += l; offset += l; length -= l;
+  }
+
+  return 0;
+#else				/* #ifdef POSITIONAL_IO */
+  if( seek_file( f, offset, SEEK_SET ) ) return 1;
+
+  if( fwrite( buffer, 1, length, f ) != length ) return 1;
+
+  return 0;
+#endif				/* #ifdef POSITIONAL_IO */
 }
 
-static gboolean
-write_to_disk( gpointer key, gpointer value, gpointer user_data )
+/* Map the whole HDF file into memory so sectors can be read without going
+   through stdio. Failure is not an error: the drive just falls back to
+   reading via `drv->disk' */
+static void
+map_hdf( libspectrum_ide_drive *drv )
 {
-  guint sector_number = *(guint*)key;
-  libspectrum_byte *buffer = value;
-  libspectrum_ide_drive *drv = user_data;
+#ifdef HAVE_MMAP
+  struct stat buf;
+  void *map;
 
-  long sector_position;
+  drv->map = NULL;
+  drv->map_length = 0;
 
-  sector_position = drv->data_offset + ( drv->sector_size * sector_number );
+  if( fstat( fileno( drv->disk ), &buf ) || buf.st_size <= 0 ) return;
 
-  if( fseek( drv->disk, sector_position, SEEK_SET ) )
-    return FALSE;
+  /* Too big for the address space; just use `drv->disk' */
+  if( (off_t)(size_t)buf.st_size != buf.st_size ) return;
 
-  if( fwrite( buffer, 1, drv->sector_size, drv->disk ) != drv->sector_size )
-    return FALSE;
+  map = mmap( NULL, buf.st_size, PROT_READ, MAP_SHARED,
+              fileno( drv->disk ), 0 );
+  if( map == MAP_FAILED ) return;
 
-  libspectrum_free( key ); libspectrum_free( value );
+  drv->map = map;
+  drv->map_length = buf.st_size;
+#endif				/* #ifdef HAVE_MMAP */
+}
 
-  return TRUE;	/* TRUE => remove key/value pair from hash */
+static void
+unmap_hdf( libspectrum_ide_drive *drv )
+{
+#ifdef HAVE_MMAP
+  if( !drv->map ) return;
+
+  munmap( drv->map, drv->map_length );
+  drv->map = NULL;
+  drv->map_length = 0;
+#endif				/* #ifdef HAVE_MMAP */
+}
+
+libspectrum_ide_cache*
+libspectrum_ide_cache_alloc( void )
+{
+  return libspectrum_new0( libspectrum_ide_cache, 1 );
 }
 
 void
-libspectrum_ide_commit_drive( libspectrum_ide_drive *drv, GHashTable *cache )
+libspectrum_ide_cache_free( libspectrum_ide_cache *cache )
 {
-  if( !drv->disk ) return;
+  cache_clear( cache );
+  libspectrum_free( cache );
+}
+
+/* The number of dirty sectors in the cache */
+size_t
+libspectrum_ide_cache_size( libspectrum_ide_cache *cache )
+{
+  return cache->count;
+}
+
+static libspectrum_byte*
+cache_lookup( libspectrum_ide_cache *cache, libspectrum_dword sector_number )
+{
+  cache_leaf **mid, *leaf;
+
+  mid = cache->index[ sector_number >> ( CACHE_LEAF_BITS + CACHE_MID_BITS ) ];
+  if( !mid ) return NULL;
+
+  leaf = mid[ ( sector_number >> CACHE_LEAF_BITS ) & ( CACHE_MID_SIZE - 1 ) ];
+  if( !leaf ) return NULL;
+
+  return leaf->sectors[ sector_number & ( CACHE_LEAF_SIZE - 1 ) ];
+}
+
+/* Get the slot for a sector, adding it to the cache if necessary */
+static libspectrum_byte*
+cache_insert( libspectrum_ide_cache *cache, libspectrum_dword sector_number )
+{
+  cache_leaf ***mid, **leaf;
+  libspectrum_byte **slot;
+
+  mid = &cache->index[ sector_number >> ( CACHE_LEAF_BITS + CACHE_MID_BITS ) ];
+  if( !*mid ) *mid = libspectrum_new0( cache_leaf*, CACHE_MID_SIZE );
+
+  leaf =
+    &(*mid)[ ( sector_number >> CACHE_LEAF_BITS ) & ( CACHE_MID_SIZE - 1 ) ];
+  if( !*leaf ) *leaf = libspectrum_new0( cache_leaf, 1 );
+
+  slot = &(*leaf)->sectors[ sector_number & ( CACHE_LEAF_SIZE - 1 ) ];
+  if( *slot ) return *slot;
+
+  if( cache->free_slots ) {
+    *slot = cache->free_slots;
+    memcpy( &cache->free_slots, *slot, sizeof( cache->free_slots ) );
+  } else {
+    if( !cache->slabs || cache->slab_used == CACHE_SLAB_SLOTS ) {
+      cache_slab *slab = libspectrum_new( cache_slab, 1 );
+      slab->next = cache->slabs;
+      cache->slabs = slab;
+      cache->slab_used = 0;
+    }
+    *slot = cache->slabs->slots[ cache->slab_used++ ];
+  }
+
+  cache->count++;
+
+  return *slot;
+}
+
+/* Remove a sector from the cache, returning its slot to the free list */
+static void
+cache_remove( libspectrum_ide_cache *cache, libspectrum_dword sector_number )
+{
+  cache_leaf **mid, *leaf;
+  libspectrum_byte **slot;
+
+  mid = cache->index[ sector_number >> ( CACHE_LEAF_BITS + CACHE_MID_BITS ) ];
+  if( !mid ) return;
+
+  leaf = mid[ ( sector_number >> CACHE_LEAF_BITS ) & ( CACHE_MID_SIZE - 1 ) ];
+  if( !leaf ) return;
+
+  slot = &leaf->sectors[ sector_number & ( CACHE_LEAF_SIZE - 1 ) ];
+  if( !*slot ) return;
+
+  memcpy( *slot, &cache->free_slots, sizeof( cache->free_slots ) );
+  cache->free_slots = *slot;
+  *slot = NULL;
+
+  cache->count--;
+}
+
+/* Empty the cache and free all the memory it uses */
+static void
+cache_clear( libspectrum_ide_cache *cache )
+{
+  size_t i, j;
+
+  for( i = 0; i < CACHE_TOP_SIZE; i++ ) {
+    if( !cache->index[i] ) continue;
+    for( j = 0; j < CACHE_MID_SIZE; j++ ) libspectrum_free( cache->index[i][j] );
+    libspectrum_free( cache->index[i] );
+    cache->index[i] = NULL;
+  }
+
+  while( cache->slabs ) {
+    cache_slab *next = cache->slabs->next;
+    libspectrum_free( cache->slabs );
+    cache->slabs = next;
+  }
+
+  cache->slab_used = 0;
+  cache->free_slots = NULL;
+  cache->count = 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Copy every sector in `src' into `dest', except those `dest' already has a
+   newer copy of */
+static void
+cache_merge( libspectrum_ide_cache *dest, libspectrum_ide_cache *src )
+{
+  libspectrum_dword sector_number;
+  size_t i, j, k;
+
+  for( i = 0; i < CACHE_TOP_SIZE; i++ ) {
+    if( !src->index[i] ) continue;
+    for( j = 0; j < CACHE_MID_SIZE; j++ ) {
+      cache_leaf *leaf = src->index[i][j];
+      if( !leaf ) continue;
+      for( k = 0; k < CACHE_LEAF_SIZE; k++ ) {
+        if( !leaf->sectors[k] ) continue;
+
+        sector_number = ( i << ( CACHE_LEAF_BITS + CACHE_MID_BITS ) ) |
+                        ( j << CACHE_LEAF_BITS ) | k;
+        if( cache_lookup( dest, sector_number ) ) continue;
+
+        memcpy( cache_insert( dest, sector_number ), leaf->sectors[k], 512 );
+      }
+    }
+  }
+}
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+/* A wall clock time in seconds, used to time commits */
+static double
+current_time( void )
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else				/* #ifdef HAVE_GETTIMEOFDAY */
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif				/* #ifdef HAVE_GETTIMEOFDAY */
+}
+
+/* Write `count' contiguous sectors starting at `start' to the disk image,
+   or its overlay if it has one, and remove them from the cache */
+static int
+write_run( libspectrum_ide_drive *drv, libspectrum_ide_cache *cache,
+           libspectrum_dword start, size_t count,
+           const libspectrum_byte *buffer )
+{
+  FILE *f = drv->disk;
+  file_offset sector_position;
+  size_t length = count * drv->sector_size, i;
+
+  sector_position =
+    drv->data_offset + (file_offset)drv->sector_size * start;
+
+  if( drv->overlay ) {
+    if( start + count > drv->overlay_sectors ) return 1;
+    f = drv->overlay;
+    sector_position =
+      drv->overlay_data_offset + (file_offset)drv->sector_size * start;
+  }
+
+  if( write_at( f, sector_position, buffer, length ) ) return 1;
+
+  drv->stats.bytes_flushed += length;
+
+  for( i = 0; i < count; i++ ) {
+    cache_remove( cache, start + i );
+    if( drv->overlay )
+      drv->overlay_map[ ( start + i ) >> 3 ] |= 1 << ( ( start + i ) & 7 );
+  }
+
+  return 0;
+}
+
+/* Write the part of an overlay's sector map covering the given sectors */
+static void
+write_overlay_map( libspectrum_ide_drive *drv, libspectrum_dword first,
+                   libspectrum_dword last )
+{
+  size_t offset = first >> 3, length = ( last >> 3 ) - offset + 1;
+
+  write_at( drv->overlay, OVERLAY_HEADER_LENGTH + offset,
+            &drv->overlay_map[ offset ], length );
+}
+
+/* Write out all the sectors in `cache'. This may run on a background
+   thread, in which case `cache' is the drive's `flushing' cache */
+static void
+commit_cache( libspectrum_ide_drive *drv, libspectrum_ide_cache *cache )
+{
+  libspectrum_byte *run;
+  libspectrum_dword start = 0, sector_number, first = 0, last = 0;
+  size_t run_length = 0, i, j, k;
+  int any = 0;
+  double started;
+
+  if( !drv->disk || !cache->count ) return;
+
+  started = current_time();
+
+  run = libspectrum_new( libspectrum_byte, CACHE_MAX_RUN * drv->sector_size );
+
+  /* Walk the dirty sectors in ascending order, gathering contiguous sectors
+     so each run is written with a single seek and write. Sectors which
+     can't be written stay in the cache */
+  for( i = 0; i < CACHE_TOP_SIZE; i++ ) {
+    if( !cache->index[i] ) continue;
+    for( j = 0; j < CACHE_MID_SIZE; j++ ) {
+      cache_leaf *leaf = cache->index[i][j];
+      if( !leaf ) continue;
+      for( k = 0; k < CACHE_LEAF_SIZE; k++ ) {
+        if( !leaf->sectors[k] ) continue;
+
+        sector_number = ( i << ( CACHE_LEAF_BITS + CACHE_MID_BITS ) ) |
+                        ( j << CACHE_LEAF_BITS ) | k;
+
+        if( run_length &&
+            ( sector_number != start + run_length ||
+              run_length == CACHE_MAX_RUN ) ) {
+          lock_drive( drv );
+          write_run( drv, cache, start, run_length, run );
+          unlock_drive( drv );
+          run_length = 0;
+        }
+
+        if( !run_length ) start = sector_number;
+        memcpy( &run[ run_length++ * drv->sector_size ], leaf->sectors[k],
+                drv->sector_size );
+
+        if( !any ) first = sector_number;
+        last = sector_number;
+        any = 1;
+      }
+    }
+  }
+
+  lock_drive( drv );
+
+  if( run_length ) write_run( drv, cache, start, run_length, run );
 
-  g_hash_table_foreach_remove( cache, write_to_disk, drv );
+  libspectrum_free( run );
+
+  if( drv->overlay ) {
+    /* Record which sectors are now in the overlay once their data is
+       there */
+    fflush( drv->overlay );
+    write_overlay_map( drv, first, last );
+    fflush( drv->overlay );
+  } else {
+    /* Make sure the written data is visible through the mapping */
+    fflush( drv->disk );
+  }
+
+  /* Release the cache's memory once everything has been written */
+  if( !cache->count ) cache_clear( cache );
+
+  drv->stats.commits++;
+  drv->stats.commit_time += current_time() - started;
+
+  unlock_drive( drv );
+}
+
+void
+libspectrum_ide_commit_drive( libspectrum_ide_drive *drv,
+                              libspectrum_ide_cache *cache )
+{
+  libspectrum_ide_wait_drive( drv, cache );
+  commit_cache( drv, cache );
+}
+
+#ifdef HAVE_PTHREAD_H
+static void*
+flush_thread( void *data )
+{
+  libspectrum_ide_drive *drv = data;
+
+  commit_cache( drv, drv->flushing );
+
+  pthread_mutex_lock( &drv->lock );
+  drv->flush_done = 1;
+  pthread_mutex_unlock( &drv->lock );
+
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+/* Start writing out the sectors in `*cache' on a background thread, leaving
+   an empty cache in its place for further writes. Without thread support,
+   or if a thread can't be started, the sectors are written straight away */
+void
+libspectrum_ide_commit_drive_async( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_cache **cache )
+{
+#ifdef HAVE_PTHREAD_H
+  libspectrum_ide_wait_drive( drv, *cache );
+
+  if( !drv->disk || !libspectrum_ide_cache_size( *cache ) ) return;
+
+  pthread_mutex_init( &drv->lock, NULL );
+  drv->flush_done = 0;
+  drv->flushing = *cache;
+  *cache = libspectrum_ide_cache_alloc();
+
+  if( pthread_create( &drv->flush_thread, NULL, flush_thread, drv ) ) {
+    libspectrum_ide_cache_free( *cache );
+    *cache = drv->flushing;
+    drv->flushing = NULL;
+    pthread_mutex_destroy( &drv->lock );
+    commit_cache( drv, *cache );
+  }
+#else				/* #ifdef HAVE_PTHREAD_H */
+  commit_cache( drv, *cache );
+#endif				/* #ifdef HAVE_PTHREAD_H */
+}
+
+/* Wait for any background commit to finish. Sectors it couldn't write are
+   returned to `cache' unless they have been written again since */
+void
+libspectrum_ide_wait_drive( libspectrum_ide_drive *drv,
+                            libspectrum_ide_cache *cache )
+{
+#ifdef HAVE_PTHREAD_H
+  if( !drv->flushing ) return;
+
+  pthread_join( drv->flush_thread, NULL );
+
+  cache_merge( cache, drv->flushing );
+  libspectrum_ide_cache_free( drv->flushing );
+  drv->flushing = NULL;
+  pthread_mutex_destroy( &drv->lock );
+#endif				/* #ifdef HAVE_PTHREAD_H */
+}
+
+/* Is there any data for this drive which isn't yet safely on disk? */
+int
+libspectrum_ide_dirty_drive( libspectrum_ide_drive *drv,
+                             libspectrum_ide_cache *cache )
+{
+#ifdef HAVE_PTHREAD_H
+  int done;
+
+  if( drv->flushing ) {
+    pthread_mutex_lock( &drv->lock );
+    done = drv->flush_done;
+    pthread_mutex_unlock( &drv->lock );
+
+    if( !done ) return 1;
+
+    libspectrum_ide_wait_drive( drv, cache );
+  }
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  return libspectrum_ide_cache_size( cache ) != 0;
 }
 
 /* Commit any pending writes to disk */
@@ -304,12 +1059,25 @@ libspectrum_ide_commit( libspectrum_ide_channel *chn,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-static gboolean
-clear_cache( gpointer key, gpointer value, gpointer user_data GCC_UNUSED )
+/* Start committing any pending writes to disk in the background */
+libspectrum_error
+libspectrum_ide_commit_async( libspectrum_ide_channel *chn,
+                              libspectrum_ide_unit unit )
 {
-  libspectrum_free( key );
-  libspectrum_free( value );
-  return TRUE;
+  libspectrum_ide_commit_drive_async( &chn->drive[ unit ],
+                                      &chn->cache[ unit ] );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Wait for a background commit to finish */
+libspectrum_error
+libspectrum_ide_commit_wait( libspectrum_ide_channel *chn,
+                             libspectrum_ide_unit unit )
+{
+  libspectrum_ide_wait_drive( &chn->drive[ unit ], chn->cache[ unit ] );
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 /* Is there any dirty data for this disk? */
@@ -317,20 +1085,51 @@ int
 libspectrum_ide_dirty( libspectrum_ide_channel *chn,
 		       libspectrum_ide_unit unit )
 {
-  return g_hash_table_size( chn->cache[ unit ] ) != 0;
+  return libspectrum_ide_dirty_drive( &chn->drive[ unit ], chn->cache[ unit ] );
+}
+
+void
+libspectrum_ide_get_drive_stats( libspectrum_ide_drive *drv,
+                                 libspectrum_ide_cache *cache,
+                                 libspectrum_ide_stats *stats )
+{
+  lock_drive( drv );
+
+  *stats = drv->stats;
+  stats->dirty_sectors = libspectrum_ide_cache_size( cache );
+#ifdef HAVE_PTHREAD_H
+  if( drv->flushing )
+    stats->dirty_sectors += libspectrum_ide_cache_size( drv->flushing );
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  unlock_drive( drv );
+}
+
+/* Get the activity counters for a drive */
+void
+libspectrum_ide_get_stats( libspectrum_ide_channel *chn,
+                           libspectrum_ide_unit unit,
+                           libspectrum_ide_stats *stats )
+{
+  libspectrum_ide_get_drive_stats( &chn->drive[ unit ], chn->cache[ unit ],
+                                   stats );
 }
 
 /* Eject a hard disk from a drive and free its cache */
 libspectrum_error
 libspectrum_ide_eject_from_drive( libspectrum_ide_drive *drv,
-                                  GHashTable *cache )
+                                  libspectrum_ide_cache *cache )
 {
   if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
 
+  libspectrum_ide_wait_drive( drv, cache );
+
+  close_overlay( drv );
+  unmap_hdf( drv );
   fclose( drv->disk );
   drv->disk = NULL;
 
-  g_hash_table_foreach_remove( cache, clear_cache, NULL );
+  cache_clear( cache );
   
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -407,43 +1206,89 @@ libspectrum_ide_reset( libspectrum_ide_channel *chn )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Get the packed data for a sector from the disk image. This is a pointer
+   straight into the mapped file if possible; otherwise the sector is read
+   into `buffer' */
+static const libspectrum_byte*
+read_packed_sector( libspectrum_ide_drive *drv,
+                    libspectrum_dword sector_number, libspectrum_byte *buffer )
+{
+  FILE *f = drv->disk;
+  file_offset sector_position;
+
+  if( in_overlay( drv, sector_number ) ) {
+
+    f = drv->overlay;
+    sector_position = drv->overlay_data_offset +
+                      (file_offset)drv->sector_size * sector_number;
+
+  } else {
+
+    sector_position =
+      drv->data_offset + (file_offset)drv->sector_size * sector_number;
+
+#ifdef HAVE_MMAP
+    if( drv->map &&
+        sector_position + drv->sector_size <= (file_offset)drv->map_length )
+      return drv->map + sector_position;
+#endif				/* #ifdef HAVE_MMAP */
+
+  }
+
+  /* Read the packed data into the temporary buffer */
+  if( read_at( f, sector_position, buffer, drv->sector_size ) ) {
+    libspectrum_print_error(
+        LIBSPECTRUM_ERROR_WARNING,
+        "Couldn't read from HDF file\n" );
+    return NULL;
+  }
+
+  return buffer;
+}
+
 int
 libspectrum_ide_read_sector_from_hdf( libspectrum_ide_drive *drv,
-    GHashTable *cache, libspectrum_dword sector_number, libspectrum_byte *dest )
+    libspectrum_ide_cache *cache, libspectrum_dword sector_number, libspectrum_byte *dest )
 {
-  libspectrum_byte *buffer, packed_buf[512];
+  const libspectrum_byte *buffer;
+  libspectrum_byte packed_buf[512];
 
   /* First look in the write cache */
-  buffer = g_hash_table_lookup( cache, &sector_number );
+  buffer = cache_lookup( cache, sector_number );
 
-  /* If it's not in the write cache, read from the disk image */
-  if( !buffer ) {
-
-    long sector_position;
+  if( buffer ) {
+    drv->stats.cache_hits++;
+  } else {
 
-    sector_position =
-      drv->data_offset + ( drv->sector_size * sector_number );
+    lock_drive( drv );
 
-    /* Seek to the correct file position */
-    if( fseek( drv->disk, sector_position, SEEK_SET ) ) {
-      libspectrum_print_error(
-          LIBSPECTRUM_ERROR_WARNING,
-          "Couldn't seek in HDF file\n" );
-      return 1;
+#ifdef HAVE_PTHREAD_H
+    /* Then in the sectors being written out by a background commit; the
+       data has to be copied before the lock is released */
+    if( drv->flushing ) {
+      buffer = cache_lookup( drv->flushing, sector_number );
+      if( buffer ) {
+        memcpy( packed_buf, buffer, drv->sector_size );
+        buffer = packed_buf;
+      }
     }
+#endif				/* #ifdef HAVE_PTHREAD_H */
 
-    /* Read the packed data into a temporary buffer */
-    if ( fread( packed_buf, 1, drv->sector_size, drv->disk ) !=
-	 drv->sector_size                                       ) {
-      libspectrum_print_error(
-          LIBSPECTRUM_ERROR_WARNING,
-          "Couldn't read from HDF file\n" );
-      return 1;
+    /* If it's not in either, read from the disk image */
+    if( buffer ) {
+      drv->stats.cache_hits++;
+    } else {
+      drv->stats.cache_misses++;
+      buffer = read_packed_sector( drv, sector_number, packed_buf );
     }
 
-    buffer = packed_buf;
+    unlock_drive( drv );
+
+    if( !buffer ) return 1;
   }
 
+  drv->stats.sectors_read++;
+
   /* Unpack or copy the data into the sector buffer */
   if( drv->sector_size == 256 ) {
 
@@ -463,33 +1308,23 @@ libspectrum_ide_read_sector_from_hdf( libspectrum_ide_drive *drv,
 
 /* Read a sector from the HDF file */
 static int
-read_hdf( libspectrum_ide_channel *chn )
+read_hdf( libspectrum_ide_channel *chn, libspectrum_byte *dest )
 {
   return libspectrum_ide_read_sector_from_hdf(
       &chn->drive[ chn->selected ], chn->cache[ chn->selected ],
-      chn->sector_number, chn->buffer );
+      chn->sector_number, dest );
 }
 
 void
-libspectrum_ide_write_sector_to_hdf( libspectrum_ide_drive *drv, GHashTable *cache,
-    libspectrum_dword sector_number, libspectrum_byte *src )
+libspectrum_ide_write_sector_to_hdf( libspectrum_ide_drive *drv,
+    libspectrum_ide_cache *cache, libspectrum_dword sector_number,
+    libspectrum_byte *src )
 {
   libspectrum_byte *buffer;
 
-  buffer = g_hash_table_lookup( cache, &sector_number );
-
   /* Add this sector to the write cache if it's not already present */
-  if( !buffer ) {
-
-    gint *key;
-
-    key = libspectrum_new( gint, 1 );
-    buffer = libspectrum_new( libspectrum_byte, drv->sector_size );
-
-    *key = sector_number;
-    g_hash_table_insert( cache, key, buffer );
-
-  }
+  buffer = cache_insert( cache, sector_number );
+  drv->stats.sectors_written++;
 
   /* Pack or copy the data into the write cache */
   if ( drv->sector_size == 256 ) {
@@ -502,9 +1337,9 @@ libspectrum_ide_write_sector_to_hdf( libspectrum_ide_drive *drv, GHashTable *cac
 
 /* Write a sector to the HDF file */
 static int
-write_hdf( libspectrum_ide_channel *chn )
+write_hdf( libspectrum_ide_channel *chn, libspectrum_byte *src )
 {
-  libspectrum_ide_write_sector_to_hdf( &chn->drive[ chn->selected ], chn->cache[ chn->selected ], chn->sector_number, chn->buffer );
+  libspectrum_ide_write_sector_to_hdf( &chn->drive[ chn->selected ], chn->cache[ chn->selected ], chn->sector_number, src );
   return 0;
 }
 
@@ -513,7 +1348,6 @@ static libspectrum_byte
 read_data( libspectrum_ide_channel *chn )
 {
   libspectrum_byte data;
-  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
   
   /* Meaningful data is only returned in PIO input phase */
   if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_IN ) return 0xff;
@@ -547,20 +1381,67 @@ read_data( libspectrum_ide_channel *chn )
   }
 
   /* Check for end of phase */
-  if( chn->datacounter >= 512 ) {
-    if( chn->sector_count ) {
-      /* more sectors to read */
-      readsector( chn );
-    } else {
-      /* all sectors done */
-      chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
-      drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
-    }
-  }
+  if( chn->datacounter >= chn->block_sectors * 512 ) read_data_done( chn );
 
   return data;
 }
 
+/* Called when the host has read all the data in the current block */
+static void
+read_data_done( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+
+  if( chn->sector_count ) {
+    /* more sectors to read */
+    readsector( chn );
+  } else {
+    /* all sectors done */
+    chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
+    drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
+  }
+}
+
+/* Read `n' bytes from the data register, as if by `n' calls to
+   libspectrum_ide_read() */
+void
+libspectrum_ide_read_block( libspectrum_ide_channel *chn,
+                            libspectrum_byte *dest, size_t n )
+{
+  size_t available;
+
+  while( n ) {
+
+    if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_IN ) {
+      memset( dest, 0xff, n );
+      return;
+    }
+
+    switch( chn->databus ) {
+
+    case LIBSPECTRUM_IDE_DATA16:
+      /* The common case: a straight copy from the sector buffer */
+      available = chn->block_sectors * 512 - chn->datacounter;
+      if( available > n ) available = n;
+      memcpy( dest, &chn->buffer[ chn->datacounter ], available );
+      chn->datacounter += available;
+      dest += available; n -= available;
+      break;
+
+    default:
+      while( n && chn->datacounter < chn->block_sectors * 512 ) {
+        *dest++ = read_data( chn );
+        n--;
+        if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_IN ) break;
+      }
+      continue;
+
+    }
+
+    if( chn->datacounter >= chn->block_sectors * 512 ) read_data_done( chn );
+  }
+}
+
 /* Read the IDE interface */
 libspectrum_byte
 libspectrum_ide_read( libspectrum_ide_channel *chn,
@@ -593,8 +1474,6 @@ libspectrum_ide_read( libspectrum_ide_channel *chn,
 static void
 write_data( libspectrum_ide_channel *chn, libspectrum_byte data )
 {
-  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
-
   /* Data register can only be written in PIO output phase */
   if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_OUT ) return;
 
@@ -623,24 +1502,74 @@ write_data( libspectrum_ide_channel *chn, libspectrum_byte data )
   }
     
   /* Check for end of phase */
-  if( chn->datacounter >= 512 ) {
+  if( chn->datacounter >= chn->block_sectors * 512 ) write_data_done( chn );
 
-    /* Write data to disk */
-    if ( write_hdf( chn ) ) {
+}
+
+/* Called when the host has written all the data for the current block */
+static void
+write_data_done( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+  int i;
+
+  /* Write data to disk. The first sector of the block was located before
+     the data was transferred */
+  for( i = 0; i < chn->block_sectors; i++ ) {
+    if( i && seek( chn ) ) {
+      abort_transfer( chn );
+      return;
+    }
+    if ( write_hdf( chn, &chn->buffer[ i * 512 ] ) ) {
       drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
       drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_UNC;
     }
+  }
 
-    if( chn->sector_count ) {
-      /* more sectors to write */
-      writesector( chn );
-    } else {
-      /* all sectors done */
-      chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
-      drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
-    }
+  if( chn->sector_count ) {
+    /* more sectors to write */
+    writesector( chn );
+  } else {
+    /* all sectors done */
+    chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
+    drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
   }
+}
+
+/* Write `n' bytes to the data register, as if by `n' calls to
+   libspectrum_ide_write() */
+void
+libspectrum_ide_write_block( libspectrum_ide_channel *chn,
+                             const libspectrum_byte *src, size_t n )
+{
+  size_t space;
+
+  while( n ) {
+
+    if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_OUT ) return;
+
+    switch( chn->databus ) {
+
+    case LIBSPECTRUM_IDE_DATA16:
+      space = chn->block_sectors * 512 - chn->datacounter;
+      if( space > n ) space = n;
+      memcpy( &chn->buffer[ chn->datacounter ], src, space );
+      chn->datacounter += space;
+      src += space; n -= space;
+      break;
 
+    default:
+      while( n && chn->datacounter < chn->block_sectors * 512 ) {
+        write_data( chn, *src++ );
+        n--;
+        if( chn->phase != LIBSPECTRUM_IDE_PHASE_PIO_OUT ) break;
+      }
+      continue;
+
+    }
+
+    if( chn->datacounter >= chn->block_sectors * 512 ) write_data_done( chn );
+  }
 }
 
 /* Seek to the addressed sector */
@@ -648,16 +1577,18 @@ static libspectrum_error
 seek( libspectrum_ide_channel *chn )
 {
   libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
-  int sectornumber;
+  libspectrum_dword sectornumber;
+  int valid = 1;
   int next_head;
 
   /* Calculate sector number, depending upon LBA/CHS mode. */
   if( chn->head & LIBSPECTRUM_IDE_HEAD_LBA ) {
 
-    sectornumber = ( chn->head & LIBSPECTRUM_IDE_HEAD_HEAD << 24 ) +
-                   ( chn->cylinder_high << 16 )			   +
-                   ( chn->cylinder_low << 8 )			   +
-                   ( chn->sector );
+    sectornumber =
+      ( (libspectrum_dword)( chn->head & LIBSPECTRUM_IDE_HEAD_HEAD ) << 24 ) +
+      ( (libspectrum_dword)chn->cylinder_high << 16 )			    +
+      ( chn->cylinder_low << 8 )					    +
+      ( chn->sector );
 
   } else {
 
@@ -667,7 +1598,8 @@ seek( libspectrum_ide_channel *chn )
 
     if( cylinder >= drv->cylinders || head >= drv->heads     ||
         sector < 0                 || sector >= drv->sectors    ) {
-      sectornumber = -1;
+      valid = 0;
+      sectornumber = 0;
     } else {
       sectornumber =
 	( ( ( cylinder * drv->heads ) + head ) * drv->sectors ) + sector;
@@ -676,8 +1608,9 @@ seek( libspectrum_ide_channel *chn )
   }
 
   /* Seek to the correct position */
-  if( sectornumber < 0                                               ||
-      sectornumber >= ( drv->cylinders * drv->heads * drv->sectors )    ) {  
+  if( !valid ||
+      sectornumber >=
+        (libspectrum_dword)drv->cylinders * drv->heads * drv->sectors ) {
     drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
     drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_IDNF;
     return LIBSPECTRUM_ERROR_UNKNOWN;
@@ -737,6 +1670,10 @@ identifydevice( libspectrum_ide_channel *chn )
   /* Clear sector buffer and copy in HDF identity information */
   memset( &chn->buffer[0], 0, 512 );
   memcpy( &chn->buffer[0], &drv->hdf.drive_identity[0], 0x6a );
+
+  /* Maximum sectors per block for READ/WRITE MULTIPLE */
+  SET_WORD( chn->buffer, LIBSPECTRUM_IDE_IDENTITY_MAX_MULTIPLE,
+            0x8000 | IDE_MAX_MULTIPLE );
     
   /* Fill in fields that lie beyond the end of the HDF header */
   /* Field validity */
@@ -760,6 +1697,12 @@ identifydevice( libspectrum_ide_channel *chn )
   SET_WORD( chn->buffer, LIBSPECTRUM_IDE_IDENTITY_CURRENT_CAPACITY_HI,
 	    ( sector_count & 0xffff0000 ) >> 16 );
 
+  /* Current multiple mode setting, if any */
+  if( chn->multiple_count[ chn->selected ] ) {
+    SET_WORD( chn->buffer, LIBSPECTRUM_IDE_IDENTITY_CURRENT_MULTIPLE,
+              0x0100 | chn->multiple_count[ chn->selected ] );
+  }
+
   /* Total number of user addressable sectors;
      only defined if LBA supported */
   if( GET_WORD( chn->buffer, LIBSPECTRUM_IDE_IDENTITY_CAPABILITIES ) &
@@ -778,39 +1721,76 @@ identifydevice( libspectrum_ide_channel *chn )
   chn->phase = LIBSPECTRUM_IDE_PHASE_PIO_IN;
   drv->status |= LIBSPECTRUM_IDE_STATUS_DRQ;
   chn->datacounter = 0;
+  chn->block_sectors = 1;
+}
+
+/* Stop transferring data after an error */
+static void
+abort_transfer( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+
+  chn->phase = LIBSPECTRUM_IDE_PHASE_READY;
+  drv->status &= ~LIBSPECTRUM_IDE_STATUS_DRQ;
 }
 
-/* Execute the READ SECTOR command */
+/* Work out how many sectors go in the next block. A sector count of zero
+   means 256 sectors at the start of a command, and can't occur part way
+   through one */
+static void
+start_block( libspectrum_ide_channel *chn )
+{
+  int remaining = chn->sector_count ? chn->sector_count : 256;
+
+  chn->block_sectors = remaining < chn->command_multiple ?
+                       remaining : chn->command_multiple;
+}
+
+/* Execute the READ SECTOR or READ MULTIPLE command, reading the whole of
+   the next block into the sector buffer */
 static void
 readsector( libspectrum_ide_channel *chn )
 {
   libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+  int i;
 
-  if( seek( chn ) ) return;
+  start_block( chn );
 
-  /* Read data from disk */
-  if( read_hdf( chn ) ) {
-    
-    drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
-    drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_UNC;
+  for( i = 0; i < chn->block_sectors; i++ ) {
 
-  } else {
+    if( seek( chn ) ) {
+      abort_transfer( chn );
+      return;
+    }
 
-    /* Initiate the PIO input phase */
-    chn->phase = LIBSPECTRUM_IDE_PHASE_PIO_IN;
-    drv->status |= LIBSPECTRUM_IDE_STATUS_DRQ;
-    chn->datacounter = 0;
+    /* Read data from disk */
+    if( read_hdf( chn, &chn->buffer[ i * 512 ] ) ) {
+      drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
+      drv->error = LIBSPECTRUM_IDE_ERROR_ABRT | LIBSPECTRUM_IDE_ERROR_UNC;
+      abort_transfer( chn );
+      return;
+    }
 
   }
+
+  /* Initiate the PIO input phase */
+  chn->phase = LIBSPECTRUM_IDE_PHASE_PIO_IN;
+  drv->status |= LIBSPECTRUM_IDE_STATUS_DRQ;
+  chn->datacounter = 0;
 }
 
-/* Execute the WRITE SECTOR command */
+/* Execute the WRITE SECTOR or WRITE MULTIPLE command */
 static void
 writesector( libspectrum_ide_channel *chn )
 {
   libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
 
-  if( seek( chn ) ) return;
+  start_block( chn );
+
+  if( seek( chn ) ) {
+    abort_transfer( chn );
+    return;
+  }
 
   /* Initiate the PIO output phase */
   chn->phase = LIBSPECTRUM_IDE_PHASE_PIO_OUT;
@@ -818,6 +1798,46 @@ writesector( libspectrum_ide_channel *chn )
   chn->datacounter = 0;
 }
 
+/* Execute READ MULTIPLE or WRITE MULTIPLE, which are only valid once
+   SET MULTIPLE MODE has been used */
+static void
+multiple_command( libspectrum_ide_channel *chn, int write )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+
+  if( !chn->multiple_count[ chn->selected ] ) {
+    drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
+    drv->error = LIBSPECTRUM_IDE_ERROR_ABRT;
+    return;
+  }
+
+  chn->command_multiple = chn->multiple_count[ chn->selected ];
+
+  if( write ) {
+    writesector( chn );
+  } else {
+    readsector( chn );
+  }
+}
+
+/* Execute the SET MULTIPLE MODE command */
+static void
+set_multiple_mode( libspectrum_ide_channel *chn )
+{
+  libspectrum_ide_drive *drv = &chn->drive[ chn->selected ];
+  int count = chn->sector_count;
+
+  /* Zero disables multiple mode; anything else must be a power of two
+     no bigger than we support */
+  if( count > IDE_MAX_MULTIPLE || ( count & ( count - 1 ) ) ) {
+    drv->status |= LIBSPECTRUM_IDE_STATUS_ERR;
+    drv->error = LIBSPECTRUM_IDE_ERROR_ABRT;
+    return;
+  }
+
+  chn->multiple_count[ chn->selected ] = count;
+}
+
 /* Execute the INITIALIZE DEVICE PARAMETERS command */
 static void
 init_device_params( libspectrum_ide_channel *chn )
@@ -864,6 +1884,11 @@ execute_command( libspectrum_ide_channel *chn, libspectrum_byte data )
   drv->status &= ~(LIBSPECTRUM_IDE_STATUS_ERR | LIBSPECTRUM_IDE_STATUS_BSY);
   drv->status |= LIBSPECTRUM_IDE_STATUS_DRDY;
 
+  /* Only the multiple commands transfer more than one sector per block */
+  chn->command_multiple = 1;
+
+  drv->stats.commands[ data ]++;
+
   /* Perform command */
   switch( data ) {
 
@@ -875,6 +1900,10 @@ execute_command( libspectrum_ide_channel *chn, libspectrum_byte data )
   case LIBSPECTRUM_IDE_COMMAND_IDENTIFY_DRIVE_ATAPI: identifydevice( chn ); break;
   case LIBSPECTRUM_IDE_COMMAND_INITIALIZE_DEVICE_PARAMETERS:
     init_device_params( chn ); break;
+  case LIBSPECTRUM_IDE_COMMAND_READ_MULTIPLE:  multiple_command( chn, 0 ); break;
+  case LIBSPECTRUM_IDE_COMMAND_WRITE_MULTIPLE: multiple_command( chn, 1 ); break;
+  case LIBSPECTRUM_IDE_COMMAND_SET_MULTIPLE_MODE:
+    set_multiple_mode( chn ); break;
       
     /* Unknown/unsupported commands */
   default:
@@ -29,6 +29,10 @@
 #include <glib.h>
 #endif				/* #ifdef HAVE_LIB_GLIB */
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
 #ifndef LIBSPECTRUM_LIBSPECTRUM_H
 #include "libspectrum.h"
 #endif				/* #ifndef LIBSPECTRUM_LIBSPECTRUM_H */
@@ -120,6 +124,21 @@ libspectrum_dword libspectrum_read_dword( const libspectrum_byte **buffer );
 int libspectrum_write_word( libspectrum_byte **buffer, libspectrum_word w );
 int libspectrum_write_dword( libspectrum_byte **buffer, libspectrum_dword d );
 
+/* Buffers which pass their contents on as they are written */
+
+/* Called with everything written to the buffer since the last drain */
+typedef libspectrum_error
+(*libspectrum_buffer_sink)( const libspectrum_byte *data, size_t length,
+                            void *user_data );
+
+libspectrum_buffer*
+libspectrum_buffer_alloc_sink( libspectrum_buffer_sink sink, void *user_data );
+
+/* Pass everything written to `buffer' so far to its sink and empty it. Does
+   nothing for ordinary buffers, so writers call this whenever nothing they
+   have written will be looked at again */
+libspectrum_error libspectrum_buffer_drain( libspectrum_buffer *buffer );
+
 /* (de)compression routines */
 
 libspectrum_error
@@ -128,6 +147,28 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 			     const unsigned char *old_buffer,
 			     size_t old_length, const char *old_filename );
 
+/* Limits on decompression; see libspectrum_set_decompression_limits() */
+size_t libspectrum_inflate_allowance( void );
+libspectrum_error libspectrum_inflate_check( size_t length );
+void libspectrum_inflate_charge( size_t length );
+void libspectrum_inflate_file_begin( void );
+void libspectrum_inflate_file_end( void );
+
+libspectrum_error
+libspectrum_identify_and_uncompress( libspectrum_id_t *type,
+				     libspectrum_class_t *libspectrum_class,
+				     libspectrum_byte **new_buffer,
+				     const char *filename,
+				     const libspectrum_byte **buffer,
+				     size_t *length );
+
+/* What's directly inside one layer of compression of `compressed_type' */
+libspectrum_error
+libspectrum_identify_layer( libspectrum_id_t *type,
+			    libspectrum_id_t compressed_type,
+			    const char *filename,
+			    const libspectrum_byte *buffer, size_t length );
+
 libspectrum_error
 libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength );
@@ -136,14 +177,94 @@ libspectrum_error
 libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
 			   libspectrum_byte **outptr, size_t *outlength );
 
+/* `size_hint' is the expected inflated length, or 0 if unknown */
+libspectrum_error
+libspectrum_bzip2_inflate_hinted( const libspectrum_byte *bzptr,
+				  size_t bzlength, libspectrum_byte **outptr,
+				  size_t *outlength, size_t size_hint );
+
+/* Called with each block of decompressed data as it is produced; return
+   non-zero to stop decompressing */
+typedef int (*libspectrum_inflate_sink)( const libspectrum_byte *data,
+                                         size_t length, void *user_data );
+
+libspectrum_error
+libspectrum_bzip2_inflate_stream( const libspectrum_byte *bzptr,
+                                  size_t bzlength,
+                                  libspectrum_inflate_sink sink,
+                                  void *user_data );
+
+/* `*outlength' is a hint as to the inflated length, or 0 if unknown */
 libspectrum_error
 libspectrum_zip_inflate( const libspectrum_byte *zipptr, size_t ziplength,
 			  libspectrum_byte **outptr, size_t *outlength );
 
+libspectrum_error
+libspectrum_zlib_inflate_hinted( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength, size_t size_hint );
+
+/* How hard to try when compressing data */
+typedef enum libspectrum_compression_level {
+  LIBSPECTRUM_COMPRESSION_BEST,	/* Smallest output */
+  LIBSPECTRUM_COMPRESSION_FAST,	/* Much quicker, slightly bigger output */
+} libspectrum_compression_level;
+
+libspectrum_error
+libspectrum_zlib_compress_level( const libspectrum_byte *data, size_t length,
+				 libspectrum_byte **gzptr, size_t *gzlength,
+				 libspectrum_compression_level level );
+
+/* Compress everything written to a buffer in gzip format as it is drained,
+   so a file can be written compressed without ever holding all of it */
+typedef struct libspectrum_gzip_writer libspectrum_gzip_writer;
+
+/* The output goes into `*buffer', which is treated as for the
+   libspectrum_*_write() functions, compressed as hard as `level' says */
+libspectrum_error
+libspectrum_gzip_writer_alloc( libspectrum_gzip_writer **writer,
+                               libspectrum_byte **buffer, size_t *length,
+                               libspectrum_compression_level level );
+
+/* Where the data to be compressed should be written */
+libspectrum_buffer*
+libspectrum_gzip_writer_buffer( libspectrum_gzip_writer *writer );
+
+/* If `error' is LIBSPECTRUM_ERROR_NONE, compress anything left and finish
+   the gzip file, setting `*length' to its size; in any case, free
+   `writer' and return the first error */
+libspectrum_error
+libspectrum_gzip_writer_free( libspectrum_gzip_writer *writer,
+                              libspectrum_error error );
+
 libspectrum_error
 libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
                             libspectrum_byte **outptr, size_t *outlength );
 
+/* As above, but decompress no more than the first `*outlength' bytes; used
+   when we only need to identify what's inside a compressed file */
+
+libspectrum_error
+libspectrum_gzip_inflate_prefix( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength );
+
+libspectrum_error
+libspectrum_bzip2_inflate_prefix( const libspectrum_byte *bzptr,
+				  size_t bzlength, libspectrum_byte **outptr,
+				  size_t *outlength );
+
+libspectrum_error
+libspectrum_zip_inflate_prefix( const libspectrum_byte *zipptr,
+				size_t ziplength, libspectrum_byte **outptr,
+				size_t *outlength );
+
+libspectrum_error
+libspectrum_zip_blind_read_prefix( const libspectrum_byte *zipptr,
+                                   size_t ziplength,
+                                   libspectrum_byte **outptr,
+                                   size_t *outlength );
+
 /* The TZX file signature */
 
 extern const char * const libspectrum_tzx_signature;
@@ -241,6 +362,13 @@ libspectrum_error
 internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
 		   const size_t length, libspectrum_id_t type );
 
+#ifdef HAVE_LIBBZ2
+/* Read a .tap style file compressed with bzip2 as it is decompressed */
+libspectrum_error
+internal_tap_read_bzip2( libspectrum_tape *tape, const libspectrum_byte *buffer,
+			 size_t length, libspectrum_id_t type );
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
 libspectrum_error
 internal_tap_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
                     libspectrum_id_t type );
@@ -297,6 +425,9 @@ typedef struct libspectrum_hdf_header {
   libspectrum_byte drive_identity[0x6a];
 
 } libspectrum_hdf_header;
+
+/* Write cache of dirty sectors for a drive */
+typedef struct libspectrum_ide_cache libspectrum_ide_cache;
   
 typedef struct libspectrum_ide_drive {
 
@@ -305,6 +436,22 @@ typedef struct libspectrum_ide_drive {
   libspectrum_word data_offset;
   libspectrum_word sector_size;
   libspectrum_hdf_header hdf;
+
+#ifdef HAVE_MMAP
+  /* Read-only mapping of the whole HDF file, or NULL if the file could
+     not be mapped and sectors must be read through `disk' */
+  libspectrum_byte *map;
+  size_t map_length;
+#endif				/* #ifdef HAVE_MMAP */
+
+  /* Copy-on-write overlay file, or NULL if none. With an overlay, `disk'
+     is opened read-only and written sectors are stored in the overlay at
+     `overlay_data_offset' + sector_size * sector number; `overlay_map' has
+     a bit set for each sector present in the overlay */
+  FILE *overlay;
+  long overlay_data_offset;
+  libspectrum_dword overlay_sectors;
+  libspectrum_byte *overlay_map;
   
   /* Drive geometry */
   int cylinders;
@@ -313,40 +460,115 @@ typedef struct libspectrum_ide_drive {
 
   libspectrum_byte error;
   libspectrum_byte status;
+
+  /* Activity counters; `dirty_sectors' is filled in from the cache when
+     they are read */
+  libspectrum_ide_stats stats;
+
+#ifdef HAVE_PTHREAD_H
+  /* Sectors being written out by a background commit, or NULL if none is
+     running. While it is, `lock' protects the files, overlay map, counters
+     and `flushing' itself against the flushing thread, and `flush_done' is
+     set once it has finished */
+  libspectrum_ide_cache *flushing;
+  pthread_t flush_thread;
+  pthread_mutex_t lock;
+  int flush_done;
+#endif				/* #ifdef HAVE_PTHREAD_H */
   
 } libspectrum_ide_drive;
 
+void
+libspectrum_ide_init_drive( libspectrum_ide_drive *drv );
+
+libspectrum_ide_cache*
+libspectrum_ide_cache_alloc( void );
+
+void
+libspectrum_ide_cache_free( libspectrum_ide_cache *cache );
+
+size_t
+libspectrum_ide_cache_size( libspectrum_ide_cache *cache );
+
+void
+libspectrum_ide_get_drive_stats( libspectrum_ide_drive *drv,
+                                 libspectrum_ide_cache *cache,
+                                 libspectrum_ide_stats *stats );
+
 libspectrum_error
 libspectrum_ide_insert_into_drive( libspectrum_ide_drive *drv,
-                                   const char *filename );
+                                   const char *filename,
+                                   const char *overlay_filename );
 
 libspectrum_error
 libspectrum_ide_eject_from_drive( libspectrum_ide_drive *drv,
-                                  GHashTable *cache );
+                                  libspectrum_ide_cache *cache );
 
 int
 libspectrum_ide_read_sector_from_hdf(
     libspectrum_ide_drive *drv,
-    GHashTable *cache,
+    libspectrum_ide_cache *cache,
     libspectrum_dword sector_number,
     libspectrum_byte *dest );
 
 void
 libspectrum_ide_write_sector_to_hdf(
     libspectrum_ide_drive *drv,
-    GHashTable *cache,
+    libspectrum_ide_cache *cache,
     libspectrum_dword sector_number,
     libspectrum_byte *src );
 
 void
-libspectrum_ide_commit_drive( libspectrum_ide_drive *drv, GHashTable *cache );
+libspectrum_ide_commit_drive( libspectrum_ide_drive *drv,
+                              libspectrum_ide_cache *cache );
+
+void
+libspectrum_ide_commit_drive_async( libspectrum_ide_drive *drv,
+                                    libspectrum_ide_cache **cache );
+
+void
+libspectrum_ide_wait_drive( libspectrum_ide_drive *drv,
+                            libspectrum_ide_cache *cache );
+
+int
+libspectrum_ide_dirty_drive( libspectrum_ide_drive *drv,
+                             libspectrum_ide_cache *cache );
 
 /* Crypto functions */
 
+typedef struct libspectrum_hash_context libspectrum_hash_context;
+
+#ifdef HAVE_GCRYPT_H
+
 libspectrum_error
-libspectrum_sign_data( libspectrum_byte **signature, size_t *signature_length,
-		       libspectrum_byte *data, size_t data_length,
-		       libspectrum_rzx_dsa_key *key );
+libspectrum_sign_digest( libspectrum_byte **signature,
+                         size_t *signature_length,
+                         const libspectrum_byte *digest, size_t digest_length,
+                         libspectrum_rzx_dsa_key *key );
+
+libspectrum_error
+libspectrum_verify_digest( const libspectrum_byte *digest,
+                           size_t digest_length, gcry_mpi_t r, gcry_mpi_t s,
+                           libspectrum_rzx_dsa_key *key );
+
+/* Hash data incrementally as it is read or written */
+
+libspectrum_error
+libspectrum_hash_start( libspectrum_hash_context **context );
+
+void
+libspectrum_hash_update( libspectrum_hash_context *context,
+                         const libspectrum_byte *data, size_t data_length );
+
+/* Free `context', returning the digest in `*digest' unless that is NULL */
+void
+libspectrum_hash_end( libspectrum_hash_context *context,
+                      libspectrum_byte **digest, size_t *digest_length );
+
+void
+libspectrum_crypto_cleanup( void );
+
+#endif				/* #ifdef HAVE_GCRYPT_H */
 
 /* Utility functions */
 
@@ -372,6 +594,15 @@ extern const int LIBSPECTRUM_BITS_IN_BYTE;
 char*
 libspectrum_safe_strdup( const char *src );
 
+/* Run `fn' on each of `count' independent jobs, using up to `threads'
+   threads if the platform supports them */
+
+typedef void (*libspectrum_parallel_fn)( void *jobs, size_t index );
+
+void
+libspectrum_run_parallel( libspectrum_parallel_fn fn, void *jobs, size_t count,
+                          int threads );
+
 /* glib replacement functions */
 
 #ifndef HAVE_LIB_GLIB		/* Only if we are using glib replacement */
@@ -73,6 +73,45 @@ static void
 gcrypt_log_handler( void *opaque, int level, const char *format, va_list ap );
 #endif				/* #ifdef HAVE_GCRYPT_H */
 
+/* How much of a compressed file to decompress when all we want to do is
+   identify it; comfortably more than the signatures checked by
+   libspectrum_identify_file_raw() need */
+#define IDENTIFY_PREFIX_LENGTH 4096
+
+static libspectrum_error
+uncompress_file( unsigned char **new_buffer, size_t *new_length,
+		 char **new_filename, libspectrum_id_t type,
+		 const unsigned char *old_buffer, size_t old_length,
+		 const char *old_filename, size_t limit );
+static libspectrum_error
+uncompress_layer( unsigned char **new_buffer, size_t *new_length,
+		  char **new_filename, libspectrum_id_t type,
+		  const unsigned char *old_buffer, size_t old_length,
+		  const char *old_filename, size_t limit );
+
+/* Limits on how much may be decompressed from one file and through how
+   many layers of compression, or 0 for no limit */
+static size_t decompression_max_bytes = 0;
+static int decompression_max_depth = 0;
+
+/* Without thread-local storage, the per-thread limits and the count of
+   what's been decompressed are shared between all threads, so the limits
+   are only approximate when several threads are reading files at once */
+#ifndef LIBSPECTRUM_THREAD_LOCAL
+#define LIBSPECTRUM_THREAD_LOCAL
+#endif				/* #ifndef LIBSPECTRUM_THREAD_LOCAL */
+
+/* Limits for this thread only, overriding the ones above if set */
+static LIBSPECTRUM_THREAD_LOCAL int thread_limits_set = 0;
+static LIBSPECTRUM_THREAD_LOCAL size_t thread_max_bytes = 0;
+static LIBSPECTRUM_THREAD_LOCAL int thread_max_depth = 0;
+
+/* While a file is being read, how many reads are in progress (as a
+   snapshot may be read from inside a recording) and how much has been
+   decompressed from the outermost file so far */
+static LIBSPECTRUM_THREAD_LOCAL int inflate_in_file = 0;
+static LIBSPECTRUM_THREAD_LOCAL size_t inflate_used = 0;
+
 /* Initialise the library */
 libspectrum_error
 libspectrum_init( void )
@@ -120,6 +159,10 @@ libspectrum_init( void )
 void
 libspectrum_end( void )
 {
+#ifdef HAVE_GCRYPT_H
+  libspectrum_crypto_cleanup();
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
 #ifndef HAVE_LIB_GLIB
   libspectrum_slist_cleanup();
   libspectrum_hashtable_cleanup();
@@ -444,39 +487,155 @@ libspectrum_machine_capabilities( libspectrum_machine type )
   return capabilities;
 }
 
+/* Is this file compressed? */
+static int
+is_compressed( const char *filename, const libspectrum_byte *buffer,
+	       size_t length )
+{
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+
+  return !libspectrum_identify_file_raw( &type, filename, buffer, length ) &&
+         !libspectrum_identify_class( &class, type ) &&
+         class == LIBSPECTRUM_CLASS_COMPRESSED;
+}
+
 /* Given a buffer and optionally a filename, make a best guess as to
-   what sort of file this is */
+   what sort of file this is, decompressing it as many times as needed to
+   find out. If it was compressed, `*new_buffer' is set to the decompressed
+   data, which the caller must free, and `*buffer' and `*length' are updated
+   to refer to it; otherwise `*new_buffer' is set to NULL. If `limit' is
+   non-zero, no more than that much of the innermost file is decompressed */
+static libspectrum_error
+identify_and_uncompress( libspectrum_id_t *type,
+			 libspectrum_class_t *libspectrum_class,
+			 libspectrum_byte **new_buffer, const char *filename,
+			 const libspectrum_byte **buffer, size_t *length,
+			 size_t limit )
+{
+  libspectrum_error error;
+  char *new_filename = NULL, *inner_filename;
+  libspectrum_byte *inner_buffer;
+  size_t inner_length;
+  int depth = 0, max_depth;
+
+  *new_buffer = NULL;
+
+  max_depth = thread_limits_set ? thread_max_depth : decompression_max_depth;
+
+  libspectrum_inflate_file_begin();
+
+  while( 1 ) {
+
+    error = libspectrum_identify_file_raw( type, filename, *buffer, *length );
+    if( error ) break;
+
+    error = libspectrum_identify_class( libspectrum_class, *type );
+    if( error || *libspectrum_class != LIBSPECTRUM_CLASS_COMPRESSED ) break;
+
+    if( max_depth && depth >= max_depth ) {
+      libspectrum_print_error(
+        LIBSPECTRUM_ERROR_LIMIT,
+        "file has more than %d layers of compression", max_depth
+      );
+      error = LIBSPECTRUM_ERROR_LIMIT;
+      break;
+    }
+    depth++;
+
+    /* new_filename or buffer will be allocated in
+       libspectrum_uncompress_file */
+    inner_filename = NULL;
+    error = uncompress_layer( &inner_buffer, &inner_length, &inner_filename,
+			      *type, *buffer, *length, filename, limit );
+    if( error ) break;
+
+    /* If we've got only the start of something which is itself
+       compressed, we need all of it to see what's inside */
+    if( limit && inner_length == limit &&
+	is_compressed( inner_filename, inner_buffer, inner_length ) ) {
+      libspectrum_free( inner_buffer ); libspectrum_free( inner_filename );
+      inner_filename = NULL;
+      error = uncompress_layer( &inner_buffer, &inner_length,
+				&inner_filename, *type, *buffer, *length,
+				filename, 0 );
+      if( error ) break;
+    }
+
+    libspectrum_free( *new_buffer ); libspectrum_free( new_filename );
+
+    *new_buffer = inner_buffer; new_filename = inner_filename;
+    *buffer = inner_buffer; *length = inner_length;
+    filename = new_filename;
+  }
+
+  libspectrum_free( new_filename );
+
+  libspectrum_inflate_file_end();
+
+  if( error ) {
+    libspectrum_free( *new_buffer ); *new_buffer = NULL;
+    return error;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_error
+libspectrum_identify_and_uncompress( libspectrum_id_t *type,
+				     libspectrum_class_t *libspectrum_class,
+				     libspectrum_byte **new_buffer,
+				     const char *filename,
+				     const libspectrum_byte **buffer,
+				     size_t *length )
+{
+  return identify_and_uncompress( type, libspectrum_class, new_buffer,
+				  filename, buffer, length, 0 );
+}
+
 libspectrum_error
 libspectrum_identify_file_with_class(
   libspectrum_id_t *type, libspectrum_class_t *libspectrum_class,
   const char *filename, const unsigned char *buffer, size_t length )
 {
   libspectrum_error error;
-  char *new_filename = NULL; unsigned char *new_buffer; size_t new_length;
+  libspectrum_byte *new_buffer;
 
-  error = libspectrum_identify_file_raw( type, filename, buffer, length );
+  /* Only the start of any compressed file is needed to identify it */
+  error = identify_and_uncompress( type, libspectrum_class, &new_buffer,
+				   filename, &buffer, &length,
+				   IDENTIFY_PREFIX_LENGTH );
   if( error ) return error;
 
-  error = libspectrum_identify_class( libspectrum_class, *type );
-  if( error ) return error;
+  libspectrum_free( new_buffer );
 
-  if( *libspectrum_class != LIBSPECTRUM_CLASS_COMPRESSED )
-    return LIBSPECTRUM_ERROR_NONE;
+  return LIBSPECTRUM_ERROR_NONE;
+}
 
-  error = libspectrum_uncompress_file( &new_buffer, &new_length, &new_filename,
-				       *type, buffer, length, filename );
-  if( error ) return error;
+/* Identify what's directly inside one layer of compression, without
+   looking through any further layers, from just the start of it */
+libspectrum_error
+libspectrum_identify_layer( libspectrum_id_t *type,
+			    libspectrum_id_t compressed_type,
+			    const char *filename,
+			    const libspectrum_byte *buffer, size_t length )
+{
+  libspectrum_byte *inner_buffer;
+  char *inner_filename = NULL;
+  size_t inner_length;
+  libspectrum_error error;
 
-  error = libspectrum_identify_file_with_class( type, libspectrum_class,
-						new_filename, new_buffer,
-						new_length );
+  error = uncompress_layer( &inner_buffer, &inner_length, &inner_filename,
+			    compressed_type, buffer, length, filename,
+			    IDENTIFY_PREFIX_LENGTH );
+  if( error ) return error;
 
-  /* new_filename or buffer will be allocated in libspectrum_uncompress_file */
-  libspectrum_free( new_filename ); libspectrum_free( new_buffer );
+  error = libspectrum_identify_file_raw( type, inner_filename, inner_buffer,
+					 inner_length );
 
-  if( error ) return error;
+  libspectrum_free( inner_buffer ); libspectrum_free( inner_filename );
 
-  return LIBSPECTRUM_ERROR_NONE;
+  return error;
 }
 
 /* Identify a file, but without worrying about its class */
@@ -764,6 +923,146 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 			     char **new_filename, libspectrum_id_t type,
 			     const unsigned char *old_buffer,
 			     size_t old_length, const char *old_filename )
+{
+  return uncompress_layer( new_buffer, new_length, new_filename, type,
+			   old_buffer, old_length, old_filename, 0 );
+}
+
+void
+libspectrum_set_decompression_limits( size_t max_bytes, int max_depth )
+{
+  decompression_max_bytes = max_bytes;
+  decompression_max_depth = max_depth > 0 ? max_depth : 0;
+}
+
+void
+libspectrum_set_thread_decompression_limits( size_t max_bytes, int max_depth )
+{
+  thread_max_bytes = max_bytes;
+  thread_max_depth = max_depth > 0 ? max_depth : 0;
+  thread_limits_set = 1;
+}
+
+void
+libspectrum_clear_thread_decompression_limits( void )
+{
+  thread_limits_set = 0;
+}
+
+/* The limits which apply to this thread */
+void
+libspectrum_get_decompression_limits( size_t *max_bytes, int *max_depth )
+{
+  if( thread_limits_set ) {
+    *max_bytes = thread_max_bytes;
+    *max_depth = thread_max_depth;
+  } else {
+    *max_bytes = decompression_max_bytes;
+    *max_depth = decompression_max_depth;
+  }
+}
+
+static size_t
+max_bytes( void )
+{
+  return thread_limits_set ? thread_max_bytes : decompression_max_bytes;
+}
+
+/* Everything decompressed between these calls counts towards the limit
+   for one file. Calls may be nested, in which case the outermost pair
+   defines the file */
+void
+libspectrum_inflate_file_begin( void )
+{
+  if( !inflate_in_file++ ) inflate_used = 0;
+}
+
+void
+libspectrum_inflate_file_end( void )
+{
+  inflate_in_file--;
+}
+
+/* How much more data the decompression in progress may produce: what's
+   left for the file being read, or the whole limit if this isn't part of
+   reading a file */
+size_t
+libspectrum_inflate_allowance( void )
+{
+  size_t limit = max_bytes();
+
+  if( !limit ) return SIZE_MAX;
+  if( !inflate_in_file ) return limit;
+
+  return inflate_used < limit ? limit - inflate_used : 0;
+}
+
+/* Check that `length' bytes of decompressed data are within the limit */
+libspectrum_error
+libspectrum_inflate_check( size_t length )
+{
+  if( length > libspectrum_inflate_allowance() ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_LIMIT,
+      "decompressed data exceeds the limit of %lu bytes",
+      (unsigned long)max_bytes()
+    );
+    return LIBSPECTRUM_ERROR_LIMIT;
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Count `length' bytes of decompressed data towards the limit for the file
+   being read; each decompressor calls this once it has finished */
+void
+libspectrum_inflate_charge( size_t length )
+{
+  if( !inflate_in_file ) return;
+
+  inflate_used = length < SIZE_MAX - inflate_used ? inflate_used + length :
+                                                    SIZE_MAX;
+}
+
+/* Decompress one layer of a file */
+static libspectrum_error
+uncompress_layer( unsigned char **new_buffer, size_t *new_length,
+		  char **new_filename, libspectrum_id_t type,
+		  const unsigned char *old_buffer, size_t old_length,
+		  const char *old_filename, size_t limit )
+{
+  libspectrum_error error;
+  size_t used;
+
+  libspectrum_inflate_file_begin();
+  used = inflate_used;
+
+  error = uncompress_file( new_buffer, new_length, new_filename, type,
+			   old_buffer, old_length, old_filename, limit );
+
+  /* In case the decompressor couldn't check as it went along */
+  if( !error && !limit && inflate_used == used ) {
+    error = libspectrum_inflate_check( *new_length );
+    if( error ) {
+      libspectrum_free( *new_buffer );
+      if( new_filename ) libspectrum_free( *new_filename );
+    } else {
+      libspectrum_inflate_charge( *new_length );
+    }
+  }
+
+  libspectrum_inflate_file_end();
+
+  return error;
+}
+
+/* Decompress a file, or just the first `limit' bytes of it if `limit' is
+   non-zero */
+static libspectrum_error
+uncompress_file( unsigned char **new_buffer, size_t *new_length,
+		 char **new_filename, libspectrum_id_t type,
+		 const unsigned char *old_buffer, size_t old_length,
+		 const char *old_filename, size_t limit )
 {
   libspectrum_class_t class;
   libspectrum_error error;
@@ -786,8 +1085,9 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
     }
   }
 
-  /* Tells the inflation routines to allocate memory for us */
-  *new_length = 0;
+  /* Tells the inflation routines to allocate memory for us, or how much
+     of it to allocate when we want just the start of the file */
+  *new_length = limit;
   
   switch( type ) {
 
@@ -802,8 +1102,13 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 	(*new_filename)[ strlen( *new_filename ) - 4 ] = '\0';
     }
 
-    error = libspectrum_bzip2_inflate( old_buffer, old_length,
-				       new_buffer, new_length );
+    if( limit ) {
+      error = libspectrum_bzip2_inflate_prefix( old_buffer, old_length,
+						new_buffer, new_length );
+    } else {
+      error = libspectrum_bzip2_inflate( old_buffer, old_length,
+					 new_buffer, new_length );
+    }
     if( error ) {
       if( new_filename ) libspectrum_free( *new_filename );
       return error;
@@ -833,8 +1138,13 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 	(*new_filename)[ strlen( *new_filename ) - 3 ] = '\0';
     }
       
-    error = libspectrum_gzip_inflate( old_buffer, old_length,
-				      new_buffer, new_length );
+    if( limit ) {
+      error = libspectrum_gzip_inflate_prefix( old_buffer, old_length,
+					       new_buffer, new_length );
+    } else {
+      error = libspectrum_gzip_inflate( old_buffer, old_length,
+					new_buffer, new_length );
+    }
     if( error ) {
       if( new_filename ) libspectrum_free( *new_filename );
       return error;
@@ -861,8 +1171,13 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
       (*new_filename)[ strlen( *new_filename ) - 4 ] = '\0';
     }
 
-    error = libspectrum_zip_blind_read( old_buffer, old_length,
-                                        new_buffer, new_length );
+    if( limit ) {
+      error = libspectrum_zip_blind_read_prefix( old_buffer, old_length,
+                                                 new_buffer, new_length );
+    } else {
+      error = libspectrum_zip_blind_read( old_buffer, old_length,
+                                          new_buffer, new_length );
+    }
     if( error ) {
       if( new_filename ) libspectrum_free( *new_filename );
       return error;
@@ -962,6 +1277,108 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+#ifndef HAVE_ZLIB_H
+
+/* The real versions of these are in zip.c */
+
+libspectrum_error
+libspectrum_zip_catalogue( const libspectrum_byte *buffer, size_t length,
+                           libspectrum_zip_catalogue_entry **entries,
+                           size_t *count )
+{
+  libspectrum_print_error( LIBSPECTRUM_ERROR_MISSING_ZLIB,
+                           "zlib not available to read zipped file" );
+  return LIBSPECTRUM_ERROR_MISSING_ZLIB;
+}
+
+void
+libspectrum_zip_catalogue_free( libspectrum_zip_catalogue_entry *entries,
+                                size_t count )
+{
+  libspectrum_free( entries );
+}
+
+libspectrum_zip*
+libspectrum_zip_open( const libspectrum_byte *buffer, size_t length,
+                      int flags )
+{
+  libspectrum_print_error( LIBSPECTRUM_ERROR_MISSING_ZLIB,
+                           "zlib not available to read zipped file" );
+  return NULL;
+}
+
+void
+libspectrum_zip_close( libspectrum_zip *zip )
+{
+}
+
+unsigned int
+libspectrum_zip_num_entries( libspectrum_zip *zip )
+{
+  return 0;
+}
+
+libspectrum_error
+libspectrum_zip_rewind( libspectrum_zip *zip )
+{
+  return LIBSPECTRUM_ERROR_INVALID;
+}
+
+libspectrum_error
+libspectrum_zip_next( libspectrum_zip *zip, libspectrum_zip_stat *info )
+{
+  return LIBSPECTRUM_ERROR_UNKNOWN;
+}
+
+int
+libspectrum_zip_locate( libspectrum_zip *zip, const char *filename,
+                        int flags, libspectrum_zip_stat *info )
+{
+  return -1;
+}
+
+libspectrum_error
+libspectrum_zip_read( libspectrum_zip *zip, libspectrum_byte **buffer,
+                      size_t *size )
+{
+  return LIBSPECTRUM_ERROR_INVALID;
+}
+
+libspectrum_error
+libspectrum_zip_extract_all( libspectrum_zip *zip,
+                             libspectrum_zip_extract_fn callback,
+                             void *user_data, int threads )
+{
+  return LIBSPECTRUM_ERROR_INVALID;
+}
+
+/* The real versions of these are in zlib.c */
+
+libspectrum_error
+libspectrum_gzip_writer_alloc( libspectrum_gzip_writer **writer,
+                               libspectrum_byte **buffer, size_t *length,
+                               libspectrum_compression_level level )
+{
+  libspectrum_print_error( LIBSPECTRUM_ERROR_MISSING_ZLIB,
+                           "zlib not available to write gzipped file" );
+  return LIBSPECTRUM_ERROR_MISSING_ZLIB;
+}
+
+libspectrum_buffer*
+libspectrum_gzip_writer_buffer( libspectrum_gzip_writer *writer )
+{
+  return NULL;
+}
+
+libspectrum_error
+libspectrum_gzip_writer_free( libspectrum_gzip_writer *writer,
+                              libspectrum_error error )
+{
+  return error;
+}
+
+#endif				/* #ifndef HAVE_ZLIB_H */
+
 /* Ensure there is room for `requested' characters after the current
    position `ptr' in `buffer'. If not, renew() and update the
    pointers as necessary */
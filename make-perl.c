@@ -354,6 +354,10 @@ int main(void)
   printf( "libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,\n" );
   printf( "			  libspectrum_byte **outptr, size_t *outlength );\n\n" );
   printf( "LIBSPECTRUM_API libspectrum_error\n" );
+  printf( "libspectrum_zlib_inflate_to_buffer( const libspectrum_byte *gzptr,\n" );
+  printf( "				    size_t gzlength, libspectrum_byte *outptr,\n" );
+  printf( "				    size_t *outlength );\n\n" );
+  printf( "LIBSPECTRUM_API libspectrum_error\n" );
   printf( "libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,\n" );
   printf( "			   libspectrum_byte **gzptr, size_t *gzlength );\n\n" );
 
@@ -54,8 +54,11 @@ enum command_byte {
   SEND_IF_COND = 8,
   SEND_CSD = 9,
   SEND_CID = 10,
+  STOP_TRANSMISSION = 12,
   READ_SINGLE_BLOCK = 17,
+  READ_MULTIPLE_BLOCK = 18,
   WRITE_BLOCK = 24,
+  WRITE_MULTIPLE_BLOCK = 25,
   ERASE_WR_BLK_START = 32,
   ERASE_WR_BLK_END = 33,
   ERASE = 38,
@@ -74,6 +77,20 @@ enum application_command_byte {
   SEND_SCR = 51,
 };
 
+/* Data tokens */
+#define START_BLOCK_TOKEN 0xfe
+#define START_MULTIPLE_BLOCK_TOKEN 0xfc
+#define STOP_TRAN_TOKEN 0xfd
+
+/* Data response tokens */
+#define DATA_ACCEPTED 0x05
+#define DATA_WRITE_ERROR 0x0d
+
+/* How many blocks a multiple block read fetches from the image at once.
+   Each block is sent as a data token, 512 bytes of data and a 2 byte CRC */
+#define MMC_READ_AHEAD 8
+#define MMC_BLOCK_LENGTH ( 1 + 512 + 2 )
+
 /* The state of an erase sequence */
 enum erase_sequence_t {
   SEQ_ERASE_NONE,
@@ -86,10 +103,10 @@ struct libspectrum_mmc_card {
   libspectrum_ide_drive drive;
 
   /* Cache of written sectors */
-  GHashTable *cache;
+  libspectrum_ide_cache *cache;
 
   /* The C_SIZE field of the card CSD */
-  libspectrum_word c_size;
+  libspectrum_dword c_size;
 
   /* The number of sectors (512 bytes) */
   libspectrum_dword total_sectors;
@@ -112,8 +129,9 @@ struct libspectrum_mmc_card {
   /* The data for the current command */
   libspectrum_byte send_buffer[512];
 
-  /* The response to the most recent command */
-  libspectrum_byte response_buffer[516];
+  /* The response to the most recent command; big enough for the R1
+     response and the read ahead blocks of a multiple block read */
+  libspectrum_byte response_buffer[ 1 + MMC_READ_AHEAD * MMC_BLOCK_LENGTH ];
 
   /* One past the last valid byte in response_buffer */
   libspectrum_byte *response_buffer_end;
@@ -133,6 +151,12 @@ struct libspectrum_mmc_card {
   /* Initial and end blocks of programmed erase */
   libspectrum_dword erase_block_start, erase_block_end;
 
+  /* Non-zero while a READ_MULTIPLE_BLOCK is streaming data */
+  int multiple_read;
+
+  /* The next block to be read or written by a multiple block command */
+  libspectrum_dword multiple_sector;
+
 };
 
 libspectrum_mmc_card*
@@ -140,8 +164,8 @@ libspectrum_mmc_alloc( void )
 {
   libspectrum_mmc_card *card = libspectrum_new( libspectrum_mmc_card, 1 );
 
-  card->drive.disk = NULL;
-  card->cache = g_hash_table_new( g_int_hash, g_int_equal );
+  libspectrum_ide_init_drive( &card->drive );
+  card->cache = libspectrum_ide_cache_alloc();
 
   libspectrum_mmc_reset( card );
 
@@ -153,13 +177,21 @@ libspectrum_mmc_free( libspectrum_mmc_card *card )
 {
   libspectrum_mmc_eject( card );
 
-  g_hash_table_destroy( card->cache );
+  libspectrum_ide_cache_free( card->cache );
 
   libspectrum_free( card );
 }
 
 libspectrum_error
 libspectrum_mmc_insert( libspectrum_mmc_card *card, const char *filename )
+{
+  return libspectrum_mmc_insert_overlay( card, filename, NULL );
+}
+
+libspectrum_error
+libspectrum_mmc_insert_overlay( libspectrum_mmc_card *card,
+                                const char *filename,
+                                const char *overlay_filename )
 {
   libspectrum_error error;
   libspectrum_dword c_size;
@@ -167,7 +199,8 @@ libspectrum_mmc_insert( libspectrum_mmc_card *card, const char *filename )
   libspectrum_mmc_eject( card );
   if( !filename ) return LIBSPECTRUM_ERROR_NONE;
 
-  error = libspectrum_ide_insert_into_drive( &card->drive, filename );
+  error = libspectrum_ide_insert_into_drive( &card->drive, filename,
+                                             overlay_filename );
   if( error ) return error;
 
   card->total_sectors = (libspectrum_dword)card->drive.cylinders *
@@ -215,12 +248,14 @@ libspectrum_mmc_reset( libspectrum_mmc_card *card )
   card->erase_sequence = SEQ_ERASE_NONE;
   card->erase_block_start = 0;
   card->erase_block_end = 0;
+  card->multiple_read = 0;
+  card->multiple_sector = 0;
 }
 
 int
 libspectrum_mmc_dirty( libspectrum_mmc_card *card )
 {
-  return g_hash_table_size( card->cache ) != 0;
+  return libspectrum_ide_dirty_drive( &card->drive, card->cache );
 }
 
 void
@@ -229,10 +264,38 @@ libspectrum_mmc_commit( libspectrum_mmc_card *card )
   libspectrum_ide_commit_drive( &card->drive, card->cache );
 }
 
+void
+libspectrum_mmc_commit_async( libspectrum_mmc_card *card )
+{
+  libspectrum_ide_commit_drive_async( &card->drive, &card->cache );
+}
+
+void
+libspectrum_mmc_commit_wait( libspectrum_mmc_card *card )
+{
+  libspectrum_ide_wait_drive( &card->drive, card->cache );
+}
+
+void
+libspectrum_mmc_get_stats( libspectrum_mmc_card *card,
+                           libspectrum_ide_stats *stats )
+{
+  libspectrum_ide_get_drive_stats( &card->drive, card->cache, stats );
+}
+
+static void fill_read_ahead( libspectrum_mmc_card *card, size_t offset );
+
 libspectrum_byte
 libspectrum_mmc_read( libspectrum_mmc_card *card )
 {
-  libspectrum_byte r = card->response_buffer_next < card->response_buffer_end ?
+  libspectrum_byte r;
+
+  /* Fetch the next blocks once the host has read all those already sent */
+  if( card->multiple_read &&
+      card->response_buffer_next == card->response_buffer_end )
+    fill_read_ahead( card, 0 );
+
+  r = card->response_buffer_next < card->response_buffer_end ?
     *(card->response_buffer_next)++ :
     0xff;
 
@@ -272,6 +335,17 @@ set_response_buffer_r7( libspectrum_mmc_card *card, libspectrum_dword value )
   card->response_buffer_end = card->response_buffer + 5;
 }
 
+/* The 32-bit argument of the current command. SDHC cards are block
+   addressed, so for data commands this is the sector number */
+static libspectrum_dword
+get_argument( libspectrum_mmc_card *card )
+{
+  return (libspectrum_dword)card->current_argument[ 3 ] |
+    (libspectrum_dword)card->current_argument[ 2 ] << 8 |
+    (libspectrum_dword)card->current_argument[ 1 ] << 16 |
+    (libspectrum_dword)card->current_argument[ 0 ] << 24;
+}
+
 static void
 reset_erase_sequence( libspectrum_mmc_card *card )
 {
@@ -298,11 +372,7 @@ erase_wr_blk_start( libspectrum_mmc_card *card )
     return;
   }
 
-  card->erase_block_start =
-    card->current_argument[ 3 ] +
-    (card->current_argument[ 2 ] << 8) +
-    (card->current_argument[ 1 ] << 16) +
-    (card->current_argument[ 0 ] << 24);
+  card->erase_block_start = get_argument( card );
 
   /* Sector out of range */
   if( card->erase_block_start >= card->total_sectors ) {
@@ -334,11 +404,7 @@ erase_wr_blk_end( libspectrum_mmc_card *card )
     return;
   }
 
-  card->erase_block_end =
-    card->current_argument[ 3 ] +
-    (card->current_argument[ 2 ] << 8) +
-    (card->current_argument[ 1 ] << 16) +
-    (card->current_argument[ 0 ] << 24);
+  card->erase_block_end = get_argument( card );
 
   /* Sector out of range */
   if( card->erase_block_end >= card->total_sectors ) {
@@ -409,11 +475,7 @@ read_single_block( libspectrum_mmc_card *card )
     return;
   }
 
-  sector_number =
-    card->current_argument[ 3 ] +
-    (card->current_argument[ 2 ] << 8) +
-    (card->current_argument[ 1 ] << 16) +
-    (card->current_argument[ 0 ] << 24);
+  sector_number = get_argument( card );
 
   /* Sector out of range */
   if( sector_number >= card->total_sectors ) {
@@ -445,6 +507,83 @@ read_single_block( libspectrum_mmc_card *card )
   card->response_buffer_end = card->response_buffer + 516;
 }
 
+/* Put as many blocks of a multiple block read as will fit into the
+   response buffer after the first `offset' bytes */
+static void
+fill_read_ahead( libspectrum_mmc_card *card, size_t offset )
+{
+  libspectrum_byte *block = &card->response_buffer[ offset ];
+  int i;
+
+  for( i = 0; i < MMC_READ_AHEAD; i++ ) {
+
+    /* Reading past the end of the card just stops the data */
+    if( card->multiple_sector >= card->total_sectors ) {
+      card->multiple_read = 0;
+      break;
+    }
+
+    if( libspectrum_ide_read_sector_from_hdf(
+          &card->drive, card->cache, card->multiple_sector, &block[ 1 ] ) ) {
+      /* Data retrieval error */
+      *block++ = 0x01;
+      card->multiple_read = 0;
+      break;
+    }
+
+    block[ 0 ] = START_BLOCK_TOKEN;
+
+    /* CRC */
+    memset( &block[ 513 ], 0x00, 2 );
+
+    block += MMC_BLOCK_LENGTH;
+    card->multiple_sector++;
+  }
+
+  card->response_buffer_next = card->response_buffer;
+  card->response_buffer_end = block;
+}
+
+static void
+read_multiple_block( libspectrum_mmc_card *card )
+{
+  libspectrum_dword sector_number;
+
+  /* Card initialised? */
+  if( card->r1_status & IN_IDLE_STATE_MASK ) {
+    card->r1_status |= ILLEGAL_COMMAND_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  sector_number = get_argument( card );
+
+  /* Sector out of range */
+  if( sector_number >= card->total_sectors ) {
+    card->r1_status |= PARAMETER_ERROR_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  card->response_buffer[ 0 ] = card->r1_status;
+  card->multiple_sector = sector_number;
+  card->multiple_read = 1;
+
+  fill_read_ahead( card, 1 );
+}
+
+static void
+stop_transmission( libspectrum_mmc_card *card )
+{
+  card->multiple_read = 0;
+
+  /* R1 response after a stuff byte */
+  card->response_buffer[ 0 ] = 0xff;
+  card->response_buffer[ 1 ] = card->r1_status;
+  card->response_buffer_next = card->response_buffer;
+  card->response_buffer_end = card->response_buffer + 2;
+}
+
 static void
 send_csd( libspectrum_mmc_card *card )
 {
@@ -470,8 +609,8 @@ send_csd( libspectrum_mmc_card *card )
   /* READ_BL_LEN = 9 => 2 ^ 9 = 512 byte sectors */
   card->response_buffer[ 2 +  5 ] |= 0x09;
 
-  /* C_SIZE (spread 6 bits, 8 bits, 8 bits across three bytes),
-     first 6 bits set to zero */
+  /* C_SIZE (spread 6 bits, 8 bits, 8 bits across three bytes) */
+  card->response_buffer[ 2 +  7 ] = ( card->c_size >> 16 ) & 0x3f;
   card->response_buffer[ 2 +  8 ] = ( card->c_size >> 8 ) & 0xff;
   card->response_buffer[ 2 +  9 ] = card->c_size & 0xff;
 
@@ -590,12 +729,22 @@ do_standard_command( libspectrum_mmc_card *card )
     case SEND_CID:
       send_cid( card );
       break;
+    case STOP_TRANSMISSION:
+      stop_transmission( card );
+      break;
     case READ_SINGLE_BLOCK:
       read_single_block( card );
       break;
+    case READ_MULTIPLE_BLOCK:
+      read_multiple_block( card );
+      break;
     case WRITE_BLOCK:
       set_response_buffer_r1( card );
       break;
+    case WRITE_MULTIPLE_BLOCK:
+      card->multiple_sector = get_argument( card );
+      set_response_buffer_r1( card );
+      break;
     case ERASE_WR_BLK_START:
       erase_wr_blk_start( card );
       break;
@@ -629,6 +778,10 @@ do_standard_command( libspectrum_mmc_card *card )
 static void
 do_command( libspectrum_mmc_card *card )
 {
+  /* Any command ends a multiple block read, though only STOP_TRANSMISSION
+     should be sent */
+  card->multiple_read = 0;
+
   /* Previous APP_CMD indicates to the card that the next command is an
      application specific command rather than a standard command */
   if( card->cmd55_issued ) {
@@ -636,10 +789,14 @@ do_command( libspectrum_mmc_card *card )
 
     /* If a non-ACMD is sent, then it is respected by the card as a normal
        SD Memory Card command */
-    if( do_application_command( card ) )
+    if( do_application_command( card ) ) {
+      card->drive.stats.commands[ 64 + card->current_command ]++;
       return;
+    }
   }
 
+  card->drive.stats.commands[ card->current_command ]++;
+
   /* Check ongoing erase sequence */
   if( card->erase_sequence != SEQ_ERASE_NONE ) {
     switch( card->current_command ) {
@@ -671,11 +828,7 @@ write_single_block( libspectrum_mmc_card *card )
     return;
   }
 
-  sector_number =
-    card->current_argument[ 3 ] +
-    (card->current_argument[ 2 ] << 8) +
-    (card->current_argument[ 1 ] << 16) +
-    (card->current_argument[ 0 ] << 24);
+  sector_number = get_argument( card );
 
   /* Sector out of range */
   if( sector_number >= card->total_sectors ) {
@@ -687,12 +840,40 @@ write_single_block( libspectrum_mmc_card *card )
   libspectrum_ide_write_sector_to_hdf( &card->drive, card->cache, sector_number,
                                        card->send_buffer );
 
-  card->response_buffer[ 0 ] = 0x05; /* data response */
+  card->response_buffer[ 0 ] = DATA_ACCEPTED; /* data response */
   card->response_buffer[ 1 ] = 0x01; /* busy flag (end of programming) */
   card->response_buffer_next = card->response_buffer;
   card->response_buffer_end = card->response_buffer + 2;
 }
 
+/* Write one block of a WRITE_MULTIPLE_BLOCK command */
+static void
+write_multiple_block( libspectrum_mmc_card *card )
+{
+  libspectrum_byte response = DATA_ACCEPTED;
+
+  /* Card initialised? */
+  if( card->r1_status & IN_IDLE_STATE_MASK ) {
+    card->r1_status |= ILLEGAL_COMMAND_MASK;
+    set_response_buffer_r1( card );
+    return;
+  }
+
+  if( card->multiple_sector < card->total_sectors ) {
+    libspectrum_ide_write_sector_to_hdf( &card->drive, card->cache,
+                                         card->multiple_sector++,
+                                         card->send_buffer );
+  } else {
+    /* Sector out of range */
+    response = DATA_WRITE_ERROR;
+  }
+
+  card->response_buffer[ 0 ] = response; /* data response */
+  card->response_buffer[ 1 ] = 0x01;     /* busy flag (end of programming) */
+  card->response_buffer_next = card->response_buffer;
+  card->response_buffer_end = card->response_buffer + 2;
+}
+
 static void
 do_command_data( libspectrum_mmc_card *card )
 {
@@ -700,6 +881,9 @@ do_command_data( libspectrum_mmc_card *card )
     case WRITE_BLOCK:
       write_single_block( card );
       break;
+    case WRITE_MULTIPLE_BLOCK:
+      write_multiple_block( card );
+      break;
     default:
       /* This should never happen as it indicates a failure in our state machine */
       libspectrum_print_error(
@@ -735,12 +919,22 @@ libspectrum_mmc_write( libspectrum_mmc_card *card, libspectrum_byte data )
       /* reset command error flags except in_idle */
       card->r1_status &= IN_IDLE_STATE_MASK;
 
-      card->command_state = card->current_command == WRITE_BLOCK ?
+      card->command_state = ( card->current_command == WRITE_BLOCK ||
+                              card->current_command == WRITE_MULTIPLE_BLOCK ) ?
         WAITING_FOR_DATA_TOKEN :
         WAITING_FOR_COMMAND;
       break;
     case WAITING_FOR_DATA_TOKEN:
-      if( data == 0xfe ) {
+      if( card->current_command == WRITE_MULTIPLE_BLOCK ) {
+        if( data == START_MULTIPLE_BLOCK_TOKEN ) {
+          card->command_state = WAITING_FOR_DATA;
+          card->data_count = 0;
+        } else if( data == STOP_TRAN_TOKEN ) {
+          /* Programming is instant, so the card is never busy */
+          card->response_buffer_next = card->response_buffer_end;
+          card->command_state = WAITING_FOR_COMMAND;
+        }
+      } else if( data == START_BLOCK_TOKEN ) {
         card->command_state = WAITING_FOR_DATA;
         card->data_count = 0;
       }
@@ -756,7 +950,9 @@ libspectrum_mmc_write( libspectrum_mmc_card *card, libspectrum_byte data )
       break;
     case WAITING_FOR_DATA_CRC2:
       do_command_data( card );
-      card->command_state = WAITING_FOR_COMMAND;
+      card->command_state = card->current_command == WRITE_MULTIPLE_BLOCK ?
+        WAITING_FOR_DATA_TOKEN :
+        WAITING_FOR_COMMAND;
       break;
     }
 }
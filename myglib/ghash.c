@@ -38,7 +38,14 @@
 
 #include "internals.h"
 
-#define HASH_TABLE_SIZE 241
+/* The table uses open addressing with linear probing. Each slot records
+   the hash of its key; these two values are reserved to mark slots which
+   have never been used and slots whose entry has been removed */
+#define UNUSED_HASH_VALUE 0
+#define TOMBSTONE_HASH_VALUE 1
+#define HASH_IS_REAL(h) ((h) >= 2)
+
+#define HASH_TABLE_MIN_SIZE 8
 
 typedef struct _GHashNode      GHashNode;
 
@@ -46,42 +53,42 @@ struct _GHashNode
 {
   gpointer   key;
   gpointer   value;
-  GHashNode *next;
+  guint      key_hash;
 };
 
 struct _GHashTable
 {
+  guint         size;
+  guint         mask;
   gint          nnodes;
-  GHashNode   **nodes;
+  gint          noccupied;  /* nodes + tombstones */
+  GHashNode    *nodes;
   GHashFunc	hash_func;
   GCompareFunc	key_equal_func;
   GDestroyNotify	key_destroy_func;
   GDestroyNotify	value_destroy_func;
 };
 
-static GHashNode *node_free_list = NULL;
-static GHashNode *node_allocated_list = NULL;
-
-#ifdef HAVE_STDATOMIC_H
-
-static atomic_char atomic_locker = ATOMIC_VAR_INIT(0);
-
-#define lock() atomic_lock( &atomic_locker )
-#define unlock() atomic_unlock( &atomic_locker )
-
-#else				/* #ifdef HAVE_STDATOMIC_H */
-
-#define lock()
-#define unlock()
-
-#endif				/* #ifdef HAVE_STDATOMIC_H */
-
 static guint
 g_direct_hash (gconstpointer v)
 {
   return GPOINTER_TO_UINT (v);
 }
 
+static GHashNode*
+g_hash_nodes_new (guint size)
+{
+  GHashNode *nodes;
+  guint i;
+
+  nodes = libspectrum_malloc (size * sizeof (GHashNode));
+
+  for (i = 0; i < size; i++)
+    nodes[i].key_hash = UNUSED_HASH_VALUE;
+
+  return nodes;
+}
+
 GHashTable*
 g_hash_table_new (GHashFunc	hash_func,
 		  GCompareFunc	key_equal_func)
@@ -96,128 +103,164 @@ g_hash_table_new_full (GHashFunc       hash_func,
 		       GDestroyNotify  value_destroy_func)
 {
   GHashTable *hash_table;
-  guint i;
 
   hash_table = libspectrum_malloc (sizeof (GHashTable));
 
+  hash_table->size = HASH_TABLE_MIN_SIZE;
+  hash_table->mask = HASH_TABLE_MIN_SIZE - 1;
   hash_table->nnodes = 0;
+  hash_table->noccupied = 0;
   hash_table->hash_func = hash_func? hash_func : g_direct_hash;
   hash_table->key_equal_func = key_equal_func;
   hash_table->key_destroy_func   = key_destroy_func;
   hash_table->value_destroy_func = value_destroy_func;
-  hash_table->nodes = libspectrum_malloc (HASH_TABLE_SIZE * sizeof (GHashNode*));
-
-  for (i = 0; i < HASH_TABLE_SIZE; i++)
-    hash_table->nodes[i] = NULL;
+  hash_table->nodes = g_hash_nodes_new (hash_table->size);
 
   return hash_table;
 }
 
-static void
-g_hash_nodes_destroy (GHashNode *hash_node,
-                      GFreeFunc  key_destroy_func,
-                      GFreeFunc  value_destroy_func)
-{
-  if (hash_node)
-    {
-      GHashNode *node = hash_node;
-
-      while (node->next) {
-        if (key_destroy_func)
-          key_destroy_func (node->key);
-        if (value_destroy_func)
-          value_destroy_func (node->value);
-
-        node = node->next;
-      }
-
-      if (key_destroy_func)
-        key_destroy_func (node->key);
-      if (value_destroy_func)
-        value_destroy_func (node->value);
-
-      lock();
-      node->next = node_free_list;
-      node_free_list = hash_node;
-      unlock();
-    }
-}
-
 void
 g_hash_table_destroy (GHashTable *hash_table)
 {
   guint i;
   
-  for (i = 0; i < HASH_TABLE_SIZE; i++)
-    g_hash_nodes_destroy (hash_table->nodes[i],
-                          hash_table->key_destroy_func,
-                          hash_table->value_destroy_func);
+  for (i = 0; i < hash_table->size; i++)
+    {
+      GHashNode *node = &hash_table->nodes[i];
+
+      if (!HASH_IS_REAL (node->key_hash))
+        continue;
+
+      if (hash_table->key_destroy_func)
+        hash_table->key_destroy_func (node->key);
+      if (hash_table->value_destroy_func)
+        hash_table->value_destroy_func (node->value);
+    }
 
   libspectrum_free (hash_table->nodes);
   libspectrum_free (hash_table);
 }
 
-static GHashNode**
-g_hash_table_lookup_node (GHashTable    *hash_table,
-                          gconstpointer  key)
+/* Spread the bits of the user's hash so that tables with a power of two
+   size don't just use the low bits, and avoid the reserved values */
+static guint
+g_hash_table_hash (GHashTable    *hash_table,
+                   gconstpointer  key)
 {
-  GHashNode **node;
-  
-  node = &hash_table->nodes
-    [(* hash_table->hash_func) (key) % HASH_TABLE_SIZE];
-
-  while( *node ) {
-    if( hash_table->key_equal_func ) {
-        if( hash_table->key_equal_func( (*node)->key, key ) ) break;
-    } else if( (*node)->key == key ) {
-      break;
-    }
+  guint hash_value = (* hash_table->hash_func) (key);
+
+  hash_value *= 0x9e3779b1U;
+  hash_value ^= hash_value >> 15;
 
-    node = &(*node)->next;
-  }
+  if (!HASH_IS_REAL (hash_value))
+    hash_value = 2;
 
-  return node;
+  return hash_value;
 }
 
-gpointer
-g_hash_table_lookup (GHashTable   *hash_table,
-		     gconstpointer key)
+/* Find the slot holding `key'. If it's not present, return the slot where
+   it should be inserted, preferring the first tombstone seen */
+static guint
+g_hash_table_lookup_node (GHashTable    *hash_table,
+                          gconstpointer  key,
+                          guint          hash_value)
 {
   GHashNode *node;
+  guint node_index;
+  guint first_tombstone = 0;
+  gboolean have_tombstone = FALSE;
 
-  node = *g_hash_table_lookup_node (hash_table, key);
+  node_index = hash_value & hash_table->mask;
+  node = &hash_table->nodes[node_index];
 
-  return node ? node->value : NULL;
+  while (node->key_hash != UNUSED_HASH_VALUE)
+    {
+      if (node->key_hash == hash_value)
+        {
+          if (hash_table->key_equal_func)
+            {
+              if (hash_table->key_equal_func (node->key, key))
+                return node_index;
+            }
+          else if (node->key == key)
+            {
+              return node_index;
+            }
+        }
+      else if (node->key_hash == TOMBSTONE_HASH_VALUE && !have_tombstone)
+        {
+          first_tombstone = node_index;
+          have_tombstone = TRUE;
+        }
+
+      node_index = (node_index + 1) & hash_table->mask;
+      node = &hash_table->nodes[node_index];
+    }
+
+  return have_tombstone ? first_tombstone : node_index;
 }
 
-static GHashNode*
-g_hash_node_new (gpointer key,
-                 gpointer value)
+/* Rebuild the table with enough space for the current number of nodes,
+   which also throws away any tombstones */
+static void
+g_hash_table_resize (GHashTable *hash_table)
 {
-  GHashNode *hash_node;
+  GHashNode *old_nodes = hash_table->nodes;
+  guint old_size = hash_table->size;
+  guint new_size = HASH_TABLE_MIN_SIZE;
   guint i;
 
-  lock();
-  if (!node_free_list)
+  while (new_size < (guint)hash_table->nnodes * 2)
+    new_size <<= 1;
+
+  hash_table->size = new_size;
+  hash_table->mask = new_size - 1;
+  hash_table->nodes = g_hash_nodes_new (new_size);
+  hash_table->noccupied = hash_table->nnodes;
+
+  for (i = 0; i < old_size; i++)
     {
-      node_free_list = libspectrum_malloc (1024 * sizeof (GHashNode));
-      node_allocated_list = node_free_list;
+      GHashNode *node = &old_nodes[i];
+      guint node_index;
+
+      if (!HASH_IS_REAL (node->key_hash))
+        continue;
+
+      node_index = node->key_hash & hash_table->mask;
+      while (hash_table->nodes[node_index].key_hash != UNUSED_HASH_VALUE)
+        node_index = (node_index + 1) & hash_table->mask;
 
-      for(i = 0; i < 1023; i++ )
-	node_free_list[i].next = &node_free_list[i+1];
-      node_free_list[1023].next = NULL;
+      hash_table->nodes[node_index] = *node;
     }
 
-  
-  hash_node = node_free_list;
-  node_free_list = node_free_list->next;
-  unlock();
+  libspectrum_free (old_nodes);
+}
 
-  hash_node->key = key;
-  hash_node->value = value;
-  hash_node->next = NULL;
-  
-  return hash_node;
+/* Grow when more than 3/4 of the slots are occupied, and shrink when less
+   than 1/8 of them hold nodes */
+static void
+g_hash_table_maybe_resize (GHashTable *hash_table)
+{
+  guint noccupied = hash_table->noccupied;
+  guint size = hash_table->size;
+
+  if ((size > HASH_TABLE_MIN_SIZE && (guint)hash_table->nnodes < size / 8) ||
+      noccupied > size / 4 * 3)
+    g_hash_table_resize (hash_table);
+}
+
+gpointer
+g_hash_table_lookup (GHashTable   *hash_table,
+		     gconstpointer key)
+{
+  GHashNode *node;
+  guint node_index;
+
+  node_index = g_hash_table_lookup_node (hash_table, key,
+                                         g_hash_table_hash (hash_table, key));
+  node = &hash_table->nodes[node_index];
+
+  return HASH_IS_REAL (node->key_hash) ? node->value : NULL;
 }
 
 void
@@ -225,42 +268,36 @@ g_hash_table_insert (GHashTable *hash_table,
                      gpointer    key,
                      gpointer    value)
 {
-  GHashNode **node;
+  GHashNode *node;
+  guint hash_value, node_index;
   
-  node = g_hash_table_lookup_node (hash_table, key);
+  hash_value = g_hash_table_hash (hash_table, key);
+  node_index = g_hash_table_lookup_node (hash_table, key, hash_value);
+  node = &hash_table->nodes[node_index];
   
-  if (*node)
+  if (HASH_IS_REAL (node->key_hash))
     {
       /* free the passed key */
       if (hash_table->key_destroy_func)
         hash_table->key_destroy_func (key);
       
       if (hash_table->value_destroy_func)
-        hash_table->value_destroy_func ((*node)->value);
+        hash_table->value_destroy_func (node->value);
 
-      (*node)->value = value;
+      node->value = value;
     }
   else
     {
-      *node = g_hash_node_new (key, value);
+      if (node->key_hash == UNUSED_HASH_VALUE)
+        hash_table->noccupied++;
+
+      node->key = key;
+      node->value = value;
+      node->key_hash = hash_value;
       hash_table->nnodes++;
-    }
-}
 
-static void
-g_hash_node_destroy (GHashNode *hash_node,
-		     GDestroyNotify  key_destroy_func,
-		     GDestroyNotify  value_destroy_func)
-{
-  if (key_destroy_func)
-    key_destroy_func (hash_node->key);
-  if (value_destroy_func)
-    value_destroy_func (hash_node->value);
-
-  lock();
-  hash_node->next = node_free_list;
-  node_free_list = hash_node;
-  unlock();
+      g_hash_table_maybe_resize (hash_table);
+    }
 }
 
 guint
@@ -268,43 +305,34 @@ g_hash_table_foreach_remove (GHashTable *hash_table,
                              GHRFunc     func,
                              gpointer    user_data)
 {
-  GHashNode *node, *prev;
   guint i;
   guint deleted = 0;
   
-  for (i = 0; i < HASH_TABLE_SIZE; i++)
+  for (i = 0; i < hash_table->size; i++)
     {
-    restart:
-      
-      prev = NULL;
-      
-      for (node = hash_table->nodes[i]; node; prev = node, node = node->next)
+      GHashNode *node = &hash_table->nodes[i];
+
+      if (!HASH_IS_REAL (node->key_hash))
+        continue;
+
+      if ((* func) (node->key, node->value, user_data))
         {
-          if ((* func) (node->key, node->value, user_data))
-            {
-              deleted += 1;
-
-              hash_table->nnodes -= 1;
-              
-              if (prev)
-                {
-                  prev->next = node->next;
-                  g_hash_node_destroy (node,
-                                       hash_table->key_destroy_func,
-                                       hash_table->value_destroy_func);
-                  node = prev;
-                }
-              else
-                {
-                  hash_table->nodes[i] = node->next;
-                  g_hash_node_destroy (node,
-                                       hash_table->key_destroy_func,
-                                       hash_table->value_destroy_func);
-                  goto restart;
-                }
-            }
+          if (hash_table->key_destroy_func)
+            hash_table->key_destroy_func (node->key);
+          if (hash_table->value_destroy_func)
+            hash_table->value_destroy_func (node->value);
+
+          node->key_hash = TOMBSTONE_HASH_VALUE;
+          node->key = NULL;
+          node->value = NULL;
+
+          hash_table->nnodes -= 1;
+          deleted += 1;
         }
     }
+
+  if (deleted)
+    g_hash_table_maybe_resize (hash_table);
   
   return deleted;
 }
@@ -314,12 +342,12 @@ g_hash_table_foreach (GHashTable *hash_table,
                       GHFunc      func,
                       gpointer    user_data)
 {
-  GHashNode *node;
-  gint i;
+  guint i;
 
-  for (i = 0; i < HASH_TABLE_SIZE; i++)
-    for (node = hash_table->nodes[i]; node; node = node->next)
-      (* func) (node->key, node->value, user_data);
+  for (i = 0; i < hash_table->size; i++)
+    if (HASH_IS_REAL (hash_table->nodes[i].key_hash))
+      (* func) (hash_table->nodes[i].key, hash_table->nodes[i].value,
+                user_data);
 }
 
 guint
@@ -365,13 +393,9 @@ g_str_equal (gconstpointer v1,
   return strcmp (string1, string2) == 0;
 }
 
+/* Nodes are now owned by each table, so there is no global state left */
 void
 libspectrum_hashtable_cleanup( void )
 {
-  lock();
-  libspectrum_free( node_allocated_list );
-  node_allocated_list = NULL;
-  node_free_list = NULL;
-  unlock();
 }
 #endif				/* #ifndef HAVE_LIB_GLIB */
@@ -28,6 +28,10 @@
 
 #include <stdlib.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
 #include "internals.h"
 
 static
@@ -40,8 +44,14 @@ gint	last_function		(gconstpointer	 a,
 
 static int FREE_LIST_ALLOCATE_CHUNK = 1024;
 
-GSList * free_list = NULL;
-GSList * allocated_list = NULL;
+/* Nodes are moved between the global free list and each thread's own free
+   list this many at a time */
+#define LOCAL_FREE_LIST_BATCH 64
+
+/* The global pool of free nodes, and all the chunks nodes have been
+   allocated from, linked through the data pointer of their first node */
+static GSList * free_list = NULL;
+static GSList * allocated_list = NULL;
 
 #ifdef HAVE_STDATOMIC_H
 
@@ -57,20 +67,191 @@ static atomic_char atomic_locker = ATOMIC_VAR_INIT(0);
 
 #endif				/* #ifdef HAVE_STDATOMIC_H */
 
+/* Each thread takes nodes from and returns them to its own free list,
+   only touching the locked global pool once per batch. Without
+   thread-local storage there's just the one `local' list, so that is
+   protected by the lock instead */
+#ifdef LIBSPECTRUM_THREAD_LOCAL
+
+#define LOCAL_FREE_LIST_PER_THREAD
+#define local_lock()
+#define local_unlock()
+#define global_lock() lock()
+#define global_unlock() unlock()
+
+#else				/* #ifdef LIBSPECTRUM_THREAD_LOCAL */
+
+#define LIBSPECTRUM_THREAD_LOCAL
+#define local_lock() lock()
+#define local_unlock() unlock()
+#define global_lock()
+#define global_unlock()
+
+#endif				/* #ifdef LIBSPECTRUM_THREAD_LOCAL */
+
+static LIBSPECTRUM_THREAD_LOCAL GSList * local_free_list = NULL;
+static LIBSPECTRUM_THREAD_LOCAL guint local_free_count = 0;
+
+/* Incremented each time libspectrum_slist_cleanup() frees all the nodes;
+   a thread whose list is from an earlier generation just drops it */
+#ifdef HAVE_STDATOMIC_H
+static atomic_uint cleanup_generation = ATOMIC_VAR_INIT(0);
+#else				/* #ifdef HAVE_STDATOMIC_H */
+static guint cleanup_generation = 0;
+#endif				/* #ifdef HAVE_STDATOMIC_H */
+static LIBSPECTRUM_THREAD_LOCAL guint local_generation = 0;
+
+#if defined LOCAL_FREE_LIST_PER_THREAD && defined HAVE_PTHREAD_H
+
+/* Used only for its destructor, which returns a thread's free nodes to the
+   global pool when the thread exits */
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static LIBSPECTRUM_THREAD_LOCAL int thread_exit_registered = 0;
+
+#define THREAD_EXIT_HOOK
+
+#endif				/* #if defined LOCAL_FREE_LIST_PER_THREAD &&
+				   defined HAVE_PTHREAD_H */
+
+/* Add a new chunk of nodes to the global free list; must be called with
+   the global pool locked */
 static
 void    allocate_free   ( void ) {
-    lock();
-    if(!free_list) {
-        int i;
-        free_list=libspectrum_malloc(FREE_LIST_ALLOCATE_CHUNK*sizeof(GSList));
-        allocated_list = free_list;
-        for(i=0;i<FREE_LIST_ALLOCATE_CHUNK-1;i++)
-            free_list[i].next=&free_list[i+1];
-        free_list[FREE_LIST_ALLOCATE_CHUNK-1].next=NULL;
+    GSList *chunk;
+    int i;
+
+    chunk=libspectrum_malloc(FREE_LIST_ALLOCATE_CHUNK*sizeof(GSList));
+    chunk[0].data = allocated_list;
+    chunk[0].next = NULL;
+    allocated_list = chunk;
+
+    for(i=1;i<FREE_LIST_ALLOCATE_CHUNK-1;i++)
+        chunk[i].next=&chunk[i+1];
+    chunk[FREE_LIST_ALLOCATE_CHUNK-1].next=free_list;
+    free_list=&chunk[1];
+}
+
+/* Forget this thread's free list if the nodes in it have been freed since
+   it was built */
+static
+void    check_local_generation  ( void ) {
+    guint generation = cleanup_generation;
+
+    if(local_generation != generation) {
+        local_free_list = NULL;
+        local_free_count = 0;
+        local_generation = generation;
+    }
+}
+
+#ifdef THREAD_EXIT_HOOK
+
+/* Called as a thread exits: give all its free nodes back */
+static
+void    return_local_free_list  ( void *value GCC_UNUSED ) {
+    GSList *last;
+
+    check_local_generation();
+    if(!local_free_list) return;
+
+    for(last=local_free_list;last->next;last=last->next)
+        ;
+
+    global_lock();
+    /* libspectrum_slist_cleanup() may have run since the check above */
+    if(local_generation == cleanup_generation) {
+        last->next = free_list;
+        free_list = local_free_list;
+    }
+    global_unlock();
+
+    local_free_list = NULL;
+    local_free_count = 0;
+}
+
+static
+void    create_thread_exit_key  ( void ) {
+    pthread_key_create(&thread_exit_key, return_local_free_list);
+}
+
+/* Make sure return_local_free_list() will be called when this thread
+   exits */
+static
+void    register_thread_exit    ( void ) {
+    pthread_once(&thread_exit_once, create_thread_exit_key);
+    pthread_setspecific(thread_exit_key, &thread_exit_registered);
+    thread_exit_registered = 1;
+}
+
+#endif				/* #ifdef THREAD_EXIT_HOOK */
+
+/* Move a batch of nodes from the global pool to this thread's list */
+static
+void    refill_local_free_list  ( void ) {
+    GSList *last;
+
+#ifdef THREAD_EXIT_HOOK
+    if(!thread_exit_registered) register_thread_exit();
+#endif				/* #ifdef THREAD_EXIT_HOOK */
+
+    global_lock();
+    if(!free_list) allocate_free();
+
+    last = free_list;
+    local_free_count = 1;
+    while(last->next && local_free_count < LOCAL_FREE_LIST_BATCH) {
+        last = last->next;
+        local_free_count++;
     }
-    unlock();
+
+    local_free_list = free_list;
+    free_list = last->next;
+    last->next = NULL;
+    global_unlock();
+}
+
+/* Return all but one batch of this thread's free nodes to the global
+   pool */
+static
+void    drain_local_free_list   ( void ) {
+    GSList *keep, *excess, *last;
+    guint i;
+
+    keep = local_free_list;
+    for(i=1;i<LOCAL_FREE_LIST_BATCH;i++) keep = keep->next;
+
+    excess = keep->next;
+    keep->next = NULL;
+    local_free_count = LOCAL_FREE_LIST_BATCH;
+
+    for(last=excess;last->next;last=last->next)
+        ;
+
+    global_lock();
+    last->next = free_list;
+    free_list = excess;
+    global_unlock();
 }
 
+static
+GSList* new_node                ( gpointer data ) {
+    GSList *node;
+
+    local_lock();
+    check_local_generation();
+    if(!local_free_list) refill_local_free_list();
+
+    node = local_free_list;
+    local_free_list = node->next;
+    local_free_count--;
+    local_unlock();
+
+    node->data = data;
+    node->next = NULL;
+
+    return node;
+}
 
 GSList* g_slist_insert	(GSList		*list,
 			 gpointer	 data,
@@ -85,14 +266,7 @@ GSList* g_slist_insert	(GSList		*list,
   else if (position == 0)
     return g_slist_prepend (list, data);
 
-  allocate_free();
-
-  lock();
-  new_list = free_list;
-  free_list=free_list->next;
-  unlock();
-  new_list->data = data;
-  new_list->next=NULL;
+  new_list = new_node(data);
 
   if (!list)
     {
@@ -131,19 +305,11 @@ GSList* g_slist_insert_sorted	(GSList		*list,
   GSList *new_list;
   gint cmp;
 
-  allocate_free();
-
   if(!func) return list;
 
   if (!list)
     {
-      lock();
-      new_list = free_list;
-      free_list=free_list->next;
-      unlock();
-      new_list->data = data;
-      new_list->next=NULL;
-      return new_list;
+      return new_node(data);
     }
 
   cmp = (*func) (data, tmp_list->data);
@@ -155,11 +321,7 @@ GSList* g_slist_insert_sorted	(GSList		*list,
       cmp = (*func) (data, tmp_list->data);
     }
 
-  lock();
-  new_list = free_list;
-  free_list=free_list->next;
-  unlock();
-  new_list->data = data;
+  new_list = new_node(data);
 
   if ((!tmp_list->next) && (cmp > 0))
     {
@@ -310,14 +472,22 @@ void	g_slist_free		(GSList		*list) {
   if (list)
     {
       GSList *last_node = list;
+      guint count = 1;
 
-      while( last_node->next )
+      while( last_node->next ) {
 	last_node = last_node->next;
-
-      lock();
-      last_node->next = free_list;
-      free_list = list;
-      unlock();
+	count++;
+      }
+
+      local_lock();
+      check_local_generation();
+      last_node->next = local_free_list;
+      local_free_list = list;
+      local_free_count += count;
+
+      if( local_free_count > 2 * LOCAL_FREE_LIST_BATCH )
+	drain_local_free_list();
+      local_unlock();
     }
 }
 
@@ -376,14 +546,25 @@ gint	g_slist_position	(GSList		*list,
   return -1;
 }
 
+/* Free all nodes. Any other thread's free list now points at freed
+   memory, so bump the generation to make each thread drop its list the
+   next time it uses it */
 void
 libspectrum_slist_cleanup( void )
 {
   lock();
-  libspectrum_free( allocated_list );
-  allocated_list = NULL;
+  while( allocated_list ) {
+    GSList *next = allocated_list->data;
+    libspectrum_free( allocated_list );
+    allocated_list = next;
+  }
   free_list = NULL;
+  cleanup_generation++;
   unlock();
+
+  local_free_list = NULL;
+  local_free_count = 0;
+  local_generation = cleanup_generation;
 }
 
 #endif				/* #ifndef HAVE_LIB_GLIB */
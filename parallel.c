@@ -0,0 +1,108 @@
+/* parallel.c: run independent jobs on multiple threads
+   Copyright (c) 2021 Philip Kendall
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+#include "internals.h"
+
+#ifdef HAVE_PTHREAD_H
+
+typedef struct parallel_state_t {
+
+  libspectrum_parallel_fn fn;
+  void *jobs;
+  size_t count;
+
+  /* The next job to be picked up by a worker */
+  size_t next;
+  pthread_mutex_t lock;
+
+} parallel_state_t;
+
+static void*
+parallel_worker( void *data )
+{
+  parallel_state_t *state = data;
+  size_t index;
+
+  while( 1 ) {
+
+    pthread_mutex_lock( &state->lock );
+    index = state->next++;
+    pthread_mutex_unlock( &state->lock );
+
+    if( index >= state->count ) break;
+
+    state->fn( state->jobs, index );
+  }
+
+  return NULL;
+}
+
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+void
+libspectrum_run_parallel( libspectrum_parallel_fn fn, void *jobs, size_t count,
+                          int threads )
+{
+#ifdef HAVE_PTHREAD_H
+  parallel_state_t state;
+  pthread_t *workers;
+  size_t i, started;
+
+  if( threads > 1 && count > 1 ) {
+
+    if( (size_t)threads > count ) threads = count;
+
+    state.fn = fn; state.jobs = jobs; state.count = count; state.next = 0;
+    pthread_mutex_init( &state.lock, NULL );
+
+    /* This thread does its share of the work too, so only start
+       threads - 1 others. If we can't start a thread, the remaining
+       threads just pick up its jobs */
+    workers = libspectrum_new( pthread_t, threads - 1 );
+    for( started = 0; started < (size_t)threads - 1; started++ )
+      if( pthread_create( &workers[ started ], NULL, parallel_worker,
+                          &state ) )
+        break;
+
+    parallel_worker( &state );
+
+    for( i = 0; i < started; i++ ) pthread_join( workers[i], NULL );
+
+    libspectrum_free( workers );
+    pthread_mutex_destroy( &state.lock );
+
+    return;
+  }
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  {
+    size_t i;
+    for( i = 0; i < count; i++ ) fn( jobs, i );
+  }
+}
@@ -59,8 +59,20 @@ typedef struct libspectrum_rzx_frame_t {
   int repeat_last;			/* Set if we should use the last
 					   frame's IN bytes */
 
+  int shared;				/* Set if `in_bytes' belongs to an
+					   earlier frame in the same block */
+
 } libspectrum_rzx_frame_t;
 
+/* An entry in the dictionary of recently recorded IN byte sequences */
+typedef struct rzx_dictionary_entry_t {
+
+  libspectrum_dword hash;
+  size_t count;
+  libspectrum_byte *in_bytes;
+
+} rzx_dictionary_entry_t;
+
 typedef struct input_block_t {
 
   libspectrum_rzx_frame_t *frames;
@@ -75,6 +87,11 @@ typedef struct input_block_t {
      every time */
   size_t non_repeat;
 
+  /* Used for recording to find earlier frames with the same IN bytes, so
+     their data can be shared. NULL if not in use */
+  rzx_dictionary_entry_t *dictionary;
+  size_t dictionary_size;
+
 } input_block_t;
 
 typedef struct snapshot_block_t {
@@ -90,6 +107,10 @@ typedef struct signature_block_t {
 
 #ifdef HAVE_GCRYPT_H
   gcry_mpi_t r, s;
+
+  /* Hash of the signed data, calculated as the file was read */
+  libspectrum_byte *digest;
+  size_t digest_length;
 #endif			/* #ifdef HAVE_GCRYPT_H */
 
 } signature_block_t;
@@ -113,6 +134,20 @@ struct libspectrum_rzx {
 
   GSList *blocks;
 
+  /* The final link in the block list, so appends don't have to walk the
+     list */
+  GSList *last_block;
+
+  /* The links of all the snapshot blocks in the list, in order, so
+     rollbacks can find the snapshot they need without a list walk */
+  GArray *snaps;
+
+  /* Number of entries in the IN byte dictionary of new input blocks */
+  size_t dictionary_size;
+
+  /* Number of threads to use when writing the recording */
+  int write_threads;
+
   /* Playback variables */
   GSList *current_block;
   input_block_t *current_input;
@@ -160,13 +195,25 @@ static void
 rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
                  libspectrum_buffer *block_data, int compress );
 static libspectrum_error
+rzx_write_block( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                 rzx_block_t *block, libspectrum_id_t snap_format,
+                 libspectrum_creator *creator, int compress );
+static libspectrum_error
+rzx_write_blocks_parallel( libspectrum_buffer *buffer, libspectrum_rzx *rzx,
+                           libspectrum_id_t snap_format,
+                           libspectrum_creator *creator, int compress );
+static libspectrum_error
 rzx_write_signed_start( libspectrum_buffer *buffer,
                         libspectrum_buffer *block_data,
                         libspectrum_rzx_dsa_key *key,
 			libspectrum_creator *creator );
+static void
+rzx_flush_written( libspectrum_hash_context *hash, libspectrum_buffer *buffer,
+                   size_t *hashed );
 static libspectrum_error
 rzx_write_signed_end( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                      libspectrum_rzx_dsa_key *key );
+                      libspectrum_rzx_dsa_key *key,
+                      libspectrum_hash_context *hash );
 
 /* The signature used to identify .rzx files */
 static const char * const rzx_signature = "RZX!";
@@ -199,8 +246,10 @@ block_free( rzx_block_t *block )
   case LIBSPECTRUM_RZX_INPUT_BLOCK:
     input = &( block->types.input );
     for( i = 0; i < input->count; i++ )
-      if( !input->frames[i].repeat_last ) libspectrum_free( input->frames[i].in_bytes );
+      if( !input->frames[i].repeat_last && !input->frames[i].shared )
+        libspectrum_free( input->frames[i].in_bytes );
     libspectrum_free( input->frames );
+    libspectrum_free( input->dictionary );
     libspectrum_free( block );
     return LIBSPECTRUM_ERROR_NONE;
 
@@ -218,6 +267,7 @@ block_free( rzx_block_t *block )
     signature = &( block->types.signature );
     gcry_mpi_release( signature->r );
     gcry_mpi_release( signature->s );
+    libspectrum_free( signature->digest );
 #endif				/* #ifdef HAVE_GCRYPT_H */
 
     libspectrum_free( block );
@@ -240,6 +290,59 @@ block_free_wrapper( gpointer data, gpointer user_data )
   block_free( data );
 }
 
+static void
+rzx_append_block( libspectrum_rzx *rzx, rzx_block_t *block )
+{
+  if( rzx->blocks == NULL ) {
+    rzx->blocks = g_slist_append( rzx->blocks, block );
+    rzx->last_block = rzx->blocks;
+  } else {
+    rzx->last_block = g_slist_append( rzx->last_block, block )->next;
+  }
+
+  if( block->type == LIBSPECTRUM_RZX_SNAPSHOT_BLOCK )
+    g_array_append_val( rzx->snaps, rzx->last_block );
+}
+
+/* Rebuild the tail pointer and snapshot index after the list has been
+   modified other than by appending or truncating */
+static void
+rzx_reindex( libspectrum_rzx *rzx )
+{
+  GSList *list;
+
+  g_array_set_size( rzx->snaps, 0 );
+  rzx->last_block = NULL;
+
+  for( list = rzx->blocks; list; list = list->next ) {
+    rzx_block_t *block = list->data;
+
+    if( block->type == LIBSPECTRUM_RZX_SNAPSHOT_BLOCK )
+      g_array_append_val( rzx->snaps, list );
+
+    rzx->last_block = list;
+  }
+}
+
+/* Delete all blocks after the nth snapshot and return that snapshot */
+static void
+rzx_truncate_after_snap( libspectrum_rzx *rzx, size_t which,
+                         libspectrum_snap **snap )
+{
+  GSList *link = g_array_index( rzx->snaps, GSList*, which );
+  rzx_block_t *block;
+
+  g_slist_foreach( link->next, block_free_wrapper, NULL );
+  g_slist_free( link->next );
+  link->next = NULL;
+
+  rzx->last_block = link;
+  g_array_set_size( rzx->snaps, which + 1 );
+
+  block = link->data;
+  *snap = block->types.snap.snap;
+}
+
 static gint
 find_block( gconstpointer a, gconstpointer b )
 {
@@ -258,6 +361,10 @@ libspectrum_rzx_alloc( void )
 {
   libspectrum_rzx *rzx = libspectrum_new( libspectrum_rzx, 1 );
   rzx->blocks = NULL;
+  rzx->last_block = NULL;
+  rzx->snaps = g_array_new( FALSE, FALSE, sizeof( GSList* ) );
+  rzx->dictionary_size = 0;
+  rzx->write_threads = 1;
   rzx->current_block = NULL;
   rzx->current_input = NULL;
   rzx->signed_start = NULL;
@@ -279,16 +386,43 @@ libspectrum_rzx_start_input( libspectrum_rzx *rzx, libspectrum_dword tstates )
   rzx->current_input->count = 0;
   rzx->current_input->non_repeat = 0;
 
-  rzx->blocks = g_slist_append( rzx->blocks, block );
+  rzx->current_input->dictionary_size = rzx->dictionary_size;
+  if( rzx->dictionary_size ) {
+    rzx->current_input->dictionary =
+      libspectrum_new0( rzx_dictionary_entry_t, rzx->dictionary_size );
+  } else {
+    rzx->current_input->dictionary = NULL;
+  }
+
+  rzx_append_block( rzx, block );
 }
 
 libspectrum_error
 libspectrum_rzx_stop_input( libspectrum_rzx *rzx )
 {
+  /* The dictionary is only needed while recording */
+  if( rzx->current_input ) {
+    libspectrum_free( rzx->current_input->dictionary );
+    rzx->current_input->dictionary = NULL;
+    rzx->current_input->dictionary_size = 0;
+  }
+
   rzx->current_input = NULL;
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+void
+libspectrum_rzx_set_frame_dictionary( libspectrum_rzx *rzx, size_t size )
+{
+  rzx->dictionary_size = size;
+}
+
+void
+libspectrum_rzx_set_write_threads( libspectrum_rzx *rzx, int threads )
+{
+  rzx->write_threads = threads;
+}
+
 libspectrum_error
 libspectrum_rzx_add_snap( libspectrum_rzx *rzx, libspectrum_snap *snap, int automatic )
 {
@@ -301,7 +435,7 @@ libspectrum_rzx_add_snap( libspectrum_rzx *rzx, libspectrum_snap *snap, int auto
   block->types.snap.snap = snap;
   block->types.snap.automatic = automatic;
 
-  rzx->blocks = g_slist_append( rzx->blocks, block );
+  rzx_append_block( rzx, block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -309,25 +443,8 @@ libspectrum_rzx_add_snap( libspectrum_rzx *rzx, libspectrum_snap *snap, int auto
 libspectrum_error
 libspectrum_rzx_rollback( libspectrum_rzx *rzx, libspectrum_snap **snap )
 {
-  GSList *previous, *list;
-  rzx_block_t *block;
-
   /* Find the last snapshot block in the file */
-  previous = NULL; list = rzx->blocks;
-
-  while( 1 ) {
-    list =
-      g_slist_find_custom( list,
-			   GINT_TO_POINTER( LIBSPECTRUM_RZX_SNAPSHOT_BLOCK ),
-			   find_block );
-    if( !list ) break;
-
-    previous = list;
-    list = list->next;
-  }
-    
-
-  if( !previous ) {
+  if( !rzx->snaps->len ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "no snapshot block found in recording" );
     return LIBSPECTRUM_ERROR_CORRUPT;
@@ -337,12 +454,7 @@ libspectrum_rzx_rollback( libspectrum_rzx *rzx, libspectrum_snap **snap )
     libspectrum_rzx_stop_input( rzx );
   }
 
-  /* Delete all blocks after the snapshot */
-  g_slist_foreach( previous->next, block_free_wrapper, NULL );
-  previous->next = NULL;
-
-  block = previous->data;
-  *snap = block->types.snap.snap;
+  rzx_truncate_after_snap( rzx, rzx->snaps->len - 1, snap );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -351,36 +463,19 @@ libspectrum_error
 libspectrum_rzx_rollback_to( libspectrum_rzx *rzx, libspectrum_snap **snap,
 			     size_t which )
 {
-  GSList *previous = NULL, *list;
-  rzx_block_t *block;
-  size_t i;
-
   /* Find the nth snapshot block in the file */
-  for( i = 0, list = rzx->blocks; i <= which; i++, list = list->next ) {
-    list =
-      g_slist_find_custom( list,
-			   GINT_TO_POINTER( LIBSPECTRUM_RZX_SNAPSHOT_BLOCK ),
-			   find_block );
-    if( !list ) {
-      libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
-			       "snapshot block %lu not found in recording",
-			       (unsigned long)which );
-      return LIBSPECTRUM_ERROR_CORRUPT;
-    }
-
-    previous = list;
+  if( which >= rzx->snaps->len ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+			     "snapshot block %lu not found in recording",
+			     (unsigned long)which );
+    return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
   if( rzx->current_input ) {
     libspectrum_rzx_stop_input( rzx );
   }
 
-  /* Delete all blocks after the snapshot */
-  g_slist_foreach( previous->next, block_free_wrapper, NULL );
-  previous->next = NULL;
-
-  block = previous->data;
-  *snap = block->types.snap.snap;
+  rzx_truncate_after_snap( rzx, which, snap );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -409,6 +504,21 @@ input_block_resize( input_block_t *input, size_t new_count )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* FNV-1a hash of a frame's IN bytes */
+static libspectrum_dword
+rzx_hash_bytes( const libspectrum_byte *bytes, size_t count )
+{
+  libspectrum_dword hash = 0x811c9dc5;
+  size_t i;
+
+  for( i = 0; i < count; i++ ) {
+    hash ^= bytes[i];
+    hash *= 0x01000193;
+  }
+
+  return hash;
+}
+
 libspectrum_error
 libspectrum_rzx_store_frame( libspectrum_rzx *rzx, size_t instructions,
 			     size_t count, libspectrum_byte *in_bytes )
@@ -438,6 +548,8 @@ libspectrum_rzx_store_frame( libspectrum_rzx *rzx, size_t instructions,
 
   frame->instructions = instructions;
 
+  frame->shared = 0;
+
   /* Check for repeated frames */
   if( input->count != 0 && count != 0 &&
       count == input->frames[ input->non_repeat ].count &&
@@ -459,10 +571,35 @@ libspectrum_rzx_store_frame( libspectrum_rzx *rzx, size_t instructions,
 
     if( count ) {
 
-      frame->in_bytes = libspectrum_new( libspectrum_byte, count );
+      rzx_dictionary_entry_t *entry = NULL;
+      libspectrum_dword hash = 0;
 
-      memcpy( frame->in_bytes, in_bytes,
-	      count * sizeof( *( frame->in_bytes ) ) );
+      /* See if we've recorded these bytes recently; if so, just refer to
+         the earlier copy */
+      if( input->dictionary ) {
+        hash = rzx_hash_bytes( in_bytes, count );
+        entry = &input->dictionary[ hash % input->dictionary_size ];
+
+        if( entry->in_bytes && entry->hash == hash && entry->count == count &&
+            !memcmp( in_bytes, entry->in_bytes, count ) ) {
+          frame->in_bytes = entry->in_bytes;
+          frame->shared = 1;
+        }
+      }
+
+      if( !frame->shared ) {
+
+        frame->in_bytes = libspectrum_new( libspectrum_byte, count );
+
+        memcpy( frame->in_bytes, in_bytes,
+                count * sizeof( *( frame->in_bytes ) ) );
+
+        if( entry ) {
+          entry->hash = hash;
+          entry->count = count;
+          entry->in_bytes = frame->in_bytes;
+        }
+      }
 
     } else {
 
@@ -606,11 +743,40 @@ libspectrum_rzx_playback( libspectrum_rzx *rzx, libspectrum_byte *byte )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+libspectrum_error
+libspectrum_rzx_playback_frame_data( libspectrum_rzx *rzx,
+                                     const libspectrum_byte **bytes,
+                                     size_t *count, size_t *instructions )
+{
+  if( !rzx->current_input ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_INVALID,
+      "libspectrum_rzx_playback_frame_data called with no active input block"
+    );
+    return LIBSPECTRUM_ERROR_INVALID;
+  }
+
+  /* Hand out whatever hasn't already been read via
+     libspectrum_rzx_playback(); data_frame already points at the frame
+     being repeated if this one is a repeat */
+  *bytes = rzx->data_frame->in_bytes ?
+           rzx->data_frame->in_bytes + rzx->in_count : NULL;
+  *count = rzx->data_frame->count - rzx->in_count;
+  *instructions =
+    rzx->current_input->frames[ rzx->current_frame ].instructions;
+
+  /* All the bytes are now considered read */
+  rzx->in_count = rzx->data_frame->count;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 libspectrum_error
 libspectrum_rzx_free( libspectrum_rzx *rzx )
 {
   g_slist_foreach( rzx->blocks, block_free_wrapper, NULL );
   g_slist_free( rzx->blocks );
+  g_array_free( rzx->snaps, TRUE );
   libspectrum_free( rzx );
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -674,17 +840,56 @@ libspectrum_rzx_get_signature( libspectrum_rzx *rzx,
 
   return LIBSPECTRUM_ERROR_NONE;
 }
-  
 
 libspectrum_error
-libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
-		      size_t length )
+libspectrum_rzx_verify_signature( libspectrum_rzx *rzx,
+                                  libspectrum_rzx_dsa_key *key )
+{
+#ifdef HAVE_GCRYPT_H
+  GSList *list;
+  rzx_block_t *block;
+  signature_block_t *sigblock;
+
+  list =
+    g_slist_find_custom( rzx->blocks,
+			 GINT_TO_POINTER( LIBSPECTRUM_RZX_SIGN_END_BLOCK ),
+			 find_block );
+  if( !list ) {
+    libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
+			     "no end of signed data block found" );
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  }
+
+  block = list->data;
+  sigblock = &( block->types.signature );
+
+  /* Uses the hash calculated while the recording was read, so the data
+     doesn't need to be hashed again */
+  return libspectrum_verify_digest( sigblock->digest, sigblock->digest_length,
+                                    sigblock->r, sigblock->s, key );
+
+#else				/* #ifdef HAVE_GCRYPT_H */
+
+  libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
+                           "libspectrum_rzx_verify_signature: "
+                           "verification needs libgcrypt" );
+  return LIBSPECTRUM_ERROR_UNKNOWN;
+
+#endif				/* #ifdef HAVE_GCRYPT_H */
+}
+
+static libspectrum_error
+rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
+	  size_t length )
 {
   libspectrum_error error;
   const libspectrum_byte *ptr, *end;
   libspectrum_byte *new_buffer;
   libspectrum_id_t raw_type;
   libspectrum_class_t class;
+#ifdef HAVE_GCRYPT_H
+  libspectrum_hash_context *hash = NULL;
+#endif				/* #ifdef HAVE_GCRYPT_H */
 
   /* Find out if this file needs decompression */
   new_buffer = NULL;
@@ -715,6 +920,9 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
   while( ptr < end ) {
 
     libspectrum_byte id;
+#ifdef HAVE_GCRYPT_H
+    const libspectrum_byte *block_start = ptr;
+#endif				/* #ifdef HAVE_GCRYPT_H */
 
     id = *ptr++;
 
@@ -722,42 +930,48 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
 
     case LIBSPECTRUM_RZX_CREATOR_BLOCK:
       error = rzx_read_creator( &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
       
     case LIBSPECTRUM_RZX_SNAPSHOT_BLOCK:
       error = rzx_read_snapshot( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
 
     case LIBSPECTRUM_RZX_INPUT_BLOCK:
       error = rzx_read_input( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
-      }
       break;
 
     case LIBSPECTRUM_RZX_SIGN_START_BLOCK:
       error = rzx_read_sign_start( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
+#ifdef HAVE_GCRYPT_H
+      /* Start hashing the signed data, including everything already read */
+      if( !error && !hash ) {
+        error = libspectrum_hash_start( &hash );
+        if( !error )
+          libspectrum_hash_update( hash, rzx->signed_start,
+                                   block_start - rzx->signed_start );
       }
+#endif				/* #ifdef HAVE_GCRYPT_H */
       break;
 
     case LIBSPECTRUM_RZX_SIGN_END_BLOCK:
       error = rzx_read_sign_end( rzx, &ptr, end );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-	libspectrum_free( new_buffer );
-	return error;
+#ifdef HAVE_GCRYPT_H
+      if( !error ) {
+        rzx_block_t *block = rzx->last_block->data;
+        signature_block_t *signature = &( block->types.signature );
+
+        if( !hash ) {
+          error = libspectrum_hash_start( &hash );
+          if( error ) break;
+          libspectrum_hash_update( hash, rzx->signed_start,
+                                   signature->length );
+        }
+
+        libspectrum_hash_end( hash, &signature->digest,
+                              &signature->digest_length );
+        hash = NULL;
       }
+#endif				/* #ifdef HAVE_GCRYPT_H */
       break;
 
     default:
@@ -765,13 +979,40 @@ libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
 	LIBSPECTRUM_ERROR_UNKNOWN,
         "libspectrum_rzx_read: unknown RZX block ID 0x%02x", id
       );
-      libspectrum_free( new_buffer );
-      return LIBSPECTRUM_ERROR_UNKNOWN;
+      error = LIBSPECTRUM_ERROR_UNKNOWN;
+      break;
     }
+
+    if( error != LIBSPECTRUM_ERROR_NONE ) break;
+
+#ifdef HAVE_GCRYPT_H
+    /* Hash each block of signed data as it's read, while it's still in
+       cache */
+    if( hash ) libspectrum_hash_update( hash, block_start, ptr - block_start );
+#endif				/* #ifdef HAVE_GCRYPT_H */
   }
 
+#ifdef HAVE_GCRYPT_H
+  if( hash ) libspectrum_hash_end( hash, NULL, NULL );
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
   libspectrum_free( new_buffer );
-  return LIBSPECTRUM_ERROR_NONE;
+  return error;
+}
+
+/* Everything decompressed while reading a recording, including its input
+   blocks and snapshots, counts towards the limit */
+libspectrum_error
+libspectrum_rzx_read( libspectrum_rzx *rzx, const libspectrum_byte *buffer,
+		      size_t length )
+{
+  libspectrum_error error;
+
+  libspectrum_inflate_file_begin();
+  error = rzx_read( rzx, buffer, length );
+  libspectrum_inflate_file_end();
+
+  return error;
 }
 
 static libspectrum_error
@@ -966,7 +1207,7 @@ rzx_read_snapshot( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
   /* Skip over the data */
   (*ptr) += blocklength - 9;
 
-  rzx->blocks = g_slist_append( rzx->blocks, block );
+  rzx_append_block( rzx, block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -1002,6 +1243,8 @@ rzx_read_input( libspectrum_rzx *rzx,
   /* Allocate memory for the frames */
   block->frames = libspectrum_new( libspectrum_rzx_frame_t, block->count );
   block->allocated = block->count;
+  block->dictionary = NULL;
+  block->dictionary_size = 0;
 
   /* Fetch the T-state counter and the flags */
   block->tstates = libspectrum_read_dword( ptr );
@@ -1027,9 +1270,11 @@ rzx_read_input( libspectrum_rzx *rzx,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
+    /* The frames haven't been read yet, so mustn't be freed one by one */
     error = libspectrum_zlib_inflate( *ptr, blocklength, &data, &data_length );
     if( error != LIBSPECTRUM_ERROR_NONE ) {
-      block_free( rzx_block );
+      libspectrum_free( block->frames );
+      libspectrum_free( rzx_block );
       return error;
     }
 
@@ -1057,7 +1302,7 @@ rzx_read_input( libspectrum_rzx *rzx,
     if( error ) { libspectrum_free( rzx_block ); return error; }
   }
 
-  rzx->blocks = g_slist_append( rzx->blocks, rzx_block );
+  rzx_append_block( rzx, rzx_block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -1083,6 +1328,7 @@ rzx_read_frames( input_block_t *block, const libspectrum_byte **ptr,
 
     block->frames[i].instructions = libspectrum_read_word( ptr );
     block->frames[i].count        = libspectrum_read_word( ptr );
+    block->frames[i].shared       = 0;
 
     if( block->frames[i].count == libspectrum_rzx_repeat_frame ) {
       block->frames[i].repeat_last = 1;
@@ -1165,7 +1411,7 @@ rzx_read_sign_start( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
   /* Skip anything we don't know about */
   *ptr += length - 13;
 
-  rzx->blocks = g_slist_append( rzx->blocks, block );
+  rzx_append_block( rzx, block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -1203,6 +1449,11 @@ rzx_read_sign_end( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
   /* - 5 as we don't sign the block ID and length of this block */
   signature->length = ( *ptr - rzx->signed_start ) - 5;
 
+#ifdef HAVE_GCRYPT_H
+  signature->digest = NULL;
+  signature->digest_length = 0;
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
 #ifdef HAVE_GCRYPT_H
   { 
     gcry_error_t error; size_t mpi_length;
@@ -1235,87 +1486,241 @@ rzx_read_sign_end( libspectrum_rzx *rzx, const libspectrum_byte **ptr,
 
   (*ptr) += length;
 
-  rzx->blocks = g_slist_append( rzx->blocks, block );
+  rzx_append_block( rzx, block );
 
   return LIBSPECTRUM_ERROR_NONE;
 }
   
 
-libspectrum_error
-libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
-		       libspectrum_rzx *rzx, libspectrum_id_t snap_format,
-		       libspectrum_creator *creator, int compress,
-		       libspectrum_rzx_dsa_key *key )
+static libspectrum_error
+rzx_write_buffer( libspectrum_buffer *buffer, libspectrum_rzx *rzx,
+                  libspectrum_id_t snap_format, libspectrum_creator *creator,
+                  int compress, libspectrum_rzx_dsa_key *key )
 {
-  libspectrum_error error;
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
   GSList *list;
-  libspectrum_byte *ptr = *buffer;
-  libspectrum_buffer *new_buffer = libspectrum_buffer_alloc();
   libspectrum_buffer *block_data = libspectrum_buffer_alloc();
+  libspectrum_hash_context *hash = NULL;
+  size_t hashed;
 
-  if( creator ) rzx_write_creator( new_buffer, block_data, creator );
+  /* The header isn't part of the signed data */
+  rzx_write_header( buffer, key ? 1 : 0 );
+  hashed = libspectrum_buffer_get_data_size( buffer );
+
+  if( creator ) rzx_write_creator( buffer, block_data, creator );
 
   if( key ) {
-    error = rzx_write_signed_start( new_buffer, block_data, key, creator );
-    if( error != LIBSPECTRUM_ERROR_NONE ) {
-      libspectrum_buffer_free( new_buffer );
-      libspectrum_buffer_free( block_data );
-      return error;
-    }
+    error = rzx_write_signed_start( buffer, block_data, key, creator );
+    if( error != LIBSPECTRUM_ERROR_NONE ) goto cleanup;
+
+#ifdef HAVE_GCRYPT_H
+    error = libspectrum_hash_start( &hash );
+    if( error != LIBSPECTRUM_ERROR_NONE ) goto cleanup;
+#endif				/* #ifdef HAVE_GCRYPT_H */
   }
 
-  for( list = rzx->blocks; list; list = list->next ) {
+  rzx_flush_written( hash, buffer, &hashed );
 
-    rzx_block_t *block = list->data;
+  if( rzx->write_threads > 1 ) {
 
-    switch( block->type ) {
+    error = rzx_write_blocks_parallel( buffer, rzx, snap_format, creator,
+                                       compress );
+    if( error != LIBSPECTRUM_ERROR_NONE ) goto cleanup;
 
-    case LIBSPECTRUM_RZX_SNAPSHOT_BLOCK:
-      error = rzx_write_snapshot( new_buffer, block_data,
-                                  block->types.snap.snap, snap_format, creator,
-                                  compress );
-      if( error != LIBSPECTRUM_ERROR_NONE ) {
-        libspectrum_buffer_free( new_buffer );
-        libspectrum_buffer_free( block_data );
-        return error;
-      }
-      break;
+    rzx_flush_written( hash, buffer, &hashed );
 
-    case LIBSPECTRUM_RZX_INPUT_BLOCK:
-      /* z80 snapshots can't safely store an intermediate state */
-      snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
+  } else {
 
-      rzx_write_input( &( block->types.input ), new_buffer, block_data,
-                       compress );
-      break;
+    for( list = rzx->blocks; list; list = list->next ) {
 
-    case LIBSPECTRUM_RZX_CREATOR_BLOCK:
-    case LIBSPECTRUM_RZX_SIGN_START_BLOCK:
-    case LIBSPECTRUM_RZX_SIGN_END_BLOCK:
-      break;
+      rzx_block_t *block = list->data;
+
+      error = rzx_write_block( buffer, block_data, block, snap_format,
+                               creator, compress );
+      if( error != LIBSPECTRUM_ERROR_NONE ) goto cleanup;
 
+      rzx_flush_written( hash, buffer, &hashed );
+
+      /* z80 snapshots can't safely store an intermediate state */
+      if( block->type == LIBSPECTRUM_RZX_INPUT_BLOCK )
+        snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
     }
+
   }
 
   if( key ) {
-    error = rzx_write_signed_end( new_buffer, block_data, key );
-    if( error != LIBSPECTRUM_ERROR_NONE ) {
-      libspectrum_buffer_free( new_buffer );
-      libspectrum_buffer_free( block_data );
-      return error;
-    }
+    error = rzx_write_signed_end( buffer, block_data, key, hash );
+    hash = NULL;
+    if( error != LIBSPECTRUM_ERROR_NONE ) goto cleanup;
   }
-  
-  rzx_write_header( block_data, key ? 1 : 0 );
-  libspectrum_buffer_append( buffer, length, &ptr, block_data );
+
+cleanup:
+#ifdef HAVE_GCRYPT_H
+  if( hash ) libspectrum_hash_end( hash, NULL, NULL );
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
   libspectrum_buffer_free( block_data );
 
-  libspectrum_buffer_append( buffer, length, &ptr, new_buffer );
+  return error;
+}
+
+libspectrum_error
+libspectrum_rzx_write( libspectrum_byte **buffer, size_t *length,
+		       libspectrum_rzx *rzx, libspectrum_id_t snap_format,
+		       libspectrum_creator *creator, int compress,
+		       libspectrum_rzx_dsa_key *key )
+{
+  libspectrum_byte *ptr = *buffer;
+  libspectrum_buffer *new_buffer = libspectrum_buffer_alloc();
+  libspectrum_error error;
+
+  error = rzx_write_buffer( new_buffer, rzx, snap_format, creator, compress,
+                            key );
+  if( error == LIBSPECTRUM_ERROR_NONE )
+    libspectrum_buffer_append( buffer, length, &ptr, new_buffer );
+
   libspectrum_buffer_free( new_buffer );
 
+  return error;
+}
+
+libspectrum_error
+libspectrum_rzx_write_gzip( libspectrum_byte **buffer, size_t *length,
+			    libspectrum_rzx *rzx,
+			    libspectrum_id_t snap_format,
+			    libspectrum_creator *creator, int compress,
+			    libspectrum_rzx_dsa_key *key )
+{
+  libspectrum_gzip_writer *writer;
+  libspectrum_error error;
+
+  error = libspectrum_gzip_writer_alloc(
+    &writer, buffer, length,
+    compress & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ?
+      LIBSPECTRUM_COMPRESSION_FAST : LIBSPECTRUM_COMPRESSION_BEST
+  );
+  if( error ) return error;
+
+  error = rzx_write_buffer( libspectrum_gzip_writer_buffer( writer ), rzx,
+                            snap_format, creator, compress, key );
+
+  return libspectrum_gzip_writer_free( writer, error );
+}
+
+/* Add anything written to `buffer' since the last call to the hash of the
+   signed data, so it's hashed while still in cache, and then pass it on if
+   `buffer' is being streamed */
+static void
+rzx_flush_written( libspectrum_hash_context *hash, libspectrum_buffer *buffer,
+                   size_t *hashed )
+{
+#ifdef HAVE_GCRYPT_H
+  size_t size = libspectrum_buffer_get_data_size( buffer );
+
+  if( hash )
+    libspectrum_hash_update( hash,
+                             libspectrum_buffer_get_data( buffer ) + *hashed,
+                             size - *hashed );
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
+  libspectrum_buffer_drain( buffer );
+  *hashed = libspectrum_buffer_get_data_size( buffer );
+}
+
+static libspectrum_error
+rzx_write_block( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
+                 rzx_block_t *block, libspectrum_id_t snap_format,
+                 libspectrum_creator *creator, int compress )
+{
+  switch( block->type ) {
+
+  case LIBSPECTRUM_RZX_SNAPSHOT_BLOCK:
+    return rzx_write_snapshot( buffer, block_data, block->types.snap.snap,
+                               snap_format, creator, compress );
+
+  case LIBSPECTRUM_RZX_INPUT_BLOCK:
+    rzx_write_input( &( block->types.input ), buffer, block_data, compress );
+    break;
+
+  case LIBSPECTRUM_RZX_CREATOR_BLOCK:
+  case LIBSPECTRUM_RZX_SIGN_START_BLOCK:
+  case LIBSPECTRUM_RZX_SIGN_END_BLOCK:
+    break;
+
+  }
+
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* One block to be serialised (and probably compressed) by a worker */
+typedef struct rzx_write_job_t {
+
+  rzx_block_t *block;
+  libspectrum_id_t snap_format;
+  libspectrum_creator *creator;
+  int compress;
+
+  libspectrum_buffer *data;	/* The complete block, including header */
+  libspectrum_error error;
+
+} rzx_write_job_t;
+
+static void
+rzx_write_job( void *jobs, size_t index )
+{
+  rzx_write_job_t *job = &( (rzx_write_job_t*)jobs )[ index ];
+  libspectrum_buffer *block_data = libspectrum_buffer_alloc();
+
+  job->error = rzx_write_block( job->data, block_data, job->block,
+                                job->snap_format, job->creator,
+                                job->compress );
+
+  libspectrum_buffer_free( block_data );
+}
+
+/* Serialise each block independently on a pool of threads, then copy the
+   results into `buffer' in the original order so the output (and so any
+   signed data) is identical to that of a serial write */
+static libspectrum_error
+rzx_write_blocks_parallel( libspectrum_buffer *buffer, libspectrum_rzx *rzx,
+                           libspectrum_id_t snap_format,
+                           libspectrum_creator *creator, int compress )
+{
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
+  rzx_write_job_t *jobs;
+  size_t i, count = g_slist_length( rzx->blocks );
+  GSList *list;
+
+  jobs = libspectrum_new( rzx_write_job_t, count );
+
+  for( i = 0, list = rzx->blocks; list; i++, list = list->next ) {
+    jobs[i].block = list->data;
+    jobs[i].snap_format = snap_format;
+    jobs[i].creator = creator;
+    jobs[i].compress = compress;
+    jobs[i].data = libspectrum_buffer_alloc();
+    jobs[i].error = LIBSPECTRUM_ERROR_NONE;
+
+    /* z80 snapshots can't safely store an intermediate state */
+    if( jobs[i].block->type == LIBSPECTRUM_RZX_INPUT_BLOCK )
+      snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
+  }
+
+  libspectrum_run_parallel( rzx_write_job, jobs, count, rzx->write_threads );
+
+  for( i = 0; i < count; i++ ) {
+    if( !error ) {
+      error = jobs[i].error;
+      if( !error ) libspectrum_buffer_write_buffer( buffer, jobs[i].data );
+    }
+    libspectrum_buffer_free( jobs[i].data );
+  }
+
+  libspectrum_free( jobs );
+
+  return error;
+}
+
 static void
 rzx_write_header( libspectrum_buffer *buffer, int sign )
 {
@@ -1386,8 +1791,11 @@ rzx_compress( libspectrum_buffer *dest, libspectrum_buffer *src, int *compress )
   }
 
 #ifdef HAVE_ZLIB_H
-  error = libspectrum_zlib_compress( out_data, out_length, &compressed_data,
-                                     &out_length );
+  error = libspectrum_zlib_compress_level(
+    out_data, out_length, &compressed_data, &out_length,
+    *compress & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ?
+      LIBSPECTRUM_COMPRESSION_FAST : LIBSPECTRUM_COMPRESSION_BEST
+  );
   if( error != LIBSPECTRUM_ERROR_NONE || 
       out_length >= libspectrum_buffer_get_data_size( src ) ) {
     *compress = 0;
@@ -1421,29 +1829,35 @@ rzx_write_snapshot( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
                     libspectrum_creator *creator, int compress )
 {
   libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
-  int flags, done;
+  int flags, snap_flags, done;
   snapshot_string_t *type;
   libspectrum_buffer *snap_data = libspectrum_buffer_alloc();
   size_t uncompressed_data_size;
 
+  /* Embedded .szx snapshots compress their memory pages the same way */
+  snap_flags = compress & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION;
+
   if( snap_format == LIBSPECTRUM_ID_UNKNOWN ) {
     /* If not given a snap format, try using .z80. If that would result
        in major information loss, use .szx instead */
     snap_format = LIBSPECTRUM_ID_SNAPSHOT_Z80;
     error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                           snap_format, creator, 0 );
+                                           snap_format, creator,
+                                           snap_flags );
     if( error ) { goto cleanup; }
 
     if( flags & LIBSPECTRUM_FLAG_SNAPSHOT_MAJOR_INFO_LOSS ) {
       libspectrum_buffer_clear( block_data );
       snap_format = LIBSPECTRUM_ID_SNAPSHOT_SZX;
       error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                             snap_format, creator, 0 );
+                                             snap_format, creator,
+                                             snap_flags );
       if( error ) { goto cleanup; }
     }
   } else {
     error = libspectrum_snap_write_buffer( block_data, &flags, snap,
-                                           snap_format, creator, 0 );
+                                           snap_format, creator,
+                                           snap_flags );
     if( error ) { goto cleanup; }
   }
 
@@ -1495,6 +1909,7 @@ rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
 {
   size_t i;
   libspectrum_buffer *frame_data = libspectrum_buffer_alloc();
+  const libspectrum_byte *last_in_bytes = NULL;
 
   /* Write the frames */
   for( i = 0; i < block->count; i++ ) {
@@ -1503,11 +1918,15 @@ rzx_write_input( input_block_t *block, libspectrum_buffer *buffer,
 
     libspectrum_buffer_write_word( block_data, frame->instructions );
 
-    if( frame->repeat_last ) {
+    /* Frames sharing the data of the last literal frame can be written as
+       repeats; other shared frames have to be written out in full */
+    if( frame->repeat_last ||
+        ( frame->shared && frame->in_bytes == last_in_bytes ) ) {
       libspectrum_buffer_write_word( block_data, libspectrum_rzx_repeat_frame );
     } else {
       libspectrum_buffer_write_word( block_data, frame->count );
       libspectrum_buffer_write( block_data, frame->in_bytes, frame->count );
+      last_in_bytes = frame->in_bytes;
     }
 
   }
@@ -1569,19 +1988,24 @@ rzx_write_signed_start( libspectrum_buffer *buffer,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Write the signature block, taking ownership of `hash', which contains the
+   hash of everything written so far */
 static libspectrum_error
 rzx_write_signed_end( libspectrum_buffer *buffer, libspectrum_buffer *block_data,
-                      libspectrum_rzx_dsa_key *key )
+                      libspectrum_rzx_dsa_key *key,
+                      libspectrum_hash_context *hash )
 {
 #ifdef HAVE_GCRYPT_H
   libspectrum_error error;
   libspectrum_byte *signature; size_t sig_length;
+  libspectrum_byte *digest; size_t digest_length;
+
+  libspectrum_hash_end( hash, &digest, &digest_length );
 
   /* Get the actual signature */
-  error = libspectrum_sign_data( &signature, &sig_length,
-                                 libspectrum_buffer_get_data( buffer ),
-                                 libspectrum_buffer_get_data_size( buffer ),
-                                 key );
+  error = libspectrum_sign_digest( &signature, &sig_length, digest,
+                                   digest_length, key );
+  libspectrum_free( digest );
   if( error ) return error;
 
   /* Write the signature */
@@ -1608,6 +2032,7 @@ libspectrum_rzx_insert_snap( libspectrum_rzx *rzx, libspectrum_snap *snap,
   block->types.snap.automatic = 0;
 
   rzx->blocks = g_slist_insert( rzx->blocks, block, where );
+  rzx_reindex( rzx );
 }
 
 /*
@@ -1629,8 +2054,7 @@ libspectrum_rzx_iterator_next( libspectrum_rzx_iterator it )
 libspectrum_rzx_iterator
 libspectrum_rzx_iterator_last( libspectrum_rzx *rzx )
 {
-  /* This function iterates over the whole list */
-  return g_slist_last( rzx->blocks );
+  return rzx->last_block;
 }
 
 libspectrum_rzx_block_id
@@ -1658,6 +2082,7 @@ libspectrum_rzx_iterator_delete( libspectrum_rzx *rzx,
   block_free( it->data );
 
   rzx->blocks = g_slist_delete_link( rzx->blocks, it );
+  rzx_reindex( rzx );
 }
 
 libspectrum_snap*
@@ -1707,7 +2132,7 @@ libspectrum_rzx_finalise( libspectrum_rzx *rzx )
 {
   GSList *list, *item, *next_item;
   rzx_block_t *block, *next_block;
-  libspectrum_error error;
+  libspectrum_error error = LIBSPECTRUM_ERROR_NONE;
   int first_snap = 1;
   int finalised = 0;
 
@@ -1746,7 +2171,8 @@ libspectrum_rzx_finalise( libspectrum_rzx *rzx )
       if( next_block->type == LIBSPECTRUM_RZX_INPUT_BLOCK ) {
         error = input_block_merge( &( block->types.input ),
                                    &( next_block->types.input ) );
-        if( error ) return error;
+        /* Snapshots may already have gone, so the index must be rebuilt */
+        if( error ) break;
 
         block_free( next_block );
         rzx->blocks = g_slist_delete_link( rzx->blocks, next_item );
@@ -1760,5 +2186,9 @@ libspectrum_rzx_finalise( libspectrum_rzx *rzx )
     }
   }
 
+  rzx_reindex( rzx );
+
+  if( error ) return error;
+
   return finalised? LIBSPECTRUM_ERROR_NONE : LIBSPECTRUM_ERROR_INVALID;
 }
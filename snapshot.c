@@ -30,26 +30,31 @@
 /* Some flags which may be given to libspectrum_snap_write() */
 const int LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION = 1 << 0;
 const int LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS = 1 << 1;
+const int LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION = 1 << 2;
 
 /* Some flags which may be returned from libspectrum_snap_write() */
 const int LIBSPECTRUM_FLAG_SNAPSHOT_MINOR_INFO_LOSS = 1 << 0;
 const int LIBSPECTRUM_FLAG_SNAPSHOT_MAJOR_INFO_LOSS = 1 << 1;
 
-/* Read in a snapshot, optionally guessing what type it is */
-libspectrum_error
-libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
-		       size_t length, libspectrum_id_t type,
-		       const char *filename )
+static libspectrum_error
+snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
+	   size_t length, libspectrum_id_t type, const char *filename )
 {
-  libspectrum_id_t raw_type;
+  libspectrum_id_t inner_type;
   libspectrum_class_t class;
   libspectrum_byte *new_buffer;
   libspectrum_error error;
 
+  /* Decompress the file if necessary, finding out what's inside at the
+     same time */
+  error = libspectrum_identify_and_uncompress( &inner_type, &class,
+					       &new_buffer, filename, &buffer,
+					       &length );
+  if( error ) return error;
+
   /* If we don't know what sort of file this is, make a best guess */
   if( type == LIBSPECTRUM_ID_UNKNOWN ) {
-    error = libspectrum_identify_file( &type, filename, buffer, length );
-    if( error ) return error;
+    type = inner_type;
 
     /* If we still can't identify it, give up */
     if( type == LIBSPECTRUM_ID_UNKNOWN ) {
@@ -57,38 +62,21 @@ libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
         LIBSPECTRUM_ERROR_UNKNOWN,
 	"libspectrum_snap_read: couldn't identify file"
       );
+      libspectrum_free( new_buffer );
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
   }
 
   error = libspectrum_identify_class( &class, type );
-  if( error ) return error;
+  if( error ) { libspectrum_free( new_buffer ); return error; }
 
   if( class != LIBSPECTRUM_CLASS_SNAPSHOT ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "libspectrum_snap_read: not a snapshot file" );
+    libspectrum_free( new_buffer );
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  /* Find out if this file needs decompression */
-  new_buffer = NULL;
-
-  error = libspectrum_identify_file_raw( &raw_type, filename, buffer, length );
-  if( error ) return error;
-
-  error = libspectrum_identify_class( &class, raw_type );
-  if( error ) return error;
-
-  if( class == LIBSPECTRUM_CLASS_COMPRESSED ) {
-
-    size_t new_length;
-
-    error = libspectrum_uncompress_file( &new_buffer, &new_length, NULL,
-					 raw_type, buffer, length, NULL );
-    if( error ) return error;
-    buffer = new_buffer; length = new_length;
-  }
-
   switch( type ) {
 
   case LIBSPECTRUM_ID_SNAPSHOT_PLUSD:
@@ -127,6 +115,22 @@ libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
   return error;
 }
 
+/* Read in a snapshot, optionally guessing what type it is. Everything
+   decompressed while reading it counts towards the limit */
+libspectrum_error
+libspectrum_snap_read( libspectrum_snap *snap, const libspectrum_byte *buffer,
+		       size_t length, libspectrum_id_t type,
+		       const char *filename )
+{
+  libspectrum_error error;
+
+  libspectrum_inflate_file_begin();
+  error = snap_read( snap, buffer, length, type, filename );
+  libspectrum_inflate_file_end();
+
+  return error;
+}
+
 libspectrum_error
 libspectrum_snap_write( libspectrum_byte **buffer, size_t *length,
 			int *out_flags, libspectrum_snap *snap,
@@ -143,6 +147,29 @@ libspectrum_snap_write( libspectrum_byte **buffer, size_t *length,
   return error;
 }
 
+libspectrum_error
+libspectrum_snap_write_gzip( libspectrum_byte **buffer, size_t *length,
+			     int *out_flags, libspectrum_snap *snap,
+			     libspectrum_id_t type,
+			     libspectrum_creator *creator, int in_flags )
+{
+  libspectrum_gzip_writer *writer;
+  libspectrum_error error;
+
+  error = libspectrum_gzip_writer_alloc(
+    &writer, buffer, length,
+    in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ?
+      LIBSPECTRUM_COMPRESSION_FAST : LIBSPECTRUM_COMPRESSION_BEST
+  );
+  if( error ) return error;
+
+  error = libspectrum_snap_write_buffer( libspectrum_gzip_writer_buffer( writer ),
+                                         out_flags, snap, type, creator,
+                                         in_flags );
+
+  return libspectrum_gzip_writer_free( writer, error );
+}
+
 libspectrum_error
 libspectrum_snap_write_buffer( libspectrum_buffer *buffer, int *out_flags,
                                libspectrum_snap *snap, libspectrum_id_t type,
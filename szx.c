@@ -2774,7 +2774,9 @@ libspectrum_szx_write( libspectrum_buffer *buffer, int *out_flags,
   capabilities =
     libspectrum_machine_capabilities( libspectrum_snap_machine( snap ) );
 
-  compress = !( in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
+  compress = in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION ? 0 :
+    1 | ( in_flags & ( LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS |
+                       LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ) );
 
   error = write_file_header( buffer, out_flags, snap );
   if( error ) return error;
@@ -3524,8 +3526,11 @@ compress_data( libspectrum_buffer *dest, const libspectrum_byte *src_data,
     libspectrum_error error;
     size_t compressed_length;
 
-    error = libspectrum_zlib_compress( src_data, src_data_length,
-				       &compressed_data, &compressed_length );
+    error = libspectrum_zlib_compress_level(
+      src_data, src_data_length, &compressed_data, &compressed_length,
+      compress & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ?
+        LIBSPECTRUM_COMPRESSION_FAST : LIBSPECTRUM_COMPRESSION_BEST
+    );
 
     if( error == LIBSPECTRUM_ERROR_NONE &&
         ( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -4220,4 +4225,5 @@ write_chunk( libspectrum_buffer *buffer, const char *id,
   libspectrum_buffer_write_dword( buffer, data_length );
   libspectrum_buffer_write_buffer( buffer, block_data );
   libspectrum_buffer_clear( block_data );
+  libspectrum_buffer_drain( buffer );
 }
@@ -30,6 +30,20 @@
 
 #define DESCRIPTION_LENGTH 256
 
+#ifdef HAVE_LIBBZ2
+/* A file being read as it is decompressed */
+typedef struct tap_stream {
+  libspectrum_tape *tape;
+  libspectrum_id_t type;
+
+  /* Decompressed data not yet read: the start of a block */
+  libspectrum_byte *pending;
+  size_t length, capacity;
+
+  libspectrum_error error;
+} tap_stream;
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
 static libspectrum_error
 write_rom( libspectrum_tape_block *block, libspectrum_buffer *buffer,
 	   libspectrum_id_t type );
@@ -46,22 +60,22 @@ write_tap_block( libspectrum_buffer *buffer, libspectrum_byte *data,
 static libspectrum_error
 skip_block( libspectrum_tape_block *block, const char *message );
 
-libspectrum_error
-internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-		   const size_t length, libspectrum_id_t type )
+/* Read blocks from `*ptr' up to `end', leaving `*ptr' after the last one
+   read. If `partial' is set, stop without error at a block which isn't
+   all there yet */
+static libspectrum_error
+read_blocks( libspectrum_tape *tape, const libspectrum_byte **ptr,
+	     const libspectrum_byte *end, libspectrum_id_t type, int partial )
 {
   libspectrum_tape_block *block;
   size_t data_length, buf_length; libspectrum_byte *data;
 
-  const libspectrum_byte *ptr, *end;
-
-  ptr = buffer; end = buffer + length;
-
-  while( ptr < end ) {
+  while( *ptr < end ) {
     
     /* If we've got less than two bytes for the length, something's
        gone wrong, so gone home */
-    if( ( end - ptr ) < 2 ) {
+    if( ( end - *ptr ) < 2 ) {
+      if( partial ) break;
       libspectrum_tape_clear( tape );
       libspectrum_print_error(
         LIBSPECTRUM_ERROR_CORRUPT,
@@ -70,16 +84,12 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
-    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
-
-    /* Get the length, and move along the buffer */
-    data_length = ptr[0] + ptr[1] * 0x100;
+    /* Get the length */
+    data_length = (*ptr)[0] + (*ptr)[1] * 0x100;
     if( type == LIBSPECTRUM_ID_TAPE_SPC ||
 	type == LIBSPECTRUM_ID_TAPE_STA ||
 	type == LIBSPECTRUM_ID_TAPE_LTP )
       data_length += 2;
-    libspectrum_tape_block_set_data_length( block, data_length );
-    ptr += 2;
 
     if( type == LIBSPECTRUM_ID_TAPE_STA )
       buf_length = data_length - 1;
@@ -87,9 +97,9 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       buf_length = data_length;
 
     /* Have we got enough bytes left in buffer? */
-    if( end - ptr < (ptrdiff_t)buf_length ) {
+    if( end - *ptr - 2 < (ptrdiff_t)buf_length ) {
+      if( partial ) break;
       libspectrum_tape_clear( tape );
-      libspectrum_free( block );
       libspectrum_print_error(
         LIBSPECTRUM_ERROR_CORRUPT,
         "libspectrum_tap_read: not enough data in buffer"
@@ -97,12 +107,18 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
 
+    /* Move along the buffer */
+    *ptr += 2;
+
+    block = libspectrum_tape_block_alloc( LIBSPECTRUM_TAPE_BLOCK_ROM );
+    libspectrum_tape_block_set_data_length( block, data_length );
+
     /* Allocate memory for the data */
     data = libspectrum_new( libspectrum_byte, data_length );
     libspectrum_tape_block_set_data( block, data );
 
     /* Copy the block data across */
-    memcpy( data, ptr, buf_length );
+    memcpy( data, *ptr, buf_length );
 
     /* Fix the parity byte for the SPC and STA tape formats */
     if( type == LIBSPECTRUM_ID_TAPE_SPC ) {
@@ -119,7 +135,7 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
     }
  
     /* Move along the buffer */
-    ptr += buf_length;
+    *ptr += buf_length;
 
     /* Give a 1s pause after each block */
     libspectrum_set_pause_ms( block, 1000 );
@@ -130,6 +146,84 @@ internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+libspectrum_error
+internal_tap_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+		   const size_t length, libspectrum_id_t type )
+{
+  const libspectrum_byte *ptr = buffer;
+
+  return read_blocks( tape, &ptr, buffer + length, type, 0 );
+}
+
+#ifdef HAVE_LIBBZ2
+
+/* Take a block of decompressed data, and read any blocks which are now
+   complete */
+static int
+tap_stream_sink( const libspectrum_byte *data, size_t length,
+		 void *user_data )
+{
+  tap_stream *stream = user_data;
+  const libspectrum_byte *ptr;
+
+  if( length > stream->capacity - stream->length ) {
+    stream->capacity = MAX( 2 * stream->capacity, stream->length + length );
+    stream->pending = libspectrum_renew( libspectrum_byte, stream->pending,
+					 stream->capacity );
+  }
+
+  memcpy( stream->pending + stream->length, data, length );
+  stream->length += length;
+
+  ptr = stream->pending;
+  stream->error = read_blocks( stream->tape, &ptr,
+			       stream->pending + stream->length, stream->type,
+			       1 );
+
+  /* Keep just the start of the next block */
+  stream->length -= ptr - stream->pending;
+  memmove( stream->pending, ptr, stream->length );
+
+  return stream->error != LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Read a bzip2 compressed file, reading each block as soon as it has been
+   decompressed. Only one block is held in decompressed form at a time,
+   rather than the whole file */
+libspectrum_error
+internal_tap_read_bzip2( libspectrum_tape *tape, const libspectrum_byte *buffer,
+			 size_t length, libspectrum_id_t type )
+{
+  tap_stream stream;
+  const libspectrum_byte *ptr;
+  libspectrum_error error;
+
+  stream.tape = tape;
+  stream.type = type;
+  stream.pending = NULL;
+  stream.length = stream.capacity = 0;
+  stream.error = LIBSPECTRUM_ERROR_NONE;
+
+  error = libspectrum_bzip2_inflate_stream( buffer, length, tap_stream_sink,
+					    &stream );
+  if( !error ) error = stream.error;
+
+  /* Anything left over is an incomplete block */
+  if( !error && stream.length ) {
+    ptr = stream.pending;
+    error = read_blocks( tape, &ptr, stream.pending + stream.length, type,
+			 0 );
+  }
+
+  if( error ) libspectrum_tape_clear( tape );
+
+  libspectrum_free( stream.pending );
+
+  return error;
+}
+
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
 libspectrum_error
 internal_tap_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
                     libspectrum_id_t type )
@@ -211,6 +305,8 @@ internal_tap_write( libspectrum_buffer *buffer, libspectrum_tape *tape,
       return LIBSPECTRUM_ERROR_LOGIC;
     }
 
+    libspectrum_buffer_drain( buffer );
+
   }
 
   return LIBSPECTRUM_ERROR_NONE;
@@ -169,21 +169,71 @@ block_free( gpointer data, gpointer user_data GCC_UNUSED )
   libspectrum_tape_block_free( data );
 }
 
-/* Read in a tape file, optionally guessing what sort of file it is */
-libspectrum_error
-libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
-		       size_t length, libspectrum_id_t type,
-		       const char *filename )
+#ifdef HAVE_LIBBZ2
+/* If the file is a .tap style file compressed with bzip2, read it while
+   it's being decompressed rather than decompressing it all first. Returns
+   non-zero if it's been read, with the result in `*error' */
+static int
+tap_bzip2_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+		size_t length, libspectrum_id_t type, const char *filename,
+		libspectrum_error *error )
+{
+  libspectrum_id_t raw_type, inner_type;
+  libspectrum_class_t class;
+
+  if( libspectrum_identify_file_raw( &raw_type, filename, buffer, length ) ||
+      raw_type != LIBSPECTRUM_ID_COMPRESSED_BZ2 )
+    return 0;
+
+  /* Anything which doesn't look right is left for the usual route to deal
+     with, including any further layers of compression */
+  if( libspectrum_identify_layer( &inner_type, raw_type, filename, buffer,
+				  length ) ||
+      libspectrum_identify_class( &class, inner_type ) ||
+      class == LIBSPECTRUM_CLASS_COMPRESSED )
+    return 0;
+
+  if( type == LIBSPECTRUM_ID_UNKNOWN ) type = inner_type;
+
+  switch( type ) {
+
+  case LIBSPECTRUM_ID_TAPE_TAP:
+  case LIBSPECTRUM_ID_TAPE_SPC:
+  case LIBSPECTRUM_ID_TAPE_STA:
+  case LIBSPECTRUM_ID_TAPE_LTP:
+    *error = internal_tap_read_bzip2( tape, buffer, length, type );
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
+static libspectrum_error
+tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+	   size_t length, libspectrum_id_t type, const char *filename )
 {
-  libspectrum_id_t raw_type;
+  libspectrum_id_t inner_type;
   libspectrum_class_t class;
   libspectrum_byte *new_buffer;
   libspectrum_error error;
 
+#ifdef HAVE_LIBBZ2
+  if( tap_bzip2_read( tape, buffer, length, type, filename, &error ) )
+    return error;
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
+  /* Decompress the file if necessary, finding out what's inside at the
+     same time */
+  error = libspectrum_identify_and_uncompress( &inner_type, &class,
+					       &new_buffer, filename, &buffer,
+					       &length );
+  if( error ) return error;
+
   /* If we don't know what sort of file this is, make a best guess */
   if( type == LIBSPECTRUM_ID_UNKNOWN ) {
-    error = libspectrum_identify_file( &type, filename, buffer, length );
-    if( error ) return error;
+    type = inner_type;
 
     /* If we still can't identify it, give up */
     if( type == LIBSPECTRUM_ID_UNKNOWN ) {
@@ -191,29 +241,11 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
         LIBSPECTRUM_ERROR_UNKNOWN,
 	"libspectrum_tape_read: couldn't identify file"
       );
+      libspectrum_free( new_buffer );
       return LIBSPECTRUM_ERROR_UNKNOWN;
     }
   }
 
-  /* Find out if this file needs decompression */
-  new_buffer = NULL;
-
-  error = libspectrum_identify_file_raw( &raw_type, filename, buffer, length );
-  if( error ) return error;
-
-  error = libspectrum_identify_class( &class, raw_type );
-  if( error ) return error;
-
-  if( class == LIBSPECTRUM_CLASS_COMPRESSED ) {
-
-    size_t new_length;
-
-    error = libspectrum_uncompress_file( &new_buffer, &new_length, NULL,
-					 raw_type, buffer, length, NULL );
-    if( error ) return error;
-    buffer = new_buffer; length = new_length;
-  }
-
   switch( type ) {
 
   case LIBSPECTRUM_ID_TAPE_TAP:
@@ -260,12 +292,26 @@ libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
   return error;
 }
 
+/* Read in a tape file, optionally guessing what sort of file it is.
+   Everything decompressed while reading it counts towards the limit */
 libspectrum_error
-libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
-			libspectrum_tape *tape, libspectrum_id_t type )
+libspectrum_tape_read( libspectrum_tape *tape, const libspectrum_byte *buffer,
+		       size_t length, libspectrum_id_t type,
+		       const char *filename )
+{
+  libspectrum_error error;
+
+  libspectrum_inflate_file_begin();
+  error = tape_read( tape, buffer, length, type, filename );
+  libspectrum_inflate_file_end();
+
+  return error;
+}
+
+static libspectrum_error
+tape_write_buffer( libspectrum_buffer *buffer, libspectrum_tape *tape,
+                   libspectrum_id_t type )
 {
-  libspectrum_byte *ptr = *buffer;
-  libspectrum_buffer *new_buffer;
   libspectrum_class_t class;
   libspectrum_error error;
 
@@ -278,35 +324,42 @@ libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
     return LIBSPECTRUM_ERROR_INVALID;
   }
 
-  /* Allow for uninitialised buffer on entry */
-  if( !*length ) *buffer = NULL;
-
-  new_buffer = libspectrum_buffer_alloc();
-
   switch( type ) {
 
   case LIBSPECTRUM_ID_TAPE_TAP:
   case LIBSPECTRUM_ID_TAPE_SPC:
   case LIBSPECTRUM_ID_TAPE_STA:
   case LIBSPECTRUM_ID_TAPE_LTP:
-    error = internal_tap_write( new_buffer, tape, type );
-    break;
+    return internal_tap_write( buffer, tape, type );
 
   case LIBSPECTRUM_ID_TAPE_TZX:
-    error = internal_tzx_write( new_buffer, tape );
-    break;
+    return internal_tzx_write( buffer, tape );
 
   case LIBSPECTRUM_ID_TAPE_CSW:
-    error = libspectrum_csw_write( new_buffer, tape );
-    break;
+    return libspectrum_csw_write( buffer, tape );
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
 			     "libspectrum_tape_write: format not supported" );
-    error = LIBSPECTRUM_ERROR_UNKNOWN;
-    break;
+    return LIBSPECTRUM_ERROR_UNKNOWN;
 
   }
+}
+
+libspectrum_error
+libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
+			libspectrum_tape *tape, libspectrum_id_t type )
+{
+  libspectrum_byte *ptr = *buffer;
+  libspectrum_buffer *new_buffer;
+  libspectrum_error error;
+
+  /* Allow for uninitialised buffer on entry */
+  if( !*length ) *buffer = NULL;
+
+  new_buffer = libspectrum_buffer_alloc();
+
+  error = tape_write_buffer( new_buffer, tape, type );
 
   libspectrum_buffer_append( buffer, length, &ptr, new_buffer );
   libspectrum_buffer_free( new_buffer );
@@ -314,6 +367,23 @@ libspectrum_tape_write( libspectrum_byte **buffer, size_t *length,
   return error;
 }
 
+libspectrum_error
+libspectrum_tape_write_gzip( libspectrum_byte **buffer, size_t *length,
+			     libspectrum_tape *tape, libspectrum_id_t type )
+{
+  libspectrum_gzip_writer *writer;
+  libspectrum_error error;
+
+  error = libspectrum_gzip_writer_alloc( &writer, buffer, length,
+                                         LIBSPECTRUM_COMPRESSION_BEST );
+  if( error ) return error;
+
+  error = tape_write_buffer( libspectrum_gzip_writer_buffer( writer ), tape,
+                             type );
+
+  return libspectrum_gzip_writer_free( writer, error );
+}
+
 /* Does this tape structure actually contain a tape? */
 int
 libspectrum_tape_present( const libspectrum_tape *tape )
@@ -529,11 +529,11 @@ empty_ram_page_expected[] = {
   0x01, 0x00, /* Flags */
   0x00, /* Page number */
   /* 16 Kb of zeros compressed */
-  0x78, 0xda, 0xed, 0xc1, 0x31, 0x01, 0x00, 0x00,
-  0x00, 0xc2, 0xa0, 0xf5, 0x4f, 0x6d, 0x0c, 0x1f,
-  0xa0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x78, 0xda, 0xed, 0xc1, 0x21, 0x0d, 0x00, 0x00,
+  0x10, 0xc4, 0xb0, 0xf9, 0x57, 0x7d, 0x32, 0x8e,
+  0xb4, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  0x80, 0xb7, 0x01, 0x40, 0x00, 0x00, 0x01
+  0x00, 0xb8, 0x1b, 0x40, 0x00, 0x00, 0x01
 };
 #else
 static libspectrum_byte
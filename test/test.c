@@ -2,12 +2,23 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD_H */
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+#ifdef HAVE_LIBBZ2
+#include <bzlib.h>
+#endif				/* #ifdef HAVE_LIBBZ2 */
+
 #include "internals.h"
 #include "test.h"
 
@@ -918,6 +929,2970 @@ test_72( void )
   return r;
 }
 
+static test_return_t
+test_75( void )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_snap *snaps[4], *snap = NULL;
+  libspectrum_byte in_bytes[] = { 0xbf, 0xff };
+  libspectrum_rzx_iterator it;
+  test_return_t r = TEST_FAIL;
+  size_t i;
+
+  for( i = 0; i < ARRAY_SIZE( snaps ); i++ ) {
+    snaps[i] = libspectrum_snap_alloc();
+    libspectrum_rzx_add_snap( rzx, snaps[i], 0 );
+    libspectrum_rzx_start_input( rzx, 0 );
+    libspectrum_rzx_store_frame( rzx, 100, ARRAY_SIZE( in_bytes ), in_bytes );
+  }
+
+  if( libspectrum_rzx_rollback_to( rzx, &snap, 1 ) || snap != snaps[1] ) {
+    fprintf( stderr, "%s: rollback to snapshot 1 failed\n", progname );
+    goto cleanup;
+  }
+
+  it = libspectrum_rzx_iterator_last( rzx );
+  if( !it || libspectrum_rzx_iterator_get_snap( it ) != snaps[1] ) {
+    fprintf( stderr, "%s: last block is not snapshot 1\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_rzx_start_input( rzx, 0 );
+  libspectrum_rzx_store_frame( rzx, 100, ARRAY_SIZE( in_bytes ), in_bytes );
+
+  if( libspectrum_rzx_rollback( rzx, &snap ) || snap != snaps[1] ) {
+    fprintf( stderr, "%s: rollback to last snapshot failed\n", progname );
+    goto cleanup;
+  }
+
+  if( libspectrum_rzx_rollback_to( rzx, &snap, 2 ) !=
+      LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: rollback to deleted snapshot succeeded\n",
+             progname );
+    goto cleanup;
+  }
+
+  for( i = 0, it = libspectrum_rzx_iterator_begin( rzx ); it;
+       it = libspectrum_rzx_iterator_next( it ) )
+    i++;
+
+  if( i == 3 ) r = TEST_PASS;
+
+cleanup:
+  libspectrum_rzx_free( rzx );
+
+  return r;
+}
+
+static test_return_t
+test_76( void )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_snap *snap;
+  libspectrum_byte frame_a[] = { 0xbf, 0xff }, frame_b[] = { 0x1f, 0x00, 0xfe };
+  const libspectrum_byte *bytes;
+  libspectrum_byte byte;
+  size_t count, instructions;
+  int finished;
+  test_return_t r = TEST_FAIL;
+
+  libspectrum_rzx_start_input( rzx, 0 );
+  libspectrum_rzx_store_frame( rzx, 100, ARRAY_SIZE( frame_a ), frame_a );
+  libspectrum_rzx_store_frame( rzx, 200, ARRAY_SIZE( frame_a ), frame_a );
+  libspectrum_rzx_store_frame( rzx, 300, ARRAY_SIZE( frame_b ), frame_b );
+  libspectrum_rzx_stop_input( rzx );
+
+  if( libspectrum_rzx_start_playback( rzx, 0, &snap ) ) goto cleanup;
+
+  /* Second frame is stored as a repeat of the first */
+  if( libspectrum_rzx_playback_frame_data( rzx, &bytes, &count,
+                                           &instructions ) ||
+      count != ARRAY_SIZE( frame_a ) || instructions != 100 ||
+      memcmp( bytes, frame_a, count ) ) goto cleanup;
+  if( libspectrum_rzx_playback_frame( rzx, &finished, &snap ) ) goto cleanup;
+
+  if( libspectrum_rzx_playback_frame_data( rzx, &bytes, &count,
+                                           &instructions ) ||
+      count != ARRAY_SIZE( frame_a ) || instructions != 200 ||
+      memcmp( bytes, frame_a, count ) ) goto cleanup;
+  if( libspectrum_rzx_playback_frame( rzx, &finished, &snap ) ) goto cleanup;
+
+  /* Mixing byte-at-a-time playback with whole-frame data */
+  if( libspectrum_rzx_playback( rzx, &byte ) || byte != frame_b[0] )
+    goto cleanup;
+  if( libspectrum_rzx_playback_frame_data( rzx, &bytes, &count,
+                                           &instructions ) ||
+      count != ARRAY_SIZE( frame_b ) - 1 || instructions != 300 ||
+      memcmp( bytes, frame_b + 1, count ) ) goto cleanup;
+  if( libspectrum_rzx_playback_frame( rzx, &finished, &snap ) ) goto cleanup;
+
+  if( finished ) r = TEST_PASS;
+
+cleanup:
+  libspectrum_rzx_free( rzx );
+
+  return r;
+}
+
+/* Play back the 7 frames recorded by record_frames(), checking their data
+   and saving where each frame's data is */
+static int
+check_frames( libspectrum_rzx *rzx, const libspectrum_byte **pointers )
+{
+  libspectrum_byte frame_a[] = { 0xbf, 0xff }, frame_b[] = { 0x1f, 0x00, 0xfe };
+  libspectrum_snap *snap;
+  const libspectrum_byte *bytes;
+  size_t count, instructions, i;
+  int finished = 0;
+
+  if( libspectrum_rzx_start_playback( rzx, 0, &snap ) ) return 1;
+
+  for( i = 0; i < 7 && !finished; i++ ) {
+    const libspectrum_byte *expected = i % 2 || i == 6 ? frame_b : frame_a;
+    size_t expected_count = i % 2 || i == 6 ? ARRAY_SIZE( frame_b ) :
+                                              ARRAY_SIZE( frame_a );
+
+    if( libspectrum_rzx_playback_frame_data( rzx, &bytes, &count,
+                                             &instructions ) ||
+        instructions != i || count != expected_count ||
+        memcmp( bytes, expected, count ) )
+      return 1;
+
+    pointers[i] = bytes;
+
+    if( libspectrum_rzx_playback_frame( rzx, &finished, &snap ) ) return 1;
+  }
+
+  return !( i == 7 && finished );
+}
+
+/* Record frames alternating between two IN patterns, with the last one
+   repeated, using a dictionary of `size' entries */
+static libspectrum_rzx*
+record_frames( size_t size )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_byte frame_a[] = { 0xbf, 0xff }, frame_b[] = { 0x1f, 0x00, 0xfe };
+  size_t i;
+
+  libspectrum_rzx_set_frame_dictionary( rzx, size );
+  libspectrum_rzx_start_input( rzx, 0 );
+  for( i = 0; i < 6; i++ ) {
+    if( i % 2 ) {
+      libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( frame_b ), frame_b );
+    } else {
+      libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( frame_a ), frame_a );
+    }
+  }
+  libspectrum_rzx_store_frame( rzx, 6, ARRAY_SIZE( frame_b ), frame_b );
+  libspectrum_rzx_stop_input( rzx );
+
+  return rzx;
+}
+
+static test_return_t
+test_77( void )
+{
+  libspectrum_rzx *rzx = record_frames( 16 ), *rzx2 = NULL, *rzx3 = NULL;
+  libspectrum_byte *buffer = NULL;
+  const libspectrum_byte *pointers[7];
+  size_t length = 0, i;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( libspectrum_rzx_write( &buffer, &length, rzx, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL, 0, NULL ) )
+    goto cleanup;
+
+  rzx2 = libspectrum_rzx_alloc();
+  if( libspectrum_rzx_read( rzx2, buffer, length ) ) goto cleanup;
+
+  r = TEST_FAIL;
+
+  if( check_frames( rzx2, pointers ) ) {
+    fprintf( stderr, "%s: shared frames not read back\n", progname );
+    goto cleanup;
+  }
+
+  /* While recording, each pattern should have been stored only once */
+  if( check_frames( rzx, pointers ) ) {
+    fprintf( stderr, "%s: shared frames not played back\n", progname );
+    goto cleanup;
+  }
+
+  for( i = 2; i < 7; i++ ) {
+    if( pointers[i] != pointers[ i == 6 ? 1 : i % 2 ] ) {
+      fprintf( stderr, "%s: frame %lu not shared\n", progname,
+               (unsigned long)i );
+      goto cleanup;
+    }
+  }
+
+  if( pointers[0] == pointers[1] ) goto cleanup;
+
+  /* With only one slot, the two patterns keep replacing each other, so
+     nothing can be shared other than the repeated last frame */
+  rzx3 = record_frames( 1 );
+
+  if( check_frames( rzx3, pointers ) ) {
+    fprintf( stderr, "%s: colliding frames not played back\n", progname );
+    goto cleanup;
+  }
+
+  for( i = 2; i < 6; i++ ) {
+    if( pointers[i] == pointers[ i - 2 ] ) {
+      fprintf( stderr, "%s: frame %lu shared after collision\n", progname,
+               (unsigned long)i );
+      goto cleanup;
+    }
+  }
+
+  if( pointers[6] != pointers[5] ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  if( rzx3 ) libspectrum_rzx_free( rzx3 );
+  libspectrum_free( buffer );
+  if( rzx2 ) libspectrum_rzx_free( rzx2 );
+  libspectrum_rzx_free( rzx );
+
+  return r;
+}
+
+static test_return_t
+test_78( void )
+{
+  const char *filename = STATIC_TEST_PATH( "random.szx" );
+  libspectrum_byte *snap_buffer = NULL, *buffer1 = NULL, *buffer2 = NULL;
+  libspectrum_byte in_bytes[] = { 0xbf, 0xff };
+  size_t filesize = 0, length1 = 0, length2 = 0, i;
+  libspectrum_rzx *rzx;
+  libspectrum_snap *snap;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( read_file( &snap_buffer, &filesize, filename ) ) return TEST_INCOMPLETE;
+
+  rzx = libspectrum_rzx_alloc();
+
+  for( i = 0; i < 3; i++ ) {
+    snap = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( snap, snap_buffer, filesize,
+                               LIBSPECTRUM_ID_UNKNOWN, filename ) ) {
+      libspectrum_snap_free( snap );
+      goto cleanup;
+    }
+    libspectrum_rzx_add_snap( rzx, snap, 0 );
+    libspectrum_rzx_start_input( rzx, 0 );
+    libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( in_bytes ), in_bytes );
+  }
+
+  if( libspectrum_rzx_write( &buffer1, &length1, rzx, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL, 1, NULL ) )
+    goto cleanup;
+
+  libspectrum_rzx_set_write_threads( rzx, 4 );
+
+  if( libspectrum_rzx_write( &buffer2, &length2, rzx, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL, 1, NULL ) )
+    goto cleanup;
+
+  r = length1 == length2 && !memcmp( buffer1, buffer2, length1 ) ?
+      TEST_PASS : TEST_FAIL;
+
+cleanup:
+  libspectrum_free( buffer2 );
+  libspectrum_free( buffer1 );
+  libspectrum_free( snap_buffer );
+  libspectrum_rzx_free( rzx );
+
+  return r;
+}
+
+#ifdef HAVE_GCRYPT_H
+/* A throwaway DSA key, used only by the signature tests */
+static libspectrum_rzx_dsa_key test_key = {
+  "b94bb3a35a50f60a985dccb10af43f6a639a1dfacc593732110d483fd633c6566d28374d"
+  "f56f5ce4dc42da4649fc918cdb130ed6b62c8f6d78eae2000ace4b1b93ed187c5fc5631d"
+  "d919ba1914347fc3c85f67f8de63be9f02b38fda5ede4e46c896db13129dc7ee9c43d209"
+  "602374b35d0418d075ed9b8e51980faa41b47451",
+  "ee108997aa6dd3033eaa4e2f7f0abd9eb3ef7ce5",
+  "a97ff4b23d56eac9220814333f2087ae6d13a1e47dcc849e8c3f3c56bf48b6243bec66ba"
+  "50fd329de87d34167ef10e8b9cf33d3c19d8a7a24dc448373e41ee51f3f1b5c6ce2af253"
+  "de3048ecae6e4ce4e37a3da7e46ad1cc1496f44ee192cfc799575c13c003e570f00f9059"
+  "4c1ca5da74420f63bf210f7e99a2c5d90880d3",
+  "171e735f67382ca40fe1ca688b0ff3894cfbefbe94e6939670b0386d028af0dbe23a8f87"
+  "2d0bd0495cec27e4864685d37e1b9fe17fd568552fded9652215f63207bce76bd89793a5"
+  "2fceadc8c24a8d3d24c722340a28dcd6a7f3c4505ba23d678018eaad7d037796885626e3"
+  "9d12281b176d4bf963752f366c4ce413fe451425",
+  "9fa50a91808ab412005f755f9dd2afc74b80e8d7"
+};
+
+static libspectrum_error
+verify_rzx( const libspectrum_byte *buffer, size_t length,
+            libspectrum_rzx_dsa_key *key )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_signature signature;
+  libspectrum_error error, error2;
+
+  error = libspectrum_rzx_read( rzx, buffer, length );
+  if( error ) { libspectrum_rzx_free( rzx ); return error; }
+
+  error = libspectrum_rzx_verify_signature( rzx, key );
+
+  /* The old interface should agree */
+  if( libspectrum_rzx_get_signature( rzx, &signature ) ) {
+    libspectrum_rzx_free( rzx );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+  error2 = libspectrum_verify_signature( &signature, key );
+  libspectrum_signature_free( &signature );
+
+  libspectrum_rzx_free( rzx );
+
+  return error == error2 ? error : LIBSPECTRUM_ERROR_LOGIC;
+}
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
+static test_return_t
+test_79( void )
+{
+#ifdef HAVE_GCRYPT_H
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_creator *creator = libspectrum_creator_alloc();
+  libspectrum_rzx_dsa_key public_key = test_key;
+  libspectrum_byte in_bytes[] = { 0xbf, 0xff, 0x1f };
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0, i;
+  test_return_t r = TEST_INCOMPLETE;
+
+  public_key.x = NULL;
+
+  libspectrum_creator_set_program( creator, "libspectrum test" );
+
+  libspectrum_rzx_start_input( rzx, 0 );
+  for( i = 0; i < 10; i++ )
+    libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( in_bytes ), in_bytes );
+  libspectrum_rzx_stop_input( rzx );
+
+  if( libspectrum_rzx_write( &buffer, &length, rzx, LIBSPECTRUM_ID_UNKNOWN,
+                             creator, 0, &test_key ) )
+    goto cleanup;
+
+  r = TEST_FAIL;
+
+  /* Verifying twice exercises the key cache */
+  if( verify_rzx( buffer, length, &public_key ) ||
+      verify_rzx( buffer, length, &public_key ) ) {
+    fprintf( stderr, "%s: valid signature not verified\n", progname );
+    goto cleanup;
+  }
+
+  /* Corrupt the recorded IN bytes; as all frames are the same, they appear
+     only once in the file */
+  for( i = 0; i + ARRAY_SIZE( in_bytes ) <= length; i++ ) {
+    if( !memcmp( &buffer[i], in_bytes, ARRAY_SIZE( in_bytes ) ) ) {
+      buffer[i] ^= 0xff;
+      break;
+    }
+  }
+
+  if( verify_rzx( buffer, length, &public_key ) !=
+      LIBSPECTRUM_ERROR_SIGNATURE ) {
+    fprintf( stderr, "%s: invalid signature verified\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_free( buffer );
+  libspectrum_creator_free( creator );
+  libspectrum_rzx_free( rzx );
+
+  return r;
+#else				/* #ifdef HAVE_GCRYPT_H */
+  return TEST_SKIPPED;
+#endif				/* #ifdef HAVE_GCRYPT_H */
+}
+
+/* Write the header for an HDF with the given geometry */
+static void
+write_hdf_header( FILE *f, int halved, int cylinders, int heads, int sectors )
+{
+  libspectrum_byte header[0x80];
+
+  memset( header, 0, sizeof( header ) );
+  memcpy( header, "RS-IDE", 6 );
+  header[0x06] = 0x1a;
+  header[0x07] = 0x11;
+  header[0x08] = halved ? 0x01 : 0x00;
+  header[0x09] = sizeof( header );
+
+  /* Geometry in the drive identity, plus LBA supported */
+  header[0x16 + 2] = cylinders & 0xff; header[0x16 + 3] = cylinders >> 8;
+  header[0x16 + 6] = heads;
+  header[0x16 + 12] = sectors;
+  header[0x16 + 99] = 0x02;
+
+  fwrite( header, 1, sizeof( header ), f );
+}
+
+/* Create a temporary HDF file; byte 0 of sector n is the high byte of n, and
+   the rest of the sector its low byte. If `sparse' is set, only the header
+   is written */
+static int
+create_hdf_file( char *filename, int halved, int cylinders, int heads,
+                 int sectors, int sparse )
+{
+  libspectrum_byte sector[512];
+  int fd, sector_size = halved ? 256 : 512;
+  long i, count = sparse ? 0 : (long)cylinders * heads * sectors;
+  FILE *f;
+
+  fd = mkstemp( filename );
+  if( fd == -1 ) {
+    fprintf( stderr, "%s: couldn't create `%s': %s\n", progname, filename,
+             strerror( errno ) );
+    return 1;
+  }
+
+  f = fdopen( fd, "wb" );
+  if( !f ) {
+    close( fd );
+    unlink( filename );
+    return 1;
+  }
+
+  write_hdf_header( f, halved, cylinders, heads, sectors );
+
+  for( i = 0; i < count; i++ ) {
+    memset( sector, i & 0xff, sector_size );
+    sector[0] = i >> 8;
+    fwrite( sector, 1, sector_size, f );
+  }
+
+  if( fclose( f ) ) {
+    unlink( filename );
+    return 1;
+  }
+
+  return 0;
+}
+
+static int
+create_hdf( char *filename, int halved, int cylinders, int heads,
+            int sectors )
+{
+  return create_hdf_file( filename, halved, cylinders, heads, sectors, 0 );
+}
+
+/* Issue an LBA command for `count' sectors from `sector' */
+static void
+ide_lba_command( libspectrum_ide_channel *chn, libspectrum_byte command,
+                 libspectrum_dword sector, libspectrum_byte count )
+{
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_HEAD_DRIVE,
+                         0xe0 | ( ( sector >> 24 ) & 0x0f ) );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR_COUNT, count );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR,
+                         sector & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_LOW,
+                         ( sector >> 8 ) & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_HIGH,
+                         ( sector >> 16 ) & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS,
+                         command );
+}
+
+/* Check `count' sectors read through the data register look as written by
+   create_hdf(), with the `changed_count' sectors from `changed' overwritten
+   with 0xaa */
+static int
+check_ide_sectors( libspectrum_ide_channel *chn, int halved,
+                   libspectrum_dword first, int count,
+                   libspectrum_dword changed, int changed_count )
+{
+  libspectrum_dword n;
+  libspectrum_byte b, expected;
+  int i;
+
+  for( n = first; n < first + count; n++ ) {
+    for( i = 0; i < 512; i++ ) {
+      b = libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA );
+      if( halved && ( i & 1 ) ) {
+        expected = 0xff;
+      } else if( n >= changed && n < changed + changed_count ) {
+        expected = 0xaa;
+      } else {
+        expected = i ? n & 0xff : n >> 8;
+      }
+      if( b != expected ) {
+        fprintf( stderr, "%s: sector %lu byte %d is 0x%02x not 0x%02x\n",
+                 progname, (unsigned long)n, i, b, expected );
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static test_return_t
+ide_sector_test( int halved )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn;
+  test_return_t r = TEST_FAIL;
+  int i;
+
+  if( create_hdf( filename, halved, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  /* Read some sectors spread across the disk */
+  ide_lba_command( chn, 0x20, 0, 3 );
+  if( check_ide_sectors( chn, halved, 0, 3, 0, 0 ) ) goto cleanup;
+  ide_lba_command( chn, 0x20, 1000, 2 );
+  if( check_ide_sectors( chn, halved, 1000, 2, 0, 0 ) ) goto cleanup;
+
+  /* Overwrite a sector; it should be read back both before and after being
+     committed to disk */
+  ide_lba_command( chn, 0x30, 300, 1 );
+  for( i = 0; i < 512; i++ )
+    libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA, 0xaa );
+
+  ide_lba_command( chn, 0x20, 299, 3 );
+  if( check_ide_sectors( chn, halved, 299, 3, 300, 1 ) ) goto cleanup;
+
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+  if( libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: drive still dirty after commit\n", progname );
+    goto cleanup;
+  }
+
+  ide_lba_command( chn, 0x20, 299, 3 );
+  if( check_ide_sectors( chn, halved, 299, 3, 300, 1 ) ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  unlink( filename );
+
+  return r;
+}
+
+static test_return_t
+test_80( void )
+{
+  test_return_t r;
+
+  r = ide_sector_test( 0 );
+  if( r != TEST_PASS ) return r;
+
+  return ide_sector_test( 1 );
+}
+
+static void
+ide_write_sectors( libspectrum_ide_channel *chn, libspectrum_dword first,
+                   int count )
+{
+  int i;
+
+  ide_lba_command( chn, 0x30, first, count );
+  for( i = 0; i < count * 512; i++ )
+    libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA, 0xaa );
+}
+
+static test_return_t
+test_81( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn;
+  test_return_t r = TEST_FAIL;
+
+  if( create_hdf( filename, 0, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  /* A long run crossing a cache leaf boundary, written out of order, plus
+     some isolated sectors */
+  ide_write_sectors( chn, 1000, 200 );
+  ide_write_sectors( chn, 900, 100 );
+  ide_write_sectors( chn, 1279, 1 );
+  ide_write_sectors( chn, 5, 1 );
+
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+  if( libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: drive still dirty after commit\n", progname );
+    goto cleanup;
+  }
+
+  /* Reinsert the disk so everything comes from the file */
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  ide_lba_command( chn, 0x20, 4, 3 );
+  if( check_ide_sectors( chn, 0, 4, 3, 5, 1 ) ) goto cleanup;
+  ide_lba_command( chn, 0x20, 899, 255 );
+  if( check_ide_sectors( chn, 0, 899, 255, 900, 300 ) ) goto cleanup;
+  ide_lba_command( chn, 0x20, 1154, 125 );
+  if( check_ide_sectors( chn, 0, 1154, 125, 900, 300 ) ) goto cleanup;
+  ide_lba_command( chn, 0x20, 1279, 1 );
+  if( check_ide_sectors( chn, 0, 1279, 1, 1279, 1 ) ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  unlink( filename );
+
+  return r;
+}
+
+static gboolean
+remove_odd_keys( gpointer key, gpointer value GCC_UNUSED,
+                 gpointer user_data GCC_UNUSED )
+{
+  return *(gint*)key & 1;
+}
+
+static test_return_t
+test_82( void )
+{
+  GHashTable *hash;
+  const gint count = 100000;
+  gint i, *key, *value;
+  test_return_t r = TEST_FAIL;
+
+  hash = g_hash_table_new_full( g_int_hash, g_int_equal, libspectrum_free,
+                                NULL );
+
+  for( i = 0; i < count; i++ ) {
+    key = libspectrum_new( gint, 1 );
+    *key = i * 7;
+    g_hash_table_insert( hash, key, GINT_TO_POINTER( i + 1 ) );
+  }
+
+  if( g_hash_table_size( hash ) != count ) goto cleanup;
+
+  for( i = 0; i < count; i++ ) {
+    gint k = i * 7;
+    value = g_hash_table_lookup( hash, &k );
+    if( GPOINTER_TO_INT( value ) != i + 1 ) {
+      fprintf( stderr, "%s: key %d not found\n", progname, k );
+      goto cleanup;
+    }
+  }
+
+  if( g_hash_table_foreach_remove( hash, remove_odd_keys, NULL ) !=
+      count / 2 )
+    goto cleanup;
+
+  for( i = 0; i < count; i++ ) {
+    gint k = i * 7;
+    value = g_hash_table_lookup( hash, &k );
+    if( ( k & 1 ) ? value != NULL : GPOINTER_TO_INT( value ) != i + 1 ) {
+      fprintf( stderr, "%s: wrong value for key %d after removal\n",
+               progname, k );
+      goto cleanup;
+    }
+  }
+
+  /* Reinsert over the removed entries and replace some existing ones */
+  for( i = 0; i < count; i++ ) {
+    key = libspectrum_new( gint, 1 );
+    *key = i * 7;
+    g_hash_table_insert( hash, key, GINT_TO_POINTER( -i ) );
+  }
+
+  if( g_hash_table_size( hash ) != count ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  g_hash_table_destroy( hash );
+
+  return r;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Build and free lists repeatedly, checking no node is handed out twice */
+static void*
+slist_worker( void *arg )
+{
+  int *failed = arg;
+  GSList *list, *l;
+  gint i, j;
+
+  for( i = 0; i < 200; i++ ) {
+    list = NULL;
+    for( j = 0; j < 500; j++ )
+      list = g_slist_prepend( list, GINT_TO_POINTER( j ) );
+
+    for( l = list, j = 499; l; l = l->next, j-- ) {
+      if( GPOINTER_TO_INT( l->data ) != j ) {
+        *failed = 1;
+        break;
+      }
+    }
+
+    g_slist_free( list );
+  }
+
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+static test_return_t
+test_83( void )
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[4];
+  int failed[ ARRAY_SIZE( threads ) ];
+  size_t i, started;
+  test_return_t r = TEST_PASS;
+
+  for( started = 0; started < ARRAY_SIZE( threads ); started++ ) {
+    failed[ started ] = 0;
+    if( pthread_create( &threads[ started ], NULL, slist_worker,
+                        &failed[ started ] ) ) {
+      r = TEST_INCOMPLETE;
+      break;
+    }
+  }
+
+  for( i = 0; i < started; i++ ) {
+    pthread_join( threads[i], NULL );
+    if( failed[i] ) {
+      fprintf( stderr, "%s: list corrupted in thread %lu\n", progname,
+               (unsigned long)i );
+      r = TEST_FAIL;
+    }
+  }
+
+  return r;
+#else				/* #ifdef HAVE_PTHREAD_H */
+  return TEST_SKIPPED;
+#endif				/* #ifdef HAVE_PTHREAD_H */
+}
+
+static test_return_t
+test_84( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn;
+  libspectrum_byte *data;
+  test_return_t r = TEST_FAIL;
+  size_t i;
+
+  if( create_hdf( filename, 0, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  data = libspectrum_new( libspectrum_byte, 12 * 512 );
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  /* READ MULTIPLE is rejected until multiple mode is set */
+  ide_lba_command( chn, 0xc4, 100, 10 );
+  if( !( libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS )
+         & 0x01 ) ) {
+    fprintf( stderr, "%s: READ MULTIPLE accepted without SET MULTIPLE\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* 10 sectors in blocks of 4 leaves a partial block at the end */
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR_COUNT, 4 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS, 0xc6 );
+
+  ide_lba_command( chn, 0xc4, 100, 10 );
+  if( check_ide_sectors( chn, 0, 100, 10, 0, 0 ) ) goto cleanup;
+
+  /* Write with the block API, crossing block boundaries mid-call */
+  memset( data, 0xaa, 10 * 512 );
+  ide_lba_command( chn, 0xc5, 200, 10 );
+  libspectrum_ide_write_block( chn, data, 1000 );
+  libspectrum_ide_write_block( chn, data, 10 * 512 - 1000 );
+
+  if( libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS ) &
+      0x09 ) {
+    fprintf( stderr, "%s: WRITE MULTIPLE did not complete\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+
+  /* Read back with single sector reads through the block API; reading past
+     the end of the data gives 0xff */
+  ide_lba_command( chn, 0x20, 199, 12 );
+  libspectrum_ide_read_block( chn, data, 6 * 512 + 7 );
+  libspectrum_ide_read_block( chn, data + 6 * 512 + 7, 6 * 512 - 7 );
+
+  for( i = 0; i < 12 * 512; i++ ) {
+    libspectrum_dword n = 199 + i / 512;
+    libspectrum_byte expected = ( n >= 200 && n < 210 ) ? 0xaa :
+                                i % 512 ? n & 0xff : n >> 8;
+    if( data[i] != expected ) {
+      fprintf( stderr, "%s: byte %lu is 0x%02x not 0x%02x\n", progname,
+               (unsigned long)i, data[i], expected );
+      goto cleanup;
+    }
+  }
+
+  libspectrum_ide_read_block( chn, data, 1 );
+  if( data[0] != 0xff ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  libspectrum_free( data );
+  unlink( filename );
+
+  return r;
+}
+
+/* Send a command to an MMC card, returning the first non-0xff byte of the
+   response */
+static libspectrum_byte
+mmc_command( libspectrum_mmc_card *card, libspectrum_byte command,
+             libspectrum_dword argument )
+{
+  libspectrum_byte r = 0xff;
+  int i;
+
+  libspectrum_mmc_write( card, 0x40 | command );
+  libspectrum_mmc_write( card, argument >> 24 );
+  libspectrum_mmc_write( card, ( argument >> 16 ) & 0xff );
+  libspectrum_mmc_write( card, ( argument >> 8 ) & 0xff );
+  libspectrum_mmc_write( card, argument & 0xff );
+  libspectrum_mmc_write( card, 0x01 );
+
+  for( i = 0; i < 8 && r == 0xff; i++ ) r = libspectrum_mmc_read( card );
+
+  return r;
+}
+
+/* Read the data for `count' blocks following a read command, checking it
+   looks as written by create_hdf() with the blocks from `changed' set to
+   0xaa */
+static int
+check_mmc_blocks( libspectrum_mmc_card *card, libspectrum_dword first,
+                  int count, libspectrum_dword changed, int changed_count )
+{
+  libspectrum_dword n;
+  libspectrum_byte b, expected;
+  int i;
+
+  for( n = first; n < first + count; n++ ) {
+    b = libspectrum_mmc_read( card );
+    if( b != 0xfe ) {
+      fprintf( stderr, "%s: got 0x%02x not data token for block %lu\n",
+               progname, b, (unsigned long)n );
+      return 1;
+    }
+    for( i = 0; i < 512; i++ ) {
+      b = libspectrum_mmc_read( card );
+      expected = ( n >= changed && n < changed + changed_count ) ? 0xaa :
+                 i ? n & 0xff : n >> 8;
+      if( b != expected ) {
+        fprintf( stderr, "%s: block %lu byte %d is 0x%02x not 0x%02x\n",
+                 progname, (unsigned long)n, i, b, expected );
+        return 1;
+      }
+    }
+    /* CRC */
+    libspectrum_mmc_read( card );
+    libspectrum_mmc_read( card );
+  }
+
+  return 0;
+}
+
+static test_return_t
+test_85( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_mmc_card *card;
+  test_return_t r = TEST_FAIL;
+  int i, j;
+
+  /* 1024 sectors is the smallest card supported */
+  if( create_hdf( filename, 0, 16, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  /* Initialise as an SDHC card */
+  mmc_command( card, 0, 0 );
+  mmc_command( card, 8, 0x1aa );
+  mmc_command( card, 55, 0 );
+  if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) {
+    fprintf( stderr, "%s: card did not initialise\n", progname );
+    goto cleanup;
+  }
+
+  /* Stream more blocks than are read ahead at once */
+  if( mmc_command( card, 18, 10 ) != 0x00 ) goto cleanup;
+  if( check_mmc_blocks( card, 10, 20, 0, 0 ) ) goto cleanup;
+  if( mmc_command( card, 12, 0 ) != 0x00 ) {
+    fprintf( stderr, "%s: STOP_TRANSMISSION failed\n", progname );
+    goto cleanup;
+  }
+
+  /* Write three blocks then stop */
+  if( mmc_command( card, 25, 500 ) != 0x00 ) goto cleanup;
+  for( i = 0; i < 3; i++ ) {
+    libspectrum_mmc_write( card, 0xfc );
+    for( j = 0; j < 512; j++ ) libspectrum_mmc_write( card, 0xaa );
+    libspectrum_mmc_write( card, 0x00 );
+    libspectrum_mmc_write( card, 0x00 );
+    if( ( libspectrum_mmc_read( card ) & 0x1f ) != 0x05 ) {
+      fprintf( stderr, "%s: block %d not accepted\n", progname, i );
+      goto cleanup;
+    }
+  }
+  libspectrum_mmc_write( card, 0xfd );
+
+  if( !libspectrum_mmc_dirty( card ) ) goto cleanup;
+  libspectrum_mmc_commit( card );
+
+  if( mmc_command( card, 17, 502 ) != 0x00 ) goto cleanup;
+  if( check_mmc_blocks( card, 502, 1, 500, 3 ) ) goto cleanup;
+
+  /* Reading stops at the end of the card */
+  if( mmc_command( card, 18, 1020 ) != 0x00 ) goto cleanup;
+  if( check_mmc_blocks( card, 1020, 4, 0, 0 ) ) goto cleanup;
+  if( libspectrum_mmc_read( card ) != 0xff ) goto cleanup;
+  if( mmc_command( card, 12, 0 ) != 0x00 ) goto cleanup;
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_mmc_free( card );
+  unlink( filename );
+
+  return r;
+}
+
+static int
+create_overlay( char *filename )
+{
+  int fd = mkstemp( filename );
+
+  if( fd == -1 ) {
+    fprintf( stderr, "%s: couldn't create `%s': %s\n", progname, filename,
+             strerror( errno ) );
+    return 1;
+  }
+
+  close( fd );
+  return 0;
+}
+
+static test_return_t
+test_86( void )
+{
+  char filename[] = "hdfXXXXXX", other[] = "hdfXXXXXX",
+    overlay1[] = "ovlXXXXXX", overlay2[] = "ovlXXXXXX";
+  libspectrum_ide_channel *chn1, *chn2;
+  libspectrum_byte *buffer = NULL;
+  size_t length;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( create_hdf( filename, 0, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+  if( create_overlay( overlay1 ) ) { unlink( filename ); return r; }
+  if( create_overlay( overlay2 ) ) {
+    unlink( filename ); unlink( overlay1 ); return r;
+  }
+
+  chn1 = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  chn2 = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+
+  /* Two drives sharing the same base image */
+  if( libspectrum_ide_insert_overlay( chn1, LIBSPECTRUM_IDE_MASTER, filename,
+                                      overlay1 ) ||
+      libspectrum_ide_insert_overlay( chn2, LIBSPECTRUM_IDE_MASTER, filename,
+                                      overlay2 ) )
+    goto cleanup;
+  libspectrum_ide_reset( chn1 );
+  libspectrum_ide_reset( chn2 );
+
+  r = TEST_FAIL;
+
+  ide_write_sectors( chn1, 8, 4 );
+  ide_write_sectors( chn1, 1100, 2 );
+  libspectrum_ide_commit( chn1, LIBSPECTRUM_IDE_MASTER );
+
+  ide_lba_command( chn1, 0x20, 7, 6 );
+  if( check_ide_sectors( chn1, 0, 7, 6, 8, 4 ) ) goto cleanup;
+  ide_lba_command( chn2, 0x20, 7, 6 );
+  if( check_ide_sectors( chn2, 0, 7, 6, 0, 0 ) ) goto cleanup;
+
+  /* The base image must not have changed */
+  if( read_file( &buffer, &length, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  if( buffer[ 0x80 + 8 * 512 + 1 ] != 8 ) {
+    fprintf( stderr, "%s: base image modified\n", progname );
+    goto cleanup;
+  }
+
+  /* The changes persist in the overlay */
+  if( libspectrum_ide_insert_overlay( chn2, LIBSPECTRUM_IDE_MASTER, filename,
+                                      overlay1 ) ) goto cleanup;
+  libspectrum_ide_reset( chn2 );
+  ide_lba_command( chn2, 0x20, 1099, 4 );
+  if( check_ide_sectors( chn2, 0, 1099, 4, 1100, 2 ) ) goto cleanup;
+  ide_lba_command( chn2, 0x20, 7, 6 );
+  if( check_ide_sectors( chn2, 0, 7, 6, 8, 4 ) ) goto cleanup;
+
+  /* An overlay can't be used with a different disk */
+  libspectrum_ide_eject( chn1, LIBSPECTRUM_IDE_MASTER );
+  if( create_hdf( other, 0, 10, 4, 16 ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  if( libspectrum_ide_insert_overlay( chn1, LIBSPECTRUM_IDE_MASTER, other,
+                                      overlay1 ) !=
+      LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: mismatched overlay accepted\n", progname );
+    unlink( other );
+    goto cleanup;
+  }
+  unlink( other );
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn1 );
+  libspectrum_ide_free( chn2 );
+  libspectrum_free( buffer );
+  unlink( filename );
+  unlink( overlay1 );
+  unlink( overlay2 );
+
+  return r;
+}
+
+/* Read a block following a read command, checking every byte is `value' */
+static int
+check_mmc_fill( libspectrum_mmc_card *card, libspectrum_byte value )
+{
+  libspectrum_byte b;
+  int i;
+
+  if( libspectrum_mmc_read( card ) != 0xfe ) return 1;
+
+  for( i = 0; i < 512; i++ ) {
+    b = libspectrum_mmc_read( card );
+    if( b != value ) {
+      fprintf( stderr, "%s: byte %d is 0x%02x not 0x%02x\n", progname, i, b,
+               value );
+      return 1;
+    }
+  }
+
+  /* CRC */
+  libspectrum_mmc_read( card );
+  libspectrum_mmc_read( card );
+
+  return 0;
+}
+
+static test_return_t
+test_87( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_mmc_card *card;
+  libspectrum_byte csd[16];
+  struct stat info;
+  /* Past the 4 Gb mark */
+  libspectrum_dword block = 0x00fffff0;
+  test_return_t r = TEST_FAIL;
+  int i;
+
+  /* An 8 Gb card with nothing but the header on disk */
+  if( create_hdf_file( filename, 0, 16384, 16, 64, 1 ) )
+    return TEST_INCOMPLETE;
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  mmc_command( card, 0, 0 );
+  mmc_command( card, 8, 0x1aa );
+  mmc_command( card, 55, 0 );
+  if( mmc_command( card, 41, 0x40000000 ) != 0x00 ) {
+    fprintf( stderr, "%s: card did not initialise\n", progname );
+    goto cleanup;
+  }
+
+  /* C_SIZE is the number of 512 Kb units less one */
+  if( mmc_command( card, 9, 0 ) != 0x00 ||
+      libspectrum_mmc_read( card ) != 0xfe ) goto cleanup;
+  for( i = 0; i < 16; i++ ) csd[i] = libspectrum_mmc_read( card );
+  if( ( csd[7] & 0x3f ) != 0x00 || csd[8] != 0x3f || csd[9] != 0xff ) {
+    fprintf( stderr, "%s: wrong C_SIZE in CSD\n", progname );
+    goto cleanup;
+  }
+
+  /* Unwritten blocks read as zeros */
+  if( mmc_command( card, 17, block ) != 0x00 ) goto cleanup;
+  if( check_mmc_fill( card, 0x00 ) ) goto cleanup;
+
+  if( mmc_command( card, 24, block ) != 0x00 ) goto cleanup;
+  libspectrum_mmc_write( card, 0xfe );
+  for( i = 0; i < 512; i++ ) libspectrum_mmc_write( card, 0xaa );
+  libspectrum_mmc_write( card, 0x00 );
+  libspectrum_mmc_write( card, 0x00 );
+  if( ( libspectrum_mmc_read( card ) & 0x1f ) != 0x05 ) {
+    fprintf( stderr, "%s: block not accepted\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_mmc_commit( card );
+
+  if( mmc_command( card, 17, block ) != 0x00 ) goto cleanup;
+  if( check_mmc_fill( card, 0xaa ) ) goto cleanup;
+  if( mmc_command( card, 17, 5 ) != 0x00 ) goto cleanup;
+  if( check_mmc_fill( card, 0x00 ) ) goto cleanup;
+
+  /* The block went to the right place in the file */
+  if( stat( filename, &info ) ) goto cleanup;
+  if( info.st_size != 0x80 + ( (off_t)block + 1 ) * 512 ) {
+    fprintf( stderr, "%s: image is %.0f bytes long\n", progname,
+             (double)info.st_size );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_mmc_free( card );
+  unlink( filename );
+
+  return r;
+}
+
+static test_return_t
+test_88( void )
+{
+  char filename[] = "hdfXXXXXX", card_filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn;
+  libspectrum_mmc_card *card = NULL;
+  libspectrum_ide_stats stats;
+  test_return_t r = TEST_FAIL;
+
+  if( create_hdf( filename, 0, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  ide_lba_command( chn, 0x20, 10, 3 );
+  if( check_ide_sectors( chn, 0, 10, 3, 0, 0 ) ) goto cleanup;
+  ide_write_sectors( chn, 11, 2 );
+  ide_lba_command( chn, 0x20, 10, 3 );
+  if( check_ide_sectors( chn, 0, 10, 3, 11, 2 ) ) goto cleanup;
+
+  libspectrum_ide_get_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+  if( stats.sectors_read != 6 || stats.sectors_written != 2 ||
+      stats.cache_hits != 2 || stats.cache_misses != 4 ||
+      stats.dirty_sectors != 2 || stats.commits != 0 ||
+      stats.commands[ 0x20 ] != 2 || stats.commands[ 0x30 ] != 1 ) {
+    fprintf( stderr, "%s: wrong IDE counters before commit\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+
+  libspectrum_ide_get_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+  if( stats.dirty_sectors != 0 || stats.commits != 1 ||
+      stats.bytes_flushed != 2 * 512 || stats.commit_time < 0 ) {
+    fprintf( stderr, "%s: wrong IDE counters after commit\n", progname );
+    goto cleanup;
+  }
+
+  /* 1024 sectors is the smallest card supported */
+  if( create_hdf( card_filename, 0, 16, 4, 16 ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  card = libspectrum_mmc_alloc();
+  if( libspectrum_mmc_insert( card, card_filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  mmc_command( card, 0, 0 );
+  mmc_command( card, 8, 0x1aa );
+  mmc_command( card, 55, 0 );
+  mmc_command( card, 41, 0x40000000 );
+  if( mmc_command( card, 17, 7 ) != 0x00 ) goto cleanup;
+  if( check_mmc_blocks( card, 7, 1, 0, 0 ) ) goto cleanup;
+
+  libspectrum_mmc_get_stats( card, &stats );
+  if( stats.sectors_read != 1 || stats.cache_misses != 1 ||
+      stats.commands[ 0 ] != 1 || stats.commands[ 8 ] != 1 ||
+      stats.commands[ 55 ] != 1 || stats.commands[ 64 + 41 ] != 1 ||
+      stats.commands[ 41 ] != 0 || stats.commands[ 17 ] != 1 ) {
+    fprintf( stderr, "%s: wrong MMC counters\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  unlink( filename );
+  if( card ) {
+    libspectrum_mmc_free( card );
+    unlink( card_filename );
+  }
+
+  return r;
+}
+
+static test_return_t
+test_89( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn, *chn2 = NULL;
+  libspectrum_ide_stats stats;
+  test_return_t r = TEST_FAIL;
+
+  if( create_hdf( filename, 0, 20, 4, 16 ) ) return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  ide_write_sectors( chn, 100, 200 );
+  libspectrum_ide_commit_async( chn, LIBSPECTRUM_IDE_MASTER );
+
+  /* Reads and writes carry on while the commit runs */
+  ide_lba_command( chn, 0x20, 90, 30 );
+  if( check_ide_sectors( chn, 0, 90, 30, 100, 200 ) ) goto cleanup;
+  ide_write_sectors( chn, 1000, 2 );
+  ide_lba_command( chn, 0x20, 999, 4 );
+  if( check_ide_sectors( chn, 0, 999, 4, 1000, 2 ) ) goto cleanup;
+
+  libspectrum_ide_commit_wait( chn, LIBSPECTRUM_IDE_MASTER );
+
+  libspectrum_ide_get_stats( chn, LIBSPECTRUM_IDE_MASTER, &stats );
+  if( stats.dirty_sectors != 2 || stats.commits != 1 ||
+      stats.bytes_flushed != 200 * 512 ) {
+    fprintf( stderr, "%s: wrong counters after background commit\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* A second commit picks up the later writes */
+  libspectrum_ide_commit_async( chn, LIBSPECTRUM_IDE_MASTER );
+  libspectrum_ide_commit_wait( chn, LIBSPECTRUM_IDE_MASTER );
+  if( libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: drive still dirty after commit\n", progname );
+    goto cleanup;
+  }
+
+  /* Everything should now be in the file */
+  chn2 = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn2, LIBSPECTRUM_IDE_MASTER, filename ) )
+    goto cleanup;
+  libspectrum_ide_reset( chn2 );
+
+  ide_lba_command( chn2, 0x20, 290, 20 );
+  if( check_ide_sectors( chn2, 0, 290, 20, 100, 200 ) ) goto cleanup;
+  ide_lba_command( chn2, 0x20, 999, 4 );
+  if( check_ide_sectors( chn2, 0, 999, 4, 1000, 2 ) ) goto cleanup;
+
+  /* Ejecting waits for a commit still running */
+  ide_write_sectors( chn, 500, 20 );
+  libspectrum_ide_commit_async( chn, LIBSPECTRUM_IDE_MASTER );
+  libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  if( chn2 ) libspectrum_ide_free( chn2 );
+  unlink( filename );
+
+  return r;
+}
+
+/* gzip `length' bytes of data, with `isize' as the stated uncompressed
+   length */
+#ifdef HAVE_ZLIB_H
+static libspectrum_byte*
+make_gzip( const libspectrum_byte *data, size_t length,
+           libspectrum_dword isize, size_t *gzip_length )
+{
+  static const libspectrum_byte header[10] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03
+  };
+  libspectrum_byte *zlib, *gzip, *ptr;
+  size_t zlib_length, deflate_length;
+  libspectrum_dword crc;
+
+  if( libspectrum_zlib_compress( data, length, &zlib, &zlib_length ) )
+    return NULL;
+
+  /* Strip the zlib header and Adler-32 checksum from the deflate data */
+  deflate_length = zlib_length - 6;
+  *gzip_length = sizeof( header ) + deflate_length + 8;
+  gzip = ptr = libspectrum_new( libspectrum_byte, *gzip_length );
+
+  memcpy( ptr, header, sizeof( header ) ); ptr += sizeof( header );
+  memcpy( ptr, zlib + 2, deflate_length ); ptr += deflate_length;
+
+  crc = crc32( 0, data, length );
+  *ptr++ = crc & 0xff; *ptr++ = ( crc >> 8 ) & 0xff;
+  *ptr++ = ( crc >> 16 ) & 0xff; *ptr++ = crc >> 24;
+  *ptr++ = isize & 0xff; *ptr++ = ( isize >> 8 ) & 0xff;
+  *ptr++ = ( isize >> 16 ) & 0xff; *ptr++ = isize >> 24;
+
+  libspectrum_free( zlib );
+
+  return gzip;
+}
+
+/* Make a gzipped .tap file containing one block of `length' bytes */
+static libspectrum_byte*
+make_gzipped_tap( const libspectrum_byte *data, size_t length,
+                  libspectrum_dword isize, size_t *gzip_length )
+{
+  libspectrum_byte *tap, *gzip;
+
+  tap = libspectrum_new( libspectrum_byte, length + 2 );
+  tap[0] = length & 0xff; tap[1] = length >> 8;
+  memcpy( tap + 2, data, length );
+
+  gzip = make_gzip( tap, length + 2, isize, gzip_length );
+
+  libspectrum_free( tap );
+
+  return gzip;
+}
+
+static int
+check_gzipped_tap( const libspectrum_byte *data, size_t length,
+                   libspectrum_dword isize )
+{
+  libspectrum_byte *gzip;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator it;
+  size_t gzip_length;
+  int r = 1;
+
+  gzip = make_gzipped_tap( data, length, isize, &gzip_length );
+  if( !gzip ) return 1;
+
+  tape = libspectrum_tape_alloc();
+  if( !libspectrum_tape_read( tape, gzip, gzip_length,
+                              LIBSPECTRUM_ID_UNKNOWN, "test.tap.gz" ) ) {
+    block = libspectrum_tape_iterator_init( &it, tape );
+    if( block && libspectrum_tape_block_data_length( block ) == length &&
+        !memcmp( libspectrum_tape_block_data( block ), data, length ) )
+      r = 0;
+  }
+
+  libspectrum_tape_free( tape );
+  libspectrum_free( gzip );
+
+  return r;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_90( void )
+{
+#ifdef HAVE_ZLIB_H
+  size_t length = 300000, zlib_length, out_length, i;
+  libspectrum_byte *data, *zlib = NULL, *out = NULL;
+  test_return_t r = TEST_FAIL;
+
+  data = libspectrum_new( libspectrum_byte, length );
+  for( i = 0; i < length; i++ ) data[i] = ( i * 7 + ( i >> 10 ) ) & 0xff;
+
+  if( libspectrum_zlib_compress( data, length, &zlib, &zlib_length ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  /* Unknown length, so the output has to grow */
+  out_length = 0;
+  if( libspectrum_zlib_inflate( zlib, zlib_length, &out, &out_length ) ||
+      out_length != length || memcmp( out, data, length ) ) {
+    fprintf( stderr, "%s: zlib inflate of unknown length failed\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* Into a buffer of exactly the right size, and one too small */
+  memset( out, 0, length );
+  if( libspectrum_zlib_inflate_to_buffer( zlib, zlib_length, out,
+                                          &out_length ) ||
+      out_length != length || memcmp( out, data, length ) ) {
+    fprintf( stderr, "%s: zlib inflate to buffer failed\n", progname );
+    goto cleanup;
+  }
+  out_length = length - 1;
+  if( libspectrum_zlib_inflate_to_buffer( zlib, zlib_length, out,
+                                          &out_length ) !=
+      LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: zlib inflate overflowed buffer\n", progname );
+    goto cleanup;
+  }
+
+  /* gzip with the right size in its trailer, then a too small, a
+     possible but too large and an impossibly large one */
+  if( check_gzipped_tap( data, 60000, 60002 ) ||
+      check_gzipped_tap( data, 60000, 10 ) ||
+      check_gzipped_tap( data, 60000, 600000 ) ||
+      check_gzipped_tap( data, 60000, 0xffffffff ) ) {
+    fprintf( stderr, "%s: gzip inflate failed\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_free( out );
+  libspectrum_free( zlib );
+  libspectrum_free( data );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+static test_return_t
+test_91( void )
+{
+#ifdef HAVE_ZLIB_H
+  size_t length = 100000, gzip_length, gzip2_length, i;
+  libspectrum_byte *data, *gzip = NULL, *gzip2 = NULL;
+  libspectrum_dword seed = 1;
+  libspectrum_id_t type;
+  test_return_t r = TEST_FAIL;
+
+  /* A .tzx file with plenty of incompressible data after its header */
+  data = libspectrum_new( libspectrum_byte, length );
+  for( i = 0; i < length; i++ ) {
+    seed = seed * 1103515245 + 12345; data[i] = seed >> 16;
+  }
+  memcpy( data, "ZXTape!\x1a\x01\x14", 10 );
+
+  gzip = make_gzip( data, length, length, &gzip_length );
+  if( !gzip ) { r = TEST_INCOMPLETE; goto cleanup; }
+
+  gzip2 = make_gzip( gzip, gzip_length, gzip_length, &gzip2_length );
+  if( !gzip2 ) { r = TEST_INCOMPLETE; goto cleanup; }
+
+  if( libspectrum_identify_file( &type, NULL, gzip, gzip_length ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ) {
+    fprintf( stderr, "%s: gzipped file not identified\n", progname );
+    goto cleanup;
+  }
+
+  /* Only the start of the file should be needed */
+  if( libspectrum_identify_file( &type, NULL, gzip, gzip_length / 4 ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ) {
+    fprintf( stderr, "%s: truncated gzipped file not identified\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* Including when it's been compressed twice */
+  if( libspectrum_identify_file( &type, NULL, gzip2, gzip2_length ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ) {
+    fprintf( stderr, "%s: doubly gzipped file not identified\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_free( gzip2 );
+  libspectrum_free( gzip );
+  libspectrum_free( data );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+#ifdef HAVE_ZLIB_H
+/* A file to be put into a zip archive */
+typedef struct zip_test_file {
+  const char *name;
+  const libspectrum_byte *data;
+  size_t length;
+  int deflate;
+  int dos;		/* Made on DOS rather than Unix */
+} zip_test_file;
+
+static libspectrum_byte*
+put_word( libspectrum_byte *ptr, libspectrum_word w )
+{
+  *ptr++ = w & 0xff; *ptr++ = w >> 8;
+  return ptr;
+}
+
+static libspectrum_byte*
+put_dword( libspectrum_byte *ptr, libspectrum_dword d )
+{
+  ptr = put_word( ptr, d & 0xffff );
+  return put_word( ptr, d >> 16 );
+}
+
+/* Write a zip file header: the local header if `local' is set, or the
+   central directory header otherwise */
+static libspectrum_byte*
+put_zip_header( libspectrum_byte *ptr, const zip_test_file *file, int local,
+                size_t compressed_length, size_t offset )
+{
+  libspectrum_dword crc = crc32( 0, file->data, file->length );
+  size_t name_length = strlen( file->name );
+
+  ptr = put_dword( ptr, local ? 0x04034b50 : 0x02014b50 );
+  if( !local ) ptr = put_word( ptr, file->dos ? 0x0014 : 0x0314 );
+  ptr = put_word( ptr, 20 );
+  ptr = put_word( ptr, 0 );
+  ptr = put_word( ptr, file->deflate ? 8 : 0 );
+  ptr = put_dword( ptr, 0 );			/* Time and date */
+  ptr = put_dword( ptr, crc );
+  ptr = put_dword( ptr, compressed_length );
+  ptr = put_dword( ptr, file->length );
+  ptr = put_word( ptr, name_length );
+  ptr = put_word( ptr, 0 );
+  if( !local ) {
+    ptr = put_dword( ptr, 0 );			/* Comment, disk number */
+    ptr = put_word( ptr, 0 );
+    ptr = put_dword( ptr, 0 );
+    ptr = put_dword( ptr, offset );
+  }
+  memcpy( ptr, file->name, name_length );
+
+  return ptr + name_length;
+}
+
+/* Make a zip archive containing `count' files */
+static libspectrum_byte*
+make_zip( const zip_test_file *files, size_t count, size_t *zip_length )
+{
+  libspectrum_byte *zip, *ptr, **data, *directory;
+  size_t *data_length, *offset, i, capacity, directory_length;
+
+  data = libspectrum_new0( libspectrum_byte*, count );
+  data_length = libspectrum_new( size_t, count );
+  offset = libspectrum_new( size_t, count );
+
+  /* Compress the files, stripping the zlib header and checksum */
+  capacity = 22;
+  for( i = 0; i < count; i++ ) {
+    if( files[i].deflate ) {
+      if( libspectrum_zlib_compress( files[i].data, files[i].length,
+                                     &data[i], &data_length[i] ) ) {
+        zip = NULL; goto cleanup;
+      }
+      memmove( data[i], data[i] + 2, data_length[i] - 6 );
+      data_length[i] -= 6;
+    } else {
+      data_length[i] = files[i].length;
+    }
+    capacity += 30 + 46 + 2 * strlen( files[i].name ) + data_length[i];
+  }
+
+  zip = ptr = libspectrum_new( libspectrum_byte, capacity );
+
+  for( i = 0; i < count; i++ ) {
+    offset[i] = ptr - zip;
+    ptr = put_zip_header( ptr, &files[i], 1, data_length[i], 0 );
+    memcpy( ptr, files[i].deflate ? data[i] : files[i].data,
+            data_length[i] );
+    ptr += data_length[i];
+  }
+
+  directory = ptr;
+  for( i = 0; i < count; i++ )
+    ptr = put_zip_header( ptr, &files[i], 0, data_length[i], offset[i] );
+
+  directory_length = ptr - directory;
+
+  ptr = put_dword( ptr, 0x06054b50 );
+  ptr = put_dword( ptr, 0 );			/* Disk numbers */
+  ptr = put_word( ptr, count );
+  ptr = put_word( ptr, count );
+  ptr = put_dword( ptr, directory_length );
+  ptr = put_dword( ptr, directory - zip );
+  ptr = put_word( ptr, 0 );
+
+  *zip_length = ptr - zip;
+
+cleanup:
+  for( i = 0; i < count; i++ ) libspectrum_free( data[i] );
+  libspectrum_free( data );
+  libspectrum_free( data_length );
+  libspectrum_free( offset );
+
+  return zip;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_92( void )
+{
+#ifdef HAVE_ZLIB_H
+  static const libspectrum_byte szx[] = "ZXST\x01\x04\x05\x00";
+  static const libspectrum_byte text[] = "Load with LOAD \"\"";
+  libspectrum_byte tzx[20000], *zip = NULL;
+  zip_test_file files[5];
+  libspectrum_zip_catalogue_entry *entries = NULL;
+  size_t zip_length = 0, count = 0, i;
+  libspectrum_id_t type;
+  test_return_t r = TEST_FAIL;
+
+  for( i = 0; i < sizeof( tzx ); i++ ) tzx[i] = ( i * 13 + ( i >> 7 ) ) & 0xff;
+  memcpy( tzx, "ZXTape!\x1a\x01\x14", 10 );
+
+  memset( files, 0, sizeof( files ) );
+  files[0].name = "games/";
+  files[0].data = text; files[0].length = 0; files[0].deflate = 0;
+  files[1].name = "games/Manic.TZX";
+  files[1].data = tzx; files[1].length = sizeof( tzx ); files[1].deflate = 1;
+  files[2].name = "snap.bin";
+  files[2].data = szx; files[2].length = 8; files[2].deflate = 0;
+  files[3].name = "readme.txt";
+  files[3].data = text; files[3].length = strlen( (const char*)text );
+  files[3].deflate = 1;
+  files[4].name = "empty.tap";
+  files[4].data = text; files[4].length = 0; files[4].deflate = 0;
+
+  zip = make_zip( files, 5, &zip_length );
+  if( !zip ) return TEST_INCOMPLETE;
+
+  if( libspectrum_zip_catalogue( zip, zip_length, &entries, &count ) ||
+      count != 5 ) {
+    fprintf( stderr, "%s: couldn't catalogue zip file\n", progname );
+    goto cleanup;
+  }
+
+  for( i = 0; i < count; i++ ) {
+    if( strcmp( entries[i].name, files[i].name ) ||
+        entries[i].uncompressed_size != files[i].length ||
+        entries[i].crc != crc32( 0, files[i].data, files[i].length ) ) {
+      fprintf( stderr, "%s: wrong details for zip entry %lu\n", progname,
+               (unsigned long)i );
+      goto cleanup;
+    }
+  }
+
+  if( !entries[0].is_dir ||
+      entries[0].type != LIBSPECTRUM_ID_UNKNOWN ||
+      entries[1].type != LIBSPECTRUM_ID_TAPE_TZX ||
+      entries[1].file_class != LIBSPECTRUM_CLASS_TAPE ||
+      entries[1].compressed_size >= sizeof( tzx ) ||
+      entries[2].type != LIBSPECTRUM_ID_SNAPSHOT_SZX ||
+      entries[2].file_class != LIBSPECTRUM_CLASS_SNAPSHOT ||
+      entries[3].type != LIBSPECTRUM_ID_UNKNOWN ||
+      entries[4].type != LIBSPECTRUM_ID_TAPE_TAP ) {
+    fprintf( stderr, "%s: zip entries wrongly identified\n", progname );
+    goto cleanup;
+  }
+
+  /* And the archive as a whole is the first thing in it which can be
+     loaded */
+  if( libspectrum_identify_file( &type, "test.zip", zip, zip_length ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ) {
+    fprintf( stderr, "%s: zip file wrongly identified\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_zip_catalogue_free( entries, count );
+  libspectrum_free( zip );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* zip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+#ifdef HAVE_ZLIB_H
+static int
+read_gzipped_tap( const libspectrum_byte *gzip, size_t gzip_length,
+                  const char *filename )
+{
+  libspectrum_tape *tape;
+  libspectrum_error error;
+
+  tape = libspectrum_tape_alloc();
+  error = libspectrum_tape_read( tape, gzip, gzip_length,
+                                 LIBSPECTRUM_ID_UNKNOWN, filename );
+  libspectrum_tape_free( tape );
+
+  return error;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_93( void )
+{
+#ifdef HAVE_ZLIB_H
+  size_t length = 60000, gzip_length, gzip2_length, zlib_length, out_length,
+    max_bytes, total, i;
+  libspectrum_byte *data, *gzip = NULL, *gzip2 = NULL, *zlib = NULL,
+    *out = NULL;
+  libspectrum_id_t type;
+  int max_depth;
+  test_return_t r = TEST_FAIL;
+
+  data = libspectrum_new( libspectrum_byte, length );
+  for( i = 0; i < length; i++ ) data[i] = ( i >> 8 ) & 0xff;
+
+  gzip = make_gzipped_tap( data, length, length + 2, &gzip_length );
+  if( !gzip ) { r = TEST_INCOMPLETE; goto cleanup; }
+
+  gzip2 = make_gzip( gzip, gzip_length, gzip_length, &gzip2_length );
+  if( !gzip2 ) { r = TEST_INCOMPLETE; goto cleanup; }
+
+  if( libspectrum_zlib_compress( data, length, &zlib, &zlib_length ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  /* Everything decompressed from the doubly gzipped file */
+  total = gzip_length + length + 2;
+
+  libspectrum_set_decompression_limits( 1000, 0 );
+  if( read_gzipped_tap( gzip, gzip_length, "test.tap.gz" ) !=
+      LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: byte limit not enforced\n", progname );
+    goto cleanup;
+  }
+
+  out_length = 0;
+  if( libspectrum_zlib_inflate( zlib, zlib_length, &out, &out_length ) !=
+      LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: byte limit not enforced on raw data\n",
+             progname );
+    libspectrum_free( out );
+    goto cleanup;
+  }
+
+  /* Every layer counts towards the limit */
+  libspectrum_set_decompression_limits( total, 0 );
+  if( read_gzipped_tap( gzip2, gzip2_length, "test.tap.gz.gz" ) ) {
+    fprintf( stderr, "%s: file within byte limit not read\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_set_decompression_limits( total - 1, 0 );
+  if( read_gzipped_tap( gzip2, gzip2_length, "test.tap.gz.gz" ) !=
+      LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: byte limit not enforced across layers\n",
+             progname );
+    goto cleanup;
+  }
+
+  libspectrum_set_decompression_limits( 0, 1 );
+  if( read_gzipped_tap( gzip, gzip_length, "test.tap.gz" ) ) {
+    fprintf( stderr, "%s: file within depth limit not read\n", progname );
+    goto cleanup;
+  }
+
+  if( libspectrum_identify_file( &type, NULL, gzip2, gzip2_length ) !=
+      LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: depth limit not enforced\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_get_decompression_limits( &max_bytes, &max_depth );
+  if( max_bytes != 0 || max_depth != 1 ) {
+    fprintf( stderr, "%s: wrong limits returned\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_set_decompression_limits( 0, 0 );
+  libspectrum_free( zlib );
+  libspectrum_free( gzip2 );
+  libspectrum_free( gzip );
+  libspectrum_free( data );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+static test_return_t
+test_94( void )
+{
+#ifdef HAVE_ZLIB_H
+  const char *filename = STATIC_TEST_PATH( "plus3.z80" );
+  libspectrum_byte *buffer = NULL, *page;
+  size_t filesize = 0, length = 0, i;
+  libspectrum_snap *snap, *snap2 = NULL;
+  libspectrum_dword seed = 1;
+  int flags, n;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( read_file( &buffer, &filesize, filename ) ) return TEST_INCOMPLETE;
+
+  snap = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     filename ) ) {
+    fprintf( stderr, "%s: reading `%s' failed\n", progname, filename );
+    goto cleanup;
+  }
+
+  libspectrum_free( buffer );
+  buffer = NULL;
+
+  /* One uniform page other than zeros, and one which won't compress */
+  page = libspectrum_new( libspectrum_byte, 0x4000 );
+  memset( page, 0xff, 0x4000 );
+  libspectrum_free( libspectrum_snap_pages( snap, 1 ) );
+  libspectrum_snap_set_pages( snap, 1, page );
+
+  page = libspectrum_new( libspectrum_byte, 0x4000 );
+  for( i = 0; i < 0x4000; i++ ) {
+    seed = seed * 1103515245 + 12345; page[i] = seed >> 16;
+  }
+  libspectrum_free( libspectrum_snap_pages( snap, 3 ) );
+  libspectrum_snap_set_pages( snap, 3, page );
+
+  if( libspectrum_snap_write( &buffer, &length, &flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL,
+                              LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ) ) {
+    fprintf( stderr, "%s: serialising to SZX failed\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_FAIL;
+
+  snap2 = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap2, buffer, length,
+                             LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL ) ) {
+    fprintf( stderr, "%s: restoring from SZX failed\n", progname );
+    goto cleanup;
+  }
+
+  for( n = 0; n < 8; n++ ) {
+    if( !libspectrum_snap_pages( snap, n ) &&
+        !libspectrum_snap_pages( snap2, n ) ) continue;
+
+    if( !libspectrum_snap_pages( snap, n ) ||
+        !libspectrum_snap_pages( snap2, n ) ||
+        memcmp( libspectrum_snap_pages( snap, n ),
+                libspectrum_snap_pages( snap2, n ), 0x4000 ) ) {
+      fprintf( stderr, "%s: page %d changed\n", progname, n );
+      goto cleanup;
+    }
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  libspectrum_snap_free( snap );
+  libspectrum_free( buffer );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+#ifdef HAVE_ZLIB_H
+/* Does `gzip' decompress to exactly `expected'? */
+static int
+check_gunzip( const libspectrum_byte *gzip, size_t gzip_length,
+              const libspectrum_byte *expected, size_t expected_length )
+{
+  z_stream stream;
+  libspectrum_byte *out;
+  int error, r;
+
+  if( gzip_length < 2 || gzip[0] != 0x1f || gzip[1] != 0x8b ) return 1;
+
+  memset( &stream, 0, sizeof( stream ) );
+  if( inflateInit2( &stream, 15 + 16 ) != Z_OK ) return 1;
+
+  out = libspectrum_new( libspectrum_byte, expected_length + 1 );
+
+  stream.next_in = (Bytef*)gzip; stream.avail_in = gzip_length;
+  stream.next_out = out; stream.avail_out = expected_length + 1;
+
+  error = inflate( &stream, Z_FINISH );
+  r = error != Z_STREAM_END || stream.total_out != expected_length ||
+      memcmp( out, expected, expected_length );
+
+  inflateEnd( &stream );
+  libspectrum_free( out );
+
+  return r;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_95( void )
+{
+#ifdef HAVE_ZLIB_H
+  const char *filename = STATIC_TEST_PATH( "plus3.z80" );
+  libspectrum_byte *buffer = NULL, *gzip = NULL;
+  size_t length = 0, gzip_length = 0, filesize = 0;
+  libspectrum_tape *tape, *tape2;
+  libspectrum_snap *snap = NULL, *snap2 = NULL;
+  libspectrum_rzx *rzx, *rzx2 = NULL;
+  libspectrum_byte in_bytes[] = { 0xbf, 0xff, 0x1f };
+#ifdef HAVE_GCRYPT_H
+  libspectrum_rzx_dsa_key public_key = test_key;
+#endif				/* #ifdef HAVE_GCRYPT_H */
+  int flags, fast, i;
+  test_return_t r = TEST_INCOMPLETE;
+
+  if( load_tape( &tape, DYNAMIC_TEST_PATH( "complete-tzx.tzx" ),
+                 LIBSPECTRUM_ERROR_NONE ) != TEST_PASS )
+    return TEST_INCOMPLETE;
+
+  tape2 = libspectrum_tape_alloc();
+  rzx = libspectrum_rzx_alloc();
+
+  if( libspectrum_tape_write( &buffer, &length, tape,
+                              LIBSPECTRUM_ID_TAPE_TZX ) ) goto cleanup;
+
+  r = TEST_FAIL;
+
+  if( libspectrum_tape_write_gzip( &gzip, &gzip_length, tape,
+                                   LIBSPECTRUM_ID_TAPE_TZX ) ) {
+    fprintf( stderr, "%s: writing gzipped tape failed\n", progname );
+    goto cleanup;
+  }
+
+  if( check_gunzip( gzip, gzip_length, buffer, length ) ) {
+    fprintf( stderr, "%s: gzipped tape changed\n", progname );
+    goto cleanup;
+  }
+
+  if( libspectrum_tape_read( tape2, gzip, gzip_length, LIBSPECTRUM_ID_UNKNOWN,
+                             "test.tzx.gz" ) ) {
+    fprintf( stderr, "%s: reading gzipped tape failed\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_free( buffer ); buffer = NULL; length = 0;
+  libspectrum_free( gzip ); gzip = NULL; gzip_length = 0;
+
+  /* And the same for a snapshot */
+  r = TEST_INCOMPLETE;
+
+  if( read_file( &buffer, &filesize, filename ) ) goto cleanup;
+
+  snap = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+                             filename ) ) goto cleanup;
+
+  libspectrum_free( buffer ); buffer = NULL;
+
+  if( libspectrum_snap_write( &buffer, &length, &flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) )
+    goto cleanup;
+
+  r = TEST_FAIL;
+
+  if( libspectrum_snap_write_gzip( &gzip, &gzip_length, &flags, snap,
+                                   LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 0 ) ) {
+    fprintf( stderr, "%s: writing gzipped snapshot failed\n", progname );
+    goto cleanup;
+  }
+
+  if( check_gunzip( gzip, gzip_length, buffer, length ) ) {
+    fprintf( stderr, "%s: gzipped snapshot changed\n", progname );
+    goto cleanup;
+  }
+
+  snap2 = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap2, gzip, gzip_length, LIBSPECTRUM_ID_UNKNOWN,
+                             "test.szx.gz" ) ) {
+    fprintf( stderr, "%s: reading gzipped snapshot failed\n", progname );
+    goto cleanup;
+  }
+
+  /* The gzip header says how hard the compressor tried */
+  if( gzip[8] != 2 ) {
+    fprintf( stderr, "%s: gzipped snapshot not best compression\n",
+             progname );
+    goto cleanup;
+  }
+
+  libspectrum_free( buffer ); buffer = NULL; length = 0;
+  libspectrum_free( gzip ); gzip = NULL; gzip_length = 0;
+
+  /* Fast compression applies to the gzip layer as well */
+  fast = LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION;
+  if( libspectrum_snap_write( &buffer, &length, &flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, fast ) ||
+      libspectrum_snap_write_gzip( &gzip, &gzip_length, &flags, snap,
+                                   LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, fast ) ||
+      check_gunzip( gzip, gzip_length, buffer, length ) || gzip[8] != 4 ) {
+    fprintf( stderr, "%s: fast gzipped snapshot wrong\n", progname );
+    goto cleanup;
+  }
+
+  libspectrum_free( buffer ); buffer = NULL; length = 0;
+  libspectrum_free( gzip ); gzip = NULL; gzip_length = 0;
+
+  /* And for an input recording, which is signed as it is streamed */
+  libspectrum_rzx_start_input( rzx, 0 );
+  for( i = 0; i < 1000; i++ )
+    libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( in_bytes ), in_bytes );
+  libspectrum_rzx_stop_input( rzx );
+
+  if( libspectrum_rzx_write( &buffer, &length, rzx, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL, 1, NULL ) ||
+      libspectrum_rzx_write_gzip( &gzip, &gzip_length, rzx,
+                                  LIBSPECTRUM_ID_UNKNOWN, NULL, 1, NULL ) ||
+      check_gunzip( gzip, gzip_length, buffer, length ) ) {
+    fprintf( stderr, "%s: gzipped recording changed\n", progname );
+    goto cleanup;
+  }
+
+#ifdef HAVE_GCRYPT_H
+  libspectrum_free( gzip ); gzip = NULL; gzip_length = 0;
+
+  public_key.x = NULL;
+
+  /* The signature only refers to the decompressed data while it's being
+     read, so must be checked with libspectrum_rzx_verify_signature() */
+  rzx2 = libspectrum_rzx_alloc();
+  if( libspectrum_rzx_write_gzip( &gzip, &gzip_length, rzx,
+                                  LIBSPECTRUM_ID_UNKNOWN, NULL, 1,
+                                  &test_key ) ||
+      libspectrum_rzx_read( rzx2, gzip, gzip_length ) ||
+      libspectrum_rzx_verify_signature( rzx2, &public_key ) ) {
+    fprintf( stderr, "%s: gzipped recording not verified\n", progname );
+    goto cleanup;
+  }
+#endif				/* #ifdef HAVE_GCRYPT_H */
+
+  r = TEST_PASS;
+
+cleanup:
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  if( snap ) libspectrum_snap_free( snap );
+  if( rzx2 ) libspectrum_rzx_free( rzx2 );
+  libspectrum_rzx_free( rzx );
+  libspectrum_tape_free( tape2 );
+  libspectrum_tape_free( tape );
+  libspectrum_free( gzip );
+  libspectrum_free( buffer );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+#ifdef HAVE_ZLIB_H
+/* Check that `zip' has just located the entry `info' from `files' */
+static int
+check_located( libspectrum_zip *zip, const libspectrum_zip_stat *info,
+               const zip_test_file *files )
+{
+  const zip_test_file *file = &files[ info->index ];
+  libspectrum_byte *data = NULL;
+  size_t length;
+  int r;
+
+  if( strcmp( info->name, file->name ) || info->size != file->length )
+    return 1;
+
+  if( libspectrum_zip_read( zip, &data, &length ) ) return 1;
+  r = length != file->length || memcmp( data, file->data, length );
+  libspectrum_free( data );
+
+  return r;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_96( void )
+{
+#ifdef HAVE_ZLIB_H
+  static const char *names[] = {
+    "manic.tzx", "Manic.TZX", "MANIC.TZX", "games/Manic.TZX",
+    "GAMES/MANIC.TZX", "jsw.tap", "gAmEs/jsw.tap", "readme.txt",
+    "README.TXT", "docs/README.txt", "missing.tap", "games/", "", NULL
+  };
+  static const int flags[] = {
+    0, LIBSPECTRUM_ZIP_NODIR, LIBSPECTRUM_ZIP_NOCASE,
+    LIBSPECTRUM_ZIP_AUTOCASE, LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_NOCASE,
+    LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_AUTOCASE, -1
+  };
+  static const libspectrum_byte text[] =
+    "The quick brown fox jumps over the lazy dog";
+  zip_test_file files[7];
+  libspectrum_zip *linear = NULL, *indexed = NULL;
+  libspectrum_zip_stat linear_info, indexed_info;
+  libspectrum_byte *zip = NULL;
+  size_t zip_length = 0, i, j;
+  int linear_index, indexed_index, linear_next, indexed_next;
+  test_return_t r = TEST_FAIL;
+
+  memset( files, 0, sizeof( files ) );
+  for( i = 0; i < 7; i++ ) {
+    files[i].data = &text[ i * 3 ];
+    files[i].length = sizeof( text ) - 1 - i * 3;
+    files[i].deflate = i & 1;
+  }
+  files[0].name = "games/"; files[0].length = 0;
+  files[1].name = "games/Manic.TZX";
+  files[2].name = "GAMES/JSW.TAP"; files[2].dos = 1;
+  files[3].name = "manic.tzx";
+  files[4].name = "Readme.TXT"; files[4].dos = 1;
+  files[5].name = "docs/readme.txt";
+  files[6].name = "games/Manic.TZX";
+
+  zip = make_zip( files, 7, &zip_length );
+  if( !zip ) return TEST_INCOMPLETE;
+
+  linear = libspectrum_zip_open( zip, zip_length, 0 );
+  indexed = libspectrum_zip_open( zip, zip_length, LIBSPECTRUM_ZIP_INDEX );
+  if( !linear || !indexed ||
+      libspectrum_zip_num_entries( indexed ) != 7 ) {
+    fprintf( stderr, "%s: couldn't open zip file\n", progname );
+    goto cleanup;
+  }
+
+  /* The index must find exactly what a search through the directory
+     would, and leave the archive in the same place */
+  for( i = 0; names[i]; i++ ) {
+    for( j = 0; flags[j] != -1; j++ ) {
+
+      linear_index = libspectrum_zip_locate( linear, names[i], flags[j],
+                                             &linear_info );
+      indexed_index = libspectrum_zip_locate( indexed, names[i], flags[j],
+                                              &indexed_info );
+
+      if( linear_index != indexed_index ) {
+        fprintf( stderr, "%s: located '%s' with flags %d at %d, not %d\n",
+                 progname, names[i], flags[j], indexed_index,
+                 linear_index );
+        goto cleanup;
+      }
+
+      if( linear_index == -1 ) continue;
+
+      if( indexed_info.index != linear_index ||
+          check_located( linear, &linear_info, files ) ||
+          check_located( indexed, &indexed_info, files ) ) {
+        fprintf( stderr, "%s: wrong file located for '%s' with flags %d\n",
+                 progname, names[i], flags[j] );
+        goto cleanup;
+      }
+
+      linear_next = libspectrum_zip_next( linear, &linear_info );
+      indexed_next = libspectrum_zip_next( indexed, &indexed_info );
+      if( linear_next != indexed_next ||
+          ( !linear_next && ( linear_info.index != indexed_info.index ||
+                              strcmp( linear_info.name,
+                                      indexed_info.name ) ) ) ) {
+        fprintf( stderr, "%s: wrong next entry after locating '%s' with "
+                 "flags %d\n", progname, names[i], flags[j] );
+        goto cleanup;
+      }
+    }
+  }
+
+  /* The first of several matches is found, and directories never are */
+  if( libspectrum_zip_locate( indexed, "games/Manic.TZX", 0,
+                              &indexed_info ) != 1 ||
+      libspectrum_zip_locate( indexed, "MANIC.TZX",
+                              LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_NOCASE,
+                              &indexed_info ) != 1 ||
+      libspectrum_zip_locate( indexed, "games/", 0, &indexed_info ) != -1 ) {
+    fprintf( stderr, "%s: wrong zip entry located\n", progname );
+    goto cleanup;
+  }
+
+  /* AUTOCASE is decided by each entry, not by whichever entry was current
+     when the search started */
+  if( libspectrum_zip_locate( linear, "jsw.tap",
+                              LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_AUTOCASE,
+                              &linear_info ) != 2 ||
+      libspectrum_zip_locate( linear, "MANIC.TZX",
+                              LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_AUTOCASE,
+                              &linear_info ) != -1 ||
+      libspectrum_zip_locate( linear, "README.TXT",
+                              LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_AUTOCASE,
+                              &linear_info ) != 4 ||
+      libspectrum_zip_locate( linear, "Manic.tzx",
+                              LIBSPECTRUM_ZIP_NODIR | LIBSPECTRUM_ZIP_AUTOCASE,
+                              &linear_info ) != -1 ) {
+    fprintf( stderr, "%s: AUTOCASE not applied per entry\n", progname );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_zip_close( indexed );
+  libspectrum_zip_close( linear );
+  libspectrum_free( zip );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* zip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+#ifdef HAVE_ZLIB_H
+/* What libspectrum_zip_extract_all() has passed to extract_callback() */
+typedef struct extract_test {
+  const zip_test_file *files;
+  int seen[16];
+  size_t count;
+  size_t stop_after;
+  int wrong;
+} extract_test;
+
+static libspectrum_error
+extract_callback( const libspectrum_zip_stat *info,
+                  const libspectrum_byte *buffer, size_t length,
+                  void *user_data )
+{
+  extract_test *test = user_data;
+  const zip_test_file *file = &test->files[ info->index ];
+
+  if( test->count >= 16 || strcmp( info->name, file->name ) ||
+      length != file->length || memcmp( buffer, file->data, length ) )
+    test->wrong = 1;
+  else
+    test->seen[ test->count ] = info->index;
+
+  test->count++;
+
+  return test->count == test->stop_after ? LIBSPECTRUM_ERROR_INVALID :
+                                           LIBSPECTRUM_ERROR_NONE;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_97( void )
+{
+#ifdef HAVE_ZLIB_H
+  static const int expected[] = { 1, 2, 4, 5, 6, 7, 8, 9, 10, 11 };
+  static const int threads[] = { 1, 4 };
+  static char names[12][16];
+  libspectrum_byte data[12][3000], *zip = NULL;
+  zip_test_file files[12];
+  libspectrum_zip *archive = NULL;
+  extract_test test;
+  size_t zip_length = 0, i, j;
+  libspectrum_error error;
+  test_return_t r = TEST_FAIL;
+
+  memset( files, 0, sizeof( files ) );
+  for( i = 0; i < 12; i++ ) {
+    for( j = 0; j < sizeof( data[i] ); j++ )
+      data[i][j] = ( j * ( i + 3 ) + ( j >> 5 ) ) & 0xff;
+    sprintf( names[i], "dir/file%02lu.bin", (unsigned long)i );
+    files[i].name = names[i];
+    files[i].data = data[i];
+    files[i].length = 1000 + i * 150;
+    files[i].deflate = i % 3 != 2;
+  }
+  files[0].name = "dir/"; files[0].length = 0;
+  files[3].length = 0;
+
+  zip = make_zip( files, 12, &zip_length );
+  if( !zip ) return TEST_INCOMPLETE;
+
+  archive = libspectrum_zip_open( zip, zip_length, 0 );
+  if( !archive ) {
+    fprintf( stderr, "%s: couldn't open zip file\n", progname );
+    goto cleanup;
+  }
+
+  for( i = 0; i < 2; i++ ) {
+
+    /* Every file, in order, whether extracted on one thread or several */
+    memset( &test, 0, sizeof( test ) );
+    test.files = files;
+    error = libspectrum_zip_extract_all( archive, extract_callback, &test,
+                                         threads[i] );
+    if( error || test.wrong || test.count != 10 ||
+        memcmp( test.seen, expected, sizeof( expected ) ) ) {
+      fprintf( stderr, "%s: wrong files extracted with %d threads\n",
+               progname, threads[i] );
+      goto cleanup;
+    }
+
+    /* And nothing more once the callback returns an error */
+    memset( &test, 0, sizeof( test ) );
+    test.files = files;
+    test.stop_after = 3;
+    error = libspectrum_zip_extract_all( archive, extract_callback, &test,
+                                         threads[i] );
+    if( error != LIBSPECTRUM_ERROR_INVALID || test.wrong ||
+        test.count != 3 || memcmp( test.seen, expected, 3 * sizeof( int ) ) ) {
+      fprintf( stderr, "%s: extraction with %d threads didn't stop\n",
+               progname, threads[i] );
+      goto cleanup;
+    }
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_zip_close( archive );
+  libspectrum_free( zip );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* zip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+static test_return_t
+test_98( void )
+{
+#ifdef HAVE_LIBBZ2
+  const size_t length = 350000, data_length = length - 21;
+  libspectrum_byte *tzx, *bz = NULL;
+  unsigned int bz_length;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator iterator;
+  libspectrum_id_t type;
+  size_t i;
+  test_return_t r = TEST_FAIL;
+
+  /* A tape with one large pure data block. This is very compressible, so
+     the output buffer has to grow several times, and it's compressed in
+     100K blocks so the start can be read from truncated data */
+  tzx = libspectrum_new( libspectrum_byte, length );
+  for( i = 0; i < length; i++ ) tzx[i] = ( i / 1000 + ( i & 7 ) ) & 0xff;
+  memcpy( tzx, "ZXTape!\x1a\x01\x14\x14\x57\x03\xae\x06\x08\x00\x00", 18 );
+  tzx[18] = data_length & 0xff;
+  tzx[19] = ( data_length >> 8 ) & 0xff;
+  tzx[20] = data_length >> 16;
+
+  bz_length = length;
+  bz = libspectrum_new( libspectrum_byte, bz_length );
+  tape = libspectrum_tape_alloc();
+  if( BZ2_bzBuffToBuffCompress( (char*)bz, &bz_length, (char*)tzx, length,
+                                1, 0, 0 ) != BZ_OK ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  /* Everything, without knowing how long it is */
+  if( libspectrum_tape_read( tape, bz, bz_length, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL ) ) {
+    fprintf( stderr, "%s: couldn't read bzipped tape\n", progname );
+    goto cleanup;
+  }
+  block = libspectrum_tape_iterator_init( &iterator, tape );
+  if( !block ||
+      libspectrum_tape_block_data_length( block ) != data_length ||
+      memcmp( libspectrum_tape_block_data( block ), &tzx[21],
+              data_length ) ) {
+    fprintf( stderr, "%s: bzipped tape wrongly decompressed\n", progname );
+    goto cleanup;
+  }
+  libspectrum_tape_clear( tape );
+
+  /* Truncated data is an error when everything is wanted */
+  if( libspectrum_tape_read( tape, bz, bz_length * 2 / 3,
+                             LIBSPECTRUM_ID_UNKNOWN, NULL ) !=
+      LIBSPECTRUM_ERROR_CORRUPT ) {
+    fprintf( stderr, "%s: truncated bzip2 data not detected\n", progname );
+    goto cleanup;
+  }
+  libspectrum_tape_clear( tape );
+
+  /* As is going past the decompression limit */
+  libspectrum_set_decompression_limits( length - 1, 0 );
+  if( libspectrum_tape_read( tape, bz, bz_length, LIBSPECTRUM_ID_UNKNOWN,
+                             NULL ) != LIBSPECTRUM_ERROR_LIMIT ) {
+    libspectrum_set_decompression_limits( 0, 0 );
+    fprintf( stderr, "%s: bzip2 decompression limit not applied\n",
+             progname );
+    goto cleanup;
+  }
+  libspectrum_tape_clear( tape );
+
+  /* But identifying the file needs only the start of it, which is there
+     even in truncated data and isn't enough to reach the limit */
+  if( libspectrum_identify_file( &type, NULL, bz, bz_length ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ||
+      libspectrum_identify_file( &type, NULL, bz, bz_length * 2 / 3 ) ||
+      type != LIBSPECTRUM_ID_TAPE_TZX ) {
+    libspectrum_set_decompression_limits( 0, 0 );
+    fprintf( stderr, "%s: bzip2 file wrongly identified\n", progname );
+    goto cleanup;
+  }
+  libspectrum_set_decompression_limits( 0, 0 );
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_tape_free( tape );
+  libspectrum_free( bz );
+  libspectrum_free( tzx );
+
+  return r;
+#else				/* #ifdef HAVE_LIBBZ2 */
+  return TEST_SKIPPED; /* bzip2 not enabled in build */
+#endif				/* #ifdef HAVE_LIBBZ2 */
+}
+
+#ifdef HAVE_ZLIB_H
+/* Read `length' bytes of `buffer' as an input recording */
+static libspectrum_error
+read_recording( const libspectrum_byte *buffer, size_t length )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_error error = libspectrum_rzx_read( rzx, buffer, length );
+
+  libspectrum_rzx_free( rzx );
+
+  return error;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_99( void )
+{
+#ifdef HAVE_ZLIB_H
+  static const int threads[] = { 1, 4 };
+  static char names[4][16];
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_byte *plain = NULL, *compressed = NULL, *gzip = NULL;
+  libspectrum_byte in_bytes[8], *big = NULL, *zip = NULL;
+  zip_test_file files[4];
+  libspectrum_zip *archive = NULL;
+  extract_test test;
+  size_t plain_length = 0, compressed_length = 0, gzip_length = 0;
+  size_t zip_length = 0, max_bytes, i, j;
+  libspectrum_dword seed = 1;
+  int max_depth;
+  test_return_t r = TEST_INCOMPLETE;
+
+  /* An input recording which doesn't compress well, so the compressed
+     input block is nearly as large as the data it holds */
+  libspectrum_rzx_start_input( rzx, 0 );
+  for( i = 0; i < 1000; i++ ) {
+    for( j = 0; j < ARRAY_SIZE( in_bytes ); j++ ) {
+      seed = seed * 1103515245 + 12345;
+      in_bytes[j] = ( seed >> 16 ) & 0xff;
+    }
+    libspectrum_rzx_store_frame( rzx, i, ARRAY_SIZE( in_bytes ), in_bytes );
+  }
+  libspectrum_rzx_stop_input( rzx );
+
+  if( libspectrum_rzx_write( &plain, &plain_length, rzx,
+                             LIBSPECTRUM_ID_UNKNOWN, NULL, 0, NULL ) ||
+      libspectrum_rzx_write( &compressed, &compressed_length, rzx,
+                             LIBSPECTRUM_ID_UNKNOWN, NULL, 1, NULL ) ||
+      libspectrum_rzx_write_gzip( &gzip, &gzip_length, rzx,
+                                  LIBSPECTRUM_ID_UNKNOWN, NULL, 1, NULL ) )
+    goto cleanup;
+
+  r = TEST_FAIL;
+
+  /* The uncompressed recording is larger than the gzipped file inflates
+     to, and than the input block inside that inflates to, but not both
+     together */
+  libspectrum_set_decompression_limits( plain_length, 0 );
+
+  if( read_recording( compressed, compressed_length ) ) {
+    fprintf( stderr, "%s: compressed input block not read\n", progname );
+    goto cleanup;
+  }
+
+  if( read_recording( gzip, gzip_length ) != LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: input block not counted towards the limit\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* This thread can have its own limits */
+  libspectrum_set_thread_decompression_limits( 0, 0 );
+  libspectrum_get_decompression_limits( &max_bytes, &max_depth );
+  if( max_bytes != 0 || max_depth != 0 ) {
+    fprintf( stderr, "%s: thread decompression limits not returned\n",
+             progname );
+    goto cleanup;
+  }
+
+  if( read_recording( gzip, gzip_length ) ) {
+    fprintf( stderr, "%s: thread decompression limits not applied\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* Until it goes back to the ones for all threads */
+  libspectrum_clear_thread_decompression_limits();
+  libspectrum_get_decompression_limits( &max_bytes, &max_depth );
+  if( max_bytes != plain_length || max_depth != 0 ) {
+    fprintf( stderr, "%s: decompression limits not restored\n", progname );
+    goto cleanup;
+  }
+
+  if( read_recording( gzip, gzip_length ) != LIBSPECTRUM_ERROR_LIMIT ) {
+    fprintf( stderr, "%s: restored decompression limits not applied\n",
+             progname );
+    goto cleanup;
+  }
+
+  /* Files extracted on worker threads get this thread's limits */
+  libspectrum_set_decompression_limits( 0, 0 );
+
+  big = libspectrum_new0( libspectrum_byte, 100000 );
+  memset( files, 0, sizeof( files ) );
+  for( i = 0; i < 4; i++ ) {
+    sprintf( names[i], "file%lu.bin", (unsigned long)i );
+    files[i].name = names[i];
+    files[i].data = big;
+    files[i].length = 100000;
+    files[i].deflate = 1;
+  }
+
+  zip = make_zip( files, 4, &zip_length );
+  archive = zip ? libspectrum_zip_open( zip, zip_length, 0 ) : NULL;
+  if( !archive ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  libspectrum_set_thread_decompression_limits( 1000, 0 );
+
+  for( i = 0; i < ARRAY_SIZE( threads ); i++ ) {
+    memset( &test, 0, sizeof( test ) );
+    test.files = files;
+    if( libspectrum_zip_extract_all( archive, extract_callback, &test,
+                                     threads[i] ) != LIBSPECTRUM_ERROR_LIMIT ||
+        test.count ) {
+      fprintf( stderr, "%s: thread decompression limits not applied with "
+               "%d threads\n", progname, threads[i] );
+      goto cleanup;
+    }
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_clear_thread_decompression_limits();
+  libspectrum_set_decompression_limits( 0, 0 );
+  libspectrum_zip_close( archive );
+  libspectrum_free( zip );
+  libspectrum_free( big );
+  libspectrum_rzx_free( rzx );
+  libspectrum_free( gzip );
+  libspectrum_free( compressed );
+  libspectrum_free( plain );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+/* Read a sector following a read command, checking every byte is `value' */
+static int
+check_ide_fill( libspectrum_ide_channel *chn, libspectrum_byte value )
+{
+  libspectrum_byte b;
+  int i;
+
+  for( i = 0; i < 512; i++ ) {
+    b = libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA );
+    if( b != value ) {
+      fprintf( stderr, "%s: byte %d is 0x%02x not 0x%02x\n", progname, i, b,
+               value );
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static test_return_t
+test_100( void )
+{
+  char filename[] = "hdfXXXXXX";
+  libspectrum_ide_channel *chn;
+  struct stat info;
+  /* Needs all 28 bits of the LBA address */
+  libspectrum_dword sector = 0x01000010;
+  test_return_t r = TEST_FAIL;
+
+  /* A 16 Gb disk with nothing but the header on disk */
+  if( create_hdf_file( filename, 0, 32768, 16, 64, 1 ) )
+    return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+  libspectrum_ide_reset( chn );
+
+  ide_write_sectors( chn, sector, 1 );
+  libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER );
+
+  /* The sector is read back from where it was written, and not from the
+     same address below 8 Gb */
+  ide_lba_command( chn, 0x20, sector, 1 );
+  if( check_ide_fill( chn, 0xaa ) ) goto cleanup;
+  ide_lba_command( chn, 0x20, sector & 0x00ffffff, 1 );
+  if( check_ide_fill( chn, 0x00 ) ) goto cleanup;
+
+  /* And went to the right place in the file */
+  if( stat( filename, &info ) ) goto cleanup;
+  if( info.st_size != 0x80 + ( (off_t)sector + 1 ) * 512 ) {
+    fprintf( stderr, "%s: image is %.0f bytes long\n", progname,
+             (double)info.st_size );
+    goto cleanup;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_ide_free( chn );
+  unlink( filename );
+
+  return r;
+}
+
+#ifdef HAVE_ZLIB_H
+/* Put `length' bytes of `data' in a zip archive as `name' and gzip that.
+   `*inflated' is how much has to be decompressed to get the data back */
+static libspectrum_byte*
+make_nested( const char *name, const libspectrum_byte *data, size_t length,
+             size_t *nested_length, size_t *inflated )
+{
+  zip_test_file file;
+  libspectrum_byte *zip, *gzip;
+  size_t zip_length;
+
+  memset( &file, 0, sizeof( file ) );
+  file.name = name;
+  file.data = data;
+  file.length = length;
+  file.deflate = 1;
+
+  zip = make_zip( &file, 1, &zip_length );
+  if( !zip ) return NULL;
+
+  gzip = make_gzip( zip, zip_length, zip_length, nested_length );
+  *inflated = zip_length + length;
+
+  libspectrum_free( zip );
+
+  return gzip;
+}
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+static test_return_t
+test_101( void )
+{
+#ifdef HAVE_ZLIB_H
+  static const libspectrum_id_t tape_types[] = {
+    LIBSPECTRUM_ID_UNKNOWN, LIBSPECTRUM_ID_TAPE_TAP
+  };
+  static const libspectrum_id_t snap_types[] = {
+    LIBSPECTRUM_ID_UNKNOWN, LIBSPECTRUM_ID_SNAPSHOT_Z80
+  };
+  const char *filename = STATIC_TEST_PATH( "plus3.z80" );
+  libspectrum_byte tap[2002], *z80 = NULL, *nested_tap = NULL;
+  libspectrum_byte *nested_z80 = NULL;
+  size_t z80_length = 0, nested_tap_length, nested_z80_length;
+  size_t tap_inflated, z80_inflated, i;
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator it;
+  libspectrum_snap *snap = NULL, *snap2 = NULL;
+  test_return_t r = TEST_INCOMPLETE;
+
+  tap[0] = 2000 & 0xff; tap[1] = 2000 >> 8;
+  for( i = 2; i < sizeof( tap ); i++ ) tap[i] = ( i * 5 + ( i >> 7 ) ) & 0xff;
+
+  if( read_file( &z80, &z80_length, filename ) ) goto cleanup;
+
+  snap = libspectrum_snap_alloc();
+  if( libspectrum_snap_read( snap, z80, z80_length, LIBSPECTRUM_ID_UNKNOWN,
+                             filename ) ) goto cleanup;
+
+  nested_tap = make_nested( "test.tap", tap, sizeof( tap ),
+                            &nested_tap_length, &tap_inflated );
+  nested_z80 = make_nested( "test.z80", z80, z80_length,
+                            &nested_z80_length, &z80_inflated );
+  if( !nested_tap || !nested_z80 ) goto cleanup;
+
+  r = TEST_FAIL;
+
+  for( i = 0; i < 2; i++ ) {
+
+    /* Every layer is decompressed once, whether or not the type is given,
+       so a limit of exactly that is enough */
+    libspectrum_set_decompression_limits( tap_inflated, 0 );
+    if( libspectrum_tape_read( tape, nested_tap, nested_tap_length,
+                               tape_types[i], "test.tap.zip.gz" ) ) {
+      fprintf( stderr, "%s: nested tape not read with type %d\n", progname,
+               tape_types[i] );
+      goto cleanup;
+    }
+    block = libspectrum_tape_iterator_init( &it, tape );
+    if( !block || libspectrum_tape_block_data_length( block ) != 2000 ||
+        memcmp( libspectrum_tape_block_data( block ), &tap[2], 2000 ) ) {
+      fprintf( stderr, "%s: nested tape wrongly read with type %d\n",
+               progname, tape_types[i] );
+      goto cleanup;
+    }
+    libspectrum_tape_clear( tape );
+
+    libspectrum_set_decompression_limits( tap_inflated - 1, 0 );
+    if( libspectrum_tape_read( tape, nested_tap, nested_tap_length,
+                               tape_types[i], "test.tap.zip.gz" ) !=
+        LIBSPECTRUM_ERROR_LIMIT ) {
+      fprintf( stderr, "%s: nested tape read past the limit with type %d\n",
+               progname, tape_types[i] );
+      goto cleanup;
+    }
+    libspectrum_tape_clear( tape );
+
+    /* And the same for a snapshot */
+    libspectrum_set_decompression_limits( z80_inflated, 0 );
+    snap2 = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( snap2, nested_z80, nested_z80_length,
+                               snap_types[i], "test.z80.zip.gz" ) ||
+        memcmp( libspectrum_snap_pages( snap, 5 ),
+                libspectrum_snap_pages( snap2, 5 ), 0x4000 ) ) {
+      fprintf( stderr, "%s: nested snapshot not read with type %d\n",
+               progname, snap_types[i] );
+      goto cleanup;
+    }
+    libspectrum_snap_free( snap2 ); snap2 = libspectrum_snap_alloc();
+
+    libspectrum_set_decompression_limits( z80_inflated - 1, 0 );
+    if( libspectrum_snap_read( snap2, nested_z80, nested_z80_length,
+                               snap_types[i], "test.z80.zip.gz" ) !=
+        LIBSPECTRUM_ERROR_LIMIT ) {
+      fprintf( stderr, "%s: nested snapshot read past the limit with "
+               "type %d\n", progname, snap_types[i] );
+      goto cleanup;
+    }
+    libspectrum_snap_free( snap2 ); snap2 = NULL;
+  }
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_set_decompression_limits( 0, 0 );
+  if( snap2 ) libspectrum_snap_free( snap2 );
+  if( snap ) libspectrum_snap_free( snap );
+  libspectrum_tape_free( tape );
+  libspectrum_free( nested_z80 );
+  libspectrum_free( nested_tap );
+  libspectrum_free( z80 );
+
+  return r;
+#else				/* #ifdef HAVE_ZLIB_H */
+  return TEST_SKIPPED; /* gzip not enabled in build */
+#endif				/* #ifdef HAVE_ZLIB_H */
+}
+
+static test_return_t
+test_102( void )
+{
+#ifdef HAVE_LIBBZ2
+  static const size_t block_lengths[] = { 19, 60000, 3, 60000, 5000 };
+  static const libspectrum_id_t types[] = {
+    LIBSPECTRUM_ID_UNKNOWN, LIBSPECTRUM_ID_TAPE_TAP
+  };
+  static const char *filenames[] = { "test.tap.bz2", NULL };
+  const size_t block_count = ARRAY_SIZE( block_lengths );
+  libspectrum_byte *tap, *bz = NULL, *ptr;
+  unsigned int bz_length;
+  size_t tap_length, i, j;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator iterator;
+  test_return_t r = TEST_FAIL;
+#ifdef HAVE_ZLIB_H
+  libspectrum_byte *zip = NULL, *directory;
+  zip_test_file file;
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  /* A tape with several blocks, one of them bigger than bzip2 gives out
+     at a time, so blocks are split across the decompressed data */
+  tap_length = 0;
+  for( i = 0; i < block_count; i++ ) tap_length += 2 + block_lengths[i];
+  tap = ptr = libspectrum_new( libspectrum_byte, tap_length );
+  for( i = 0; i < block_count; i++ ) {
+    *ptr++ = block_lengths[i] & 0xff; *ptr++ = block_lengths[i] >> 8;
+    for( j = 0; j < block_lengths[i]; j++ )
+      *ptr++ = ( i + j * 7 + ( j >> 9 ) ) & 0xff;
+  }
+
+  bz_length = tap_length;
+  bz = libspectrum_new( libspectrum_byte, bz_length );
+  tape = libspectrum_tape_alloc();
+  if( BZ2_bzBuffToBuffCompress( (char*)bz, &bz_length, (char*)tap,
+                                tap_length, 1, 0, 0 ) != BZ_OK ) {
+    r = TEST_INCOMPLETE;
+    goto cleanup;
+  }
+
+  for( i = 0; i < ARRAY_SIZE( types ); i++ ) {
+
+    /* Reading just as much as is in the file is within the limit */
+    libspectrum_set_decompression_limits( tap_length, 0 );
+    if( libspectrum_tape_read( tape, bz, bz_length, types[i],
+                               filenames[i] ) ) {
+      fprintf( stderr, "%s: couldn't read bzipped tap with type %d\n",
+               progname, types[i] );
+      goto cleanup;
+    }
+
+    ptr = tap;
+    block = libspectrum_tape_iterator_init( &iterator, tape );
+    for( j = 0; j < block_count; j++ ) {
+      if( !block ||
+          libspectrum_tape_block_data_length( block ) != block_lengths[j] ||
+          memcmp( libspectrum_tape_block_data( block ), ptr + 2,
+                  block_lengths[j] ) ) {
+        fprintf( stderr, "%s: block %lu of bzipped tap wrongly read\n",
+                 progname, (unsigned long)j );
+        goto cleanup;
+      }
+      ptr += 2 + block_lengths[j];
+      block = libspectrum_tape_iterator_next( &iterator );
+    }
+    if( block ) {
+      fprintf( stderr, "%s: too many blocks in bzipped tap\n", progname );
+      goto cleanup;
+    }
+    libspectrum_tape_clear( tape );
+
+    libspectrum_set_decompression_limits( tap_length - 1, 0 );
+    if( libspectrum_tape_read( tape, bz, bz_length, types[i],
+                               filenames[i] ) != LIBSPECTRUM_ERROR_LIMIT ||
+        libspectrum_tape_present( tape ) ) {
+      fprintf( stderr, "%s: bzipped tap read past the limit with type %d\n",
+               progname, types[i] );
+      goto cleanup;
+    }
+    libspectrum_set_decompression_limits( 0, 0 );
+
+    /* A truncated file leaves nothing behind, even though the first blocks
+       were read before the end was found */
+    if( libspectrum_tape_read( tape, bz, bz_length - 10, types[i],
+                               filenames[i] ) != LIBSPECTRUM_ERROR_CORRUPT ||
+        libspectrum_tape_present( tape ) ) {
+      fprintf( stderr, "%s: truncated bzipped tap not detected with type "
+               "%d\n", progname, types[i] );
+      goto cleanup;
+    }
+  }
+
+#ifdef HAVE_ZLIB_H
+  /* The same data as a bzip2 compressed entry in a zip file */
+  file.name = "test.tap"; file.data = tap; file.length = tap_length;
+  file.deflate = 0; file.dos = 0;
+
+  zip = ptr = libspectrum_new( libspectrum_byte, 2 * 46 + bz_length + 22 );
+  ptr = put_zip_header( ptr, &file, 1, bz_length, 0 );
+  put_word( zip + 8, 12 );
+  memcpy( ptr, bz, bz_length ); ptr += bz_length;
+  directory = ptr;
+  ptr = put_zip_header( ptr, &file, 0, bz_length, 0 );
+  put_word( directory + 10, 12 );
+
+  ptr = put_dword( ptr, 0x06054b50 );
+  ptr = put_dword( ptr, 0 );
+  ptr = put_word( ptr, 1 );
+  ptr = put_word( ptr, 1 );
+  ptr = put_dword( ptr, ptr - directory - 8 );
+  ptr = put_dword( ptr, directory - zip );
+  ptr = put_word( ptr, 0 );
+
+  if( libspectrum_tape_read( tape, zip, ptr - zip, LIBSPECTRUM_ID_UNKNOWN,
+                             "test.zip" ) ||
+      !( block = libspectrum_tape_iterator_init( &iterator, tape ) ) ||
+      libspectrum_tape_block_data_length( block ) != block_lengths[0] ||
+      memcmp( libspectrum_tape_block_data( block ), tap + 2,
+              block_lengths[0] ) ) {
+    fprintf( stderr, "%s: bzip2 zip entry wrongly read\n", progname );
+    goto cleanup;
+  }
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  r = TEST_PASS;
+
+cleanup:
+  libspectrum_set_decompression_limits( 0, 0 );
+#ifdef HAVE_ZLIB_H
+  libspectrum_free( zip );
+#endif				/* #ifdef HAVE_ZLIB_H */
+  libspectrum_tape_free( tape );
+  libspectrum_free( bz );
+  libspectrum_free( tap );
+
+  return r;
+#else				/* #ifdef HAVE_LIBBZ2 */
+  return TEST_SKIPPED; /* bzip2 not enabled in build */
+#endif				/* #ifdef HAVE_LIBBZ2 */
+}
+
 struct test_description {
 
   test_fn test;
@@ -1000,7 +3975,35 @@ static struct test_description tests[] = {
   { test_71, "Write RZX with incompressible snap", 0 },
   { test_72, "Tape peek next block", 0 },
   { test_73, "Read TZX RAW block edge handling", 0 },
-  { test_74, "Trailing pause block TZX file", 0 }
+  { test_74, "Trailing pause block TZX file", 0 },
+  { test_75, "RZX rollback to earlier snapshot", 0 },
+  { test_76, "RZX whole frame playback", 0 },
+  { test_77, "RZX recording with frame dictionary", 0 },
+  { test_78, "RZX write with multiple threads", 0 },
+  { test_79, "Signed RZX verification", 0 },
+  { test_80, "IDE sector reads and writes", 0 },
+  { test_81, "IDE commit of many sectors", 0 },
+  { test_82, "Hash table with many entries", 0 },
+  { test_83, "Lists used from several threads", 0 },
+  { test_84, "IDE multiple sector commands and block transfers", 0 },
+  { test_85, "MMC multiple block reads and writes", 0 },
+  { test_86, "IDE copy-on-write overlay", 0 },
+  { test_87, "Sparse card images bigger than 4 Gb", 0 },
+  { test_88, "IDE and MMC activity counters", 0 },
+  { test_89, "IDE background commit", 0 },
+  { test_90, "Inflating data of unknown length", 0 },
+  { test_91, "Identifying compressed files from their start", 0 },
+  { test_92, "Cataloguing zip archives", 0 },
+  { test_93, "Limiting decompression", 0 },
+  { test_94, "Writing SZX files with fast compression", 0 },
+  { test_95, "Writing gzipped files", 0 },
+  { test_96, "Locating files in zip archives", 0 },
+  { test_97, "Extracting all files from zip archives", 0 },
+  { test_98, "Decompressing bzip2 files", 0 },
+  { test_99, "Decompression limits across a whole file", 0 },
+  { test_100, "IDE sectors past 8 Gb", 0 },
+  { test_101, "Reading files inside several layers of compression", 0 },
+  { test_102, "Reading bzip2 compressed tapes as they are decompressed", 0 }
 };
 
 static size_t test_count = ARRAY_SIZE( tests );
@@ -220,6 +220,8 @@ internal_tzx_write( libspectrum_buffer* buffer, libspectrum_tape *tape )
       );
       return LIBSPECTRUM_ERROR_LOGIC;
     }
+
+    libspectrum_buffer_drain( buffer );
   }
 
   return LIBSPECTRUM_ERROR_NONE;
@@ -26,6 +26,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <string.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>		/* Needed for strcasecmp() on QNX6 */
@@ -41,6 +42,10 @@
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
 #endif
 
+/* How much of each file libspectrum_zip_catalogue() inflates to identify
+   it; enough for the signatures libspectrum_identify_file_raw() checks */
+#define CATALOGUE_PREFIX_LENGTH 256
+
 enum {
   ARCHIVE_CLOSED = 0,
   ARCHIVE_OPEN
@@ -164,6 +169,19 @@ match_file_names( const char *a, const char *b, const int ignore_case )
 static void
 close_zip( struct libspectrum_zip *z )
 {
+  unsigned int i;
+
+  if( z->index ) {
+    g_hash_table_destroy( z->index );
+    z->index = NULL;
+  }
+
+  for( i = 0; i < z->entry_count; i++ )
+    libspectrum_free( z->entries[i].file_name );
+  libspectrum_free( z->entries );
+  z->entries = NULL;
+  z->entry_count = 0;
+
   z->state = ARCHIVE_CLOSED;
   z->input_data = NULL;
   z->data_size = 0;
@@ -305,9 +323,102 @@ read_directory( struct libspectrum_zip *z )
   return 0;
 }
 
-/* Open a ZIP archive from memory */
+/* The key under which a file is indexed: its name without any
+   directories, case-folded so that all the entries which might match a
+   name are found together */
+static char *
+index_key( const char *name )
+{
+  const char *slash;
+  char *key, *ptr;
+
+  slash = strrchr( name, '/' );
+  key = libspectrum_safe_strdup( slash ? slash + 1 : name );
+
+  for( ptr = key; *ptr; ptr++ ) *ptr = tolower( (unsigned char)*ptr );
+
+  return key;
+}
+
+/* Read the whole central directory into memory, leaving the archive
+   rewound */
+static libspectrum_error
+read_entries( struct libspectrum_zip *z )
+{
+  zip_entry *entry;
+  libspectrum_error error;
+
+  error = libspectrum_zip_rewind( z );
+  if( error ) return error;
+
+  z->entries = libspectrum_new( zip_entry, z->file_count );
+
+  while( read_directory( z ) == 0 ) {
+    entry = &z->entries[ z->entry_count++ ];
+
+    entry->file_info = z->file_info;
+    entry->file_name = libspectrum_safe_strdup( z->file_name );
+    entry->file_ignore_case = z->file_ignore_case;
+    entry->file_index = z->file_index - 1;
+    entry->next_header = z->ptr;
+    entry->next = NULL;
+  }
+
+  return libspectrum_zip_rewind( z );
+}
+
+/* Is this entry a directory? */
+static int
+is_directory( const char *file_name )
+{
+  size_t length = strlen( file_name );
+
+  return !length || file_name[ length - 1 ] == '/';
+}
+
+/* Read the whole central directory into memory, indexed by file name */
+static libspectrum_error
+build_index( struct libspectrum_zip *z )
+{
+  zip_entry *entry, *last;
+  libspectrum_error error;
+  unsigned int i;
+  char *key;
+
+  error = read_entries( z );
+  if( error ) return error;
+
+  z->index = g_hash_table_new_full( g_str_hash, g_str_equal,
+                                    libspectrum_free, NULL );
+
+  for( i = 0; i < z->entry_count; i++ ) {
+    entry = &z->entries[i];
+
+    /* Directories are never located */
+    if( is_directory( entry->file_name ) ) continue;
+
+    /* Keep entries with the same key in directory order, so the first
+       match is the same one a linear search would find */
+    key = index_key( entry->file_name );
+    last = g_hash_table_lookup( z->index, key );
+    if( last ) {
+      while( last->next ) last = last->next;
+      last->next = entry;
+      libspectrum_free( key );
+    } else {
+      g_hash_table_insert( z->index, key, entry );
+    }
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Open a ZIP archive from memory. If `flags' includes
+   LIBSPECTRUM_ZIP_INDEX, the central directory is indexed so that
+   libspectrum_zip_locate() doesn't have to search through it every time */
 struct libspectrum_zip *
-libspectrum_zip_open( const libspectrum_byte *buffer, size_t length )
+libspectrum_zip_open( const libspectrum_byte *buffer, size_t length,
+                      int flags )
 {
   struct libspectrum_zip *z;
   libspectrum_error error;
@@ -334,29 +445,41 @@ libspectrum_zip_open( const libspectrum_byte *buffer, size_t length )
     return NULL;
   }
 
+  if( ( flags & LIBSPECTRUM_ZIP_INDEX ) && build_index( z ) ) {
+    libspectrum_zip_close( z );
+    return NULL;
+  }
+
   return z;
 }
 
 static void
-dump_entry_stat( struct libspectrum_zip *z, zip_stat *info )
+entry_stat( const char *file_name, const zip_file_header *file_info,
+            unsigned int file_index, libspectrum_zip_stat *info )
 {
   char *slash;
   size_t length;
 
-  strcpy( info->name, z->file_name );
+  strcpy( info->name, file_name );
   slash = strrchr( info->name, '/' );
   info->filename = slash ? slash + 1 : info->name;
 
-  length = strlen( z->file_name );
-  info->is_dir = ( z->file_name[ length - 1 ] == '/' ) ? 1 : 0;
+  length = strlen( file_name );
+  info->is_dir = ( file_name[ length - 1 ] == '/' ) ? 1 : 0;
+
+  info->size = file_info->uncompressed_size;
+  info->index = file_index;
+}
 
-  info->size = z->file_info.uncompressed_size;
-  info->index = z->file_index -1;
+static void
+dump_entry_stat( struct libspectrum_zip *z, libspectrum_zip_stat *info )
+{
+  entry_stat( z->file_name, &z->file_info, z->file_index - 1, info );
 }
 
 /* Jump to next entry in the archive */
 libspectrum_error
-libspectrum_zip_next( struct libspectrum_zip *z, zip_stat *info )
+libspectrum_zip_next( struct libspectrum_zip *z, libspectrum_zip_stat *info )
 {
   if( !z || z->state == ARCHIVE_CLOSED ) return LIBSPECTRUM_ERROR_UNKNOWN;
 
@@ -367,10 +490,55 @@ libspectrum_zip_next( struct libspectrum_zip *z, zip_stat *info )
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+/* Locate a file using the index of the central directory */
+static int
+locate_indexed( struct libspectrum_zip *z, const char *filename,
+                int flags, libspectrum_zip_stat *info )
+{
+  zip_entry *entry;
+  const char *fname, *slash;
+  int ignore_case;
+  char *key;
+
+  key = index_key( filename );
+  entry = g_hash_table_lookup( z->index, key );
+  libspectrum_free( key );
+
+  for( ; entry; entry = entry->next ) {
+
+    /* Ignore directories in path */
+    if( flags & LIBSPECTRUM_ZIP_NODIR ) {
+      slash = strrchr( entry->file_name, '/' );
+      fname = slash ? slash + 1 : entry->file_name;
+    } else {
+      fname = entry->file_name;
+    }
+
+    ignore_case = ( flags & LIBSPECTRUM_ZIP_AUTOCASE ) ?
+                  entry->file_ignore_case :
+                  ( flags & LIBSPECTRUM_ZIP_NOCASE );
+
+    if( match_file_names( filename, fname, ignore_case ) ) {
+
+      /* Leave things as if we'd just read this entry from the directory */
+      z->file_info = entry->file_info;
+      strcpy( z->file_name, entry->file_name );
+      z->file_ignore_case = entry->file_ignore_case;
+      z->file_index = entry->file_index + 1;
+      z->ptr = entry->next_header;
+
+      dump_entry_stat( z, info );
+      return info->index;
+    }
+  }
+
+  return -1;
+}
+
 /* Locate a file in the archive (non-sequential acces) */
 int
 libspectrum_zip_locate( struct libspectrum_zip *z, const char *filename, 
-                        int flags, zip_stat *info )
+                        int flags, libspectrum_zip_stat *info )
 {
   int ignore_dir, ignore_case;
   size_t length;
@@ -381,14 +549,14 @@ libspectrum_zip_locate( struct libspectrum_zip *z, const char *filename,
 
   if( !filename || strlen( filename ) == 0 ) return -1;
 
+  if( z->index ) return locate_indexed( z, filename, flags, info );
+
   if( libspectrum_zip_rewind( z ) ) {
     close_zip( z );
     return -1;
   }
 
-  ignore_dir = flags & ZIPFLAG_NODIR;
-  ignore_case = ( flags & ZIPFLAG_AUTOCASE ) ? z->file_ignore_case :
-                                               ( flags & ZIPFLAG_NOCASE );
+  ignore_dir = flags & LIBSPECTRUM_ZIP_NODIR;
 
   while( read_directory( z ) == 0 ) {
     const char *fname, *slash;
@@ -408,6 +576,10 @@ libspectrum_zip_locate( struct libspectrum_zip *z, const char *filename,
     length = strlen( fname );
     if( fname[ length - 1 ] == '/' ) continue;
 
+    ignore_case = ( flags & LIBSPECTRUM_ZIP_AUTOCASE ) ?
+                  z->file_ignore_case :
+                  ( flags & LIBSPECTRUM_ZIP_NOCASE );
+
     if( match_file_names( filename, fname, ignore_case ) ) {
       dump_entry_stat( z, info );
       return info->index;
@@ -427,25 +599,30 @@ libspectrum_zip_close( struct libspectrum_zip *z )
   }
 }
 
-/* Prepare stream for reading from ZIP archive */
+/* Prepare stream for reading a file from ZIP archive, leaving `*ptr'
+   pointing to its data. This doesn't change the state of the archive, so
+   several files can be read at once */
 static libspectrum_error
-prepare_stream( struct libspectrum_zip *z )
+prepare_stream( const struct libspectrum_zip *z,
+                const zip_file_header *file_info,
+                const libspectrum_byte **ptr )
 {
   zip_local_header header;
   int retval;
   libspectrum_dword skip;
   libspectrum_word version;
-  libspectrum_error error;
 
   /* Seek to the local header and read it */
-  error = seek( z, z->file_info.file_offset, SEEK_SET );
-  if( error ) return error;
+  if( file_info->file_offset < 0 ||
+      file_info->file_offset > z->end - z->input_data )
+    return LIBSPECTRUM_ERROR_CORRUPT;
+  *ptr = z->input_data + file_info->file_offset;
 
-  retval = read_local_header( &header, z->ptr, z->end );
+  retval = read_local_header( &header, *ptr, z->end );
   if( !retval ) {
     return LIBSPECTRUM_ERROR_CORRUPT;
   } else {
-    z->ptr += retval;
+    *ptr += retval;
   }
 
   /* Verify the header */
@@ -467,16 +644,19 @@ prepare_stream( struct libspectrum_zip *z )
      authorative. */
   skip = header.name_size + header.extra_field_size;
 
-  error = seek( z, skip, SEEK_CUR );
-  if( error ) return error;
+  if( skip > (size_t)( z->end - *ptr ) ) return LIBSPECTRUM_ERROR_CORRUPT;
+  *ptr += skip;
 
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-/* Decompress the zlib compressed data */
+/* Decompress the deflate or bzip2 compressed data, or just the first `limit'
+   bytes of it if `limit' is non-zero */
 static libspectrum_error
-decompress_stream( struct libspectrum_zip *z, libspectrum_byte **buffer,
-                   size_t *buffer_size )
+decompress_stream( const struct libspectrum_zip *z,
+                   const zip_file_header *file_info,
+                   const libspectrum_byte *ptr, libspectrum_byte **buffer,
+                   size_t *buffer_size, size_t limit )
 {
   libspectrum_error error;
   size_t file_compressed_left;
@@ -484,7 +664,7 @@ decompress_stream( struct libspectrum_zip *z, libspectrum_byte **buffer,
   /* Note that we take the sizes from central directory rather than
      the local header, as those may be 0 in case of non-seekable compressed
      streams */
-  file_compressed_left = z->file_info.compressed_size;
+  file_compressed_left = file_info->compressed_size;
 
   /* Nothing to do */
   if( file_compressed_left == 0 ) {
@@ -492,93 +672,410 @@ decompress_stream( struct libspectrum_zip *z, libspectrum_byte **buffer,
   }
 
   /* Bad archive? */
-  if( z->ptr + file_compressed_left > z->end ) {
+  if( file_compressed_left > (size_t)( z->end - ptr ) ) {
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
-  error = libspectrum_zip_inflate( z->ptr, file_compressed_left, buffer,
-                                   buffer_size );
+#ifdef HAVE_LIBBZ2
+  /* The size from the directory is only a hint, as it can't be trusted */
+  if( file_info->compression == 12 ) {
+    if( limit ) {
+      *buffer_size = limit;
+      error = libspectrum_bzip2_inflate_prefix( ptr, file_compressed_left,
+                                                buffer, buffer_size );
+    } else {
+      error = libspectrum_bzip2_inflate_hinted( ptr, file_compressed_left,
+                                                buffer, buffer_size,
+                                                *buffer_size );
+    }
+  } else
+#endif				/* #ifdef HAVE_LIBBZ2 */
+  if( limit ) {
+    *buffer_size = limit;
+    error = libspectrum_zip_inflate_prefix( ptr, file_compressed_left,
+                                            buffer, buffer_size );
+  } else {
+    error = libspectrum_zip_inflate( ptr, file_compressed_left, buffer,
+                                     buffer_size );
+  }
   if( error ) return error;
 
-  z->ptr += file_compressed_left;
-
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-/* Read file from ZIP archive */
-libspectrum_error
-libspectrum_zip_read( struct libspectrum_zip *z, libspectrum_byte **buffer,
-                      size_t *size )
+/* Read a file from ZIP archive, or just the first `limit' bytes of it if
+   `limit' is non-zero. Like prepare_stream(), this can be used for
+   several files at once */
+static libspectrum_error
+read_entry( const struct libspectrum_zip *z, const zip_file_header *file_info,
+            libspectrum_byte **buffer, size_t *size, size_t limit )
 {
-  const libspectrum_byte *last = z->ptr;
+  const libspectrum_byte *ptr;
   libspectrum_error error;
   libspectrum_dword file_crc;
   libspectrum_word compression;
 
-  error = prepare_stream( z );
-  if( error ) {
-    z->ptr = last;
-    return error;
-  }
+  error = prepare_stream( z, file_info, &ptr );
+  if( error ) return error;
 
   /* Report EOF when there is no more to read */
-  *size = z->file_info.uncompressed_size;
+  *size = file_info->uncompressed_size;
 
   if( *size == 0 ) {
     return LIBSPECTRUM_ERROR_UNKNOWN;
   }
 
   /* Now read the data depending on the compression method used */
-  compression = z->file_info.compression;
+  compression = file_info->compression;
 
   switch( compression ) {
 
   case 0: /* store */
-    if( z->ptr + *size > z->end ) return 1;
+    if( limit && *size > limit ) *size = limit;
+    if( *size > (size_t)( z->end - ptr ) ) return 1;
+    if( !limit ) {
+      error = libspectrum_inflate_check( *size );
+      if( error ) return error;
+      libspectrum_inflate_charge( *size );
+    }
     *buffer = libspectrum_malloc( *size );
-    memcpy( *buffer, z->ptr, *size );
+    memcpy( *buffer, ptr, *size );
     break;
 
   case 8: /* deflate */
-    if( decompress_stream( z, buffer, size ) ) {
+#ifdef HAVE_LIBBZ2
+  case 12: /* bzip2 */
+#endif				/* #ifdef HAVE_LIBBZ2 */
+    error = decompress_stream( z, file_info, ptr, buffer, size, limit );
+    if( error == LIBSPECTRUM_ERROR_LIMIT ) return error;
+    if( error ) {
       libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
                                "ZIP decompression failed" );
-      z->ptr = last;
       return LIBSPECTRUM_ERROR_CORRUPT;
     }
     break;
 
   default:
-    z->ptr = last;
     libspectrum_print_error( LIBSPECTRUM_ERROR_INVALID,
                              "Unsupported compression method %u", compression );
     return LIBSPECTRUM_ERROR_INVALID;
   }
 
-  /* Restore position to allow reading next header in central directory */
-  z->ptr = last;
+  /* Only the whole file can be checked */
+  if( limit ) return LIBSPECTRUM_ERROR_NONE;
 
   /* Update the CRC, and report an error when it doesn't match at end */
   file_crc = crc32( 0, *buffer, *size );
 
-  if( file_crc != z->file_info.crc ) {
+  if( file_crc != file_info->crc ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT, "ZIP CRC mismatch" );
+    libspectrum_free( *buffer ); *buffer = NULL;
     return LIBSPECTRUM_ERROR_CORRUPT;
   }
 
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-/* Make 'best guesses' as to what to uncompress from the archive */
+/* Read the current file from ZIP archive, or just the first `limit' bytes
+   of it if `limit' is non-zero */
+static libspectrum_error
+zip_read( struct libspectrum_zip *z, libspectrum_byte **buffer, size_t *size,
+          size_t limit )
+{
+  return read_entry( z, &z->file_info, buffer, size, limit );
+}
+
 libspectrum_error
-libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
-                            libspectrum_byte **outptr, size_t *outlength )
+libspectrum_zip_read( struct libspectrum_zip *z, libspectrum_byte **buffer,
+                      size_t *size )
+{
+  return zip_read( z, buffer, size, 0 );
+}
+
+/* The result of extracting one entry from the archive */
+typedef struct extract_result {
+  libspectrum_byte *buffer;
+  size_t length;
+  libspectrum_error error;
+  int done;
+} extract_result;
+
+/* Entries being extracted by libspectrum_zip_extract_all() */
+typedef struct extract_job {
+  const struct libspectrum_zip *z;
+  extract_result *results;
+
+  /* The next entry for a worker thread to extract */
+  unsigned int next;
+
+  /* Entries before this have been passed to the callback. Workers don't
+     get more than `window' entries ahead of it, so at most that many
+     extracted files are held in memory */
+  unsigned int consumed;
+  unsigned int window;
+
+  /* The calling thread's decompression limits, which the workers use too */
+  size_t max_bytes;
+  int max_depth;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  pthread_cond_t space;
+#endif				/* #ifdef HAVE_PTHREAD_H */
+} extract_job;
+
+/* Directories and empty files have nothing to extract */
+static int
+has_data( const zip_entry *entry )
+{
+  return entry->file_info.uncompressed_size &&
+         !is_directory( entry->file_name );
+}
+
+static void
+extract_entry( extract_job *job, unsigned int i )
+{
+  const zip_entry *entry = &job->z->entries[i];
+  extract_result *result = &job->results[i];
+
+  if( has_data( entry ) )
+    result->error = read_entry( job->z, &entry->file_info, &result->buffer,
+                                &result->length, 0 );
+}
+
+#ifdef HAVE_PTHREAD_H
+static void*
+extract_thread( void *data )
+{
+  extract_job *job = data;
+  unsigned int i;
+
+  libspectrum_set_thread_decompression_limits( job->max_bytes,
+                                               job->max_depth );
+
+  while( 1 ) {
+    pthread_mutex_lock( &job->lock );
+    while( job->next < job->z->entry_count &&
+           job->next >= job->consumed + job->window )
+      pthread_cond_wait( &job->space, &job->lock );
+    i = job->next;
+    if( i < job->z->entry_count ) job->next++;
+    pthread_mutex_unlock( &job->lock );
+
+    if( i >= job->z->entry_count ) break;
+
+    extract_entry( job, i );
+
+    pthread_mutex_lock( &job->lock );
+    job->results[i].done = 1;
+    pthread_cond_broadcast( &job->done );
+    pthread_mutex_unlock( &job->lock );
+  }
+
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+/* Extract every file in the archive, inflating them on up to `threads'
+   worker threads, which keep at most two files each ready ahead of the
+   callback. `callback' is called from this thread for each file in
+   directory order, and the data passed to it is freed when it returns.
+   Stops at the first error, whether from the archive or from `callback' */
+libspectrum_error
+libspectrum_zip_extract_all( struct libspectrum_zip *z,
+                             libspectrum_zip_extract_fn callback,
+                             void *user_data, int threads )
+{
+  extract_job job;
+  extract_result *result;
+  const zip_entry *entry;
+  libspectrum_zip_stat info;
+  unsigned int i, count;
+  libspectrum_error error;
+#ifdef HAVE_PTHREAD_H
+  pthread_t *workers = NULL;
+  int started = 0;
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  if( !z || z->state == ARCHIVE_CLOSED ) return LIBSPECTRUM_ERROR_INVALID;
+
+  if( !z->entries ) {
+    error = read_entries( z );
+    if( error ) return error;
+  }
+
+  count = z->entry_count;
+
+  job.z = z;
+  job.results = libspectrum_new0( extract_result, count );
+  job.next = 0;
+  job.consumed = 0;
+  job.window = 0;
+  libspectrum_get_decompression_limits( &job.max_bytes, &job.max_depth );
+
+#ifdef HAVE_PTHREAD_H
+  if( threads > 1 && count > 1 ) {
+    if( (unsigned int)threads > count ) threads = count;
+    job.window = threads * 2;
+
+    pthread_mutex_init( &job.lock, NULL );
+    pthread_cond_init( &job.done, NULL );
+    pthread_cond_init( &job.space, NULL );
+    workers = libspectrum_new( pthread_t, threads );
+
+    /* If we can't start any threads, do everything on this one */
+    while( started < threads &&
+           !pthread_create( &workers[ started ], NULL, extract_thread, &job ) )
+      started++;
+  }
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  error = LIBSPECTRUM_ERROR_NONE;
+
+  for( i = 0; i < count && !error; i++ ) {
+    entry = &z->entries[i];
+    result = &job.results[i];
+
+#ifdef HAVE_PTHREAD_H
+    if( started ) {
+      pthread_mutex_lock( &job.lock );
+      while( !result->done ) pthread_cond_wait( &job.done, &job.lock );
+      pthread_mutex_unlock( &job.lock );
+    } else
+#endif				/* #ifdef HAVE_PTHREAD_H */
+      extract_entry( &job, i );
+
+    error = result->error;
+
+    if( !error && has_data( entry ) ) {
+      entry_stat( entry->file_name, &entry->file_info, entry->file_index,
+                  &info );
+      error = callback( &info, result->buffer, result->length, user_data );
+    }
+
+    libspectrum_free( result->buffer ); result->buffer = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    if( started ) {
+      pthread_mutex_lock( &job.lock );
+      job.consumed = i + 1;
+      pthread_cond_broadcast( &job.space );
+      pthread_mutex_unlock( &job.lock );
+    }
+#endif				/* #ifdef HAVE_PTHREAD_H */
+  }
+
+#ifdef HAVE_PTHREAD_H
+  if( workers ) {
+
+    /* Stop the workers picking up anything else if we finished early */
+    pthread_mutex_lock( &job.lock );
+    job.next = count;
+    pthread_cond_broadcast( &job.space );
+    pthread_mutex_unlock( &job.lock );
+
+    while( started ) pthread_join( workers[ --started ], NULL );
+
+    pthread_cond_destroy( &job.space );
+    pthread_cond_destroy( &job.done );
+    pthread_mutex_destroy( &job.lock );
+    libspectrum_free( workers );
+  }
+#endif				/* #ifdef HAVE_PTHREAD_H */
+
+  for( i = 0; i < count; i++ ) libspectrum_free( job.results[i].buffer );
+  libspectrum_free( job.results );
+
+  return error;
+}
+
+/* List every entry in an archive, identifying each file from its name and
+   the first few bytes of its data */
+libspectrum_error
+libspectrum_zip_catalogue( const libspectrum_byte *buffer, size_t length,
+                           libspectrum_zip_catalogue_entry **entries,
+                           size_t *count )
+{
+  struct libspectrum_zip *z;
+  libspectrum_zip_catalogue_entry *catalogue;
+  const zip_entry *entry;
+  libspectrum_byte *data;
+  size_t data_length;
+  libspectrum_error error;
+  unsigned int i;
+
+  z = libspectrum_zip_open( buffer, length, 0 );
+  if( !z ) return LIBSPECTRUM_ERROR_INVALID;
+
+  error = read_entries( z );
+  if( error ) { libspectrum_zip_close( z ); return error; }
+
+  catalogue = libspectrum_new( libspectrum_zip_catalogue_entry,
+                               z->entry_count );
+
+  for( i = 0; i < z->entry_count; i++ ) {
+    entry = &z->entries[i];
+
+    catalogue[i].name = libspectrum_safe_strdup( entry->file_name );
+    catalogue[i].is_dir = is_directory( entry->file_name );
+    catalogue[i].compressed_size = entry->file_info.compressed_size;
+    catalogue[i].uncompressed_size = entry->file_info.uncompressed_size;
+    catalogue[i].crc = entry->file_info.crc;
+    catalogue[i].type = LIBSPECTRUM_ID_UNKNOWN;
+    catalogue[i].file_class = LIBSPECTRUM_CLASS_UNKNOWN;
+
+    if( catalogue[i].is_dir ) continue;
+
+    /* If the data can't be read, go by the name alone */
+    data = NULL; data_length = 0;
+    if( has_data( entry ) &&
+        read_entry( z, &entry->file_info, &data, &data_length,
+                    CATALOGUE_PREFIX_LENGTH ) ) {
+      data = NULL; data_length = 0;
+    }
+
+    error = libspectrum_identify_file_raw( &catalogue[i].type,
+                                           entry->file_name, data,
+                                           data_length );
+    libspectrum_free( data );
+    if( !error )
+      error = libspectrum_identify_class( &catalogue[i].file_class,
+                                          catalogue[i].type );
+    if( error ) {
+      libspectrum_zip_catalogue_free( catalogue, i + 1 );
+      libspectrum_zip_close( z );
+      return error;
+    }
+  }
+
+  *entries = catalogue; *count = z->entry_count;
+
+  libspectrum_zip_close( z );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+void
+libspectrum_zip_catalogue_free( libspectrum_zip_catalogue_entry *entries,
+                                size_t count )
+{
+  size_t i;
+
+  for( i = 0; i < count; i++ ) libspectrum_free( entries[i].name );
+  libspectrum_free( entries );
+}
+
+/* Make 'best guesses' as to what to uncompress from the archive */
+static libspectrum_error
+zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
+                libspectrum_byte **outptr, size_t *outlength, size_t limit )
 {
   struct libspectrum_zip *z;
-  zip_stat info;
+  libspectrum_zip_stat info;
   libspectrum_error error;
 
-  z = libspectrum_zip_open( zipptr, ziplength );
+  z = libspectrum_zip_open( zipptr, ziplength, 0 );
   if( !z ) return LIBSPECTRUM_ERROR_INVALID;
 
   while( libspectrum_zip_next( z, &info ) == 0 ) {
@@ -600,7 +1097,7 @@ libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
         class != LIBSPECTRUM_CLASS_COMPRESSED &&
         class != LIBSPECTRUM_CLASS_AUXILIARY ) {
 
-      error = libspectrum_zip_read( z, outptr, outlength );
+      error = zip_read( z, outptr, outlength, limit );
       libspectrum_zip_close( z );
 
       return error;
@@ -611,3 +1108,19 @@ libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
 
   return LIBSPECTRUM_ERROR_UNKNOWN;
 }
+
+libspectrum_error
+libspectrum_zip_blind_read( const libspectrum_byte *zipptr, size_t ziplength,
+                            libspectrum_byte **outptr, size_t *outlength )
+{
+  return zip_blind_read( zipptr, ziplength, outptr, outlength, 0 );
+}
+
+libspectrum_error
+libspectrum_zip_blind_read_prefix( const libspectrum_byte *zipptr,
+                                   size_t ziplength,
+                                   libspectrum_byte **outptr,
+                                   size_t *outlength )
+{
+  return zip_blind_read( zipptr, ziplength, outptr, outlength, *outlength );
+}
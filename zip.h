@@ -35,10 +35,6 @@
 
 #define ZIP_SUPPORTED_VERSION  20
 
-#define ZIPFLAG_NODIR    1
-#define ZIPFLAG_NOCASE   2
-#define ZIPFLAG_AUTOCASE 4
-
 enum {
   ZIP_LOCAL_HEADER_SIZE = 30,
   ZIP_FILE_HEADER_SIZE = 46,
@@ -115,15 +111,23 @@ typedef struct zip_directory_info {
  /* libspectrum_byte comment[ comment_size ]; */
 } zip_directory_info;
 
-typedef struct zip_stat {
-  char name[1024];
-  char *filename;
-  size_t size;
-  int is_dir;
-  libspectrum_word index;
-} zip_stat;
+/* An entry in the index of the central directory */
+typedef struct zip_entry {
+  zip_file_header file_info;
+  char *file_name;
+  int file_ignore_case;
 
-typedef struct libspectrum_zip {
+  /* Position of the entry in the central directory, and of the header
+     after it */
+  unsigned int file_index;
+  const libspectrum_byte *next_header;
+
+  /* The next entry with the same case-folded file name, ignoring any
+     directories, or NULL */
+  struct zip_entry *next;
+} zip_entry;
+
+struct libspectrum_zip {
 
   /* State of the parsing process */  
   libspectrum_dword state;
@@ -153,29 +157,13 @@ typedef struct libspectrum_zip {
   zip_file_header file_info;
   char file_name[1024];
   int file_ignore_case;
-} libspectrum_zip;
-
-struct libspectrum_zip *
-libspectrum_zip_open( const libspectrum_byte *buffer, size_t length );
 
-libspectrum_error
-libspectrum_zip_next( struct libspectrum_zip *zip, zip_stat *info );
-
-libspectrum_error
-libspectrum_zip_read( struct libspectrum_zip *zip,
-                      libspectrum_byte **buffer, size_t *size );
-
-int
-libspectrum_zip_locate( struct libspectrum_zip *zip, const char *filename,
-                        int flags, zip_stat *info );
-
-libspectrum_error
-libspectrum_zip_rewind( struct libspectrum_zip *zip );
-
-void
-libspectrum_zip_close( struct libspectrum_zip *zip ) ;
-
-unsigned int
-libspectrum_zip_num_entries( struct libspectrum_zip *zip );
+  /* Index of the central directory, if requested when the archive was
+     opened; maps case-folded file names, ignoring any directories, to
+     the first entry with that name */
+  zip_entry *entries;
+  unsigned int entry_count;
+  GHashTable *index;
+};
 
 #endif				/* #ifndef LIBSPECTRUM_ZIP_H */
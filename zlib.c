@@ -40,14 +40,91 @@
 
 #include "internals.h"
 
+/* The output buffer starts at this size when there's no hint as to the
+   inflated length, and at least doubles each time it runs out */
+#define INFLATE_MIN_BUFFER 16384
+
+/* No deflate stream expands by more than this */
+#define DEFLATE_MAX_RATIO 1032
+
+/* A hint comes from the file itself, so the buffer starts no bigger than
+   this many times the compressed length, or than INFLATE_MAX_HINT, however
+   large the hint is */
+#define INFLATE_HINT_RATIO 64
+#define INFLATE_MAX_HINT ( 4 * 1024 * 1024 )
+
+/* Data at least this long which is all one byte is compressed without
+   calling zlib; it's common in memory pages */
+#define UNIFORM_MIN_LENGTH 1024
+
+/* The gzip writer makes at least this much room in its output each time
+   deflate() runs out */
+#define GZIP_WRITER_CHUNK 16384
+
+/* Bits being written to a deflate stream, least significant first */
+typedef struct bit_writer {
+  libspectrum_byte *ptr;
+  libspectrum_dword buffer;
+  int bits;
+} bit_writer;
+
+struct libspectrum_gzip_writer {
+
+  z_stream stream;
+  libspectrum_buffer *buffer;	/* What the data is written into */
+
+  /* The compressed output: `ptr' is the next byte to write, and
+     `*length' the space allocated at `*out' */
+  libspectrum_byte **out, *ptr;
+  size_t *length;
+
+  libspectrum_error error;	/* The first error, if any */
+
+};
+
+/* For each deflate match length symbol from 257 upwards, the shortest
+   match it represents and the number of extra bits which follow it */
+static const libspectrum_word match_base[] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+  67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const int match_extra_bits[] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+  5, 5, 5, 5, 0
+};
+
 static libspectrum_error
 skip_gzip_header( const libspectrum_byte **gzptr, size_t *gzlength );
+static void
+compress_uniform( libspectrum_byte value, size_t length,
+		  libspectrum_byte **gzptr, size_t *gzlength );
 static libspectrum_error
 skip_null_terminated_string( const libspectrum_byte **ptr, size_t *length,
 			     const char *name );
 static libspectrum_error
+zlib_init( z_stream *stream, const libspectrum_byte *gzptr, size_t gzlength,
+	   int gzip_hack );
+static libspectrum_error
+zlib_finish( z_stream *stream, int error );
+static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack );
+	      libspectrum_byte **outptr, size_t *outlength, size_t size_hint,
+	      int gzip_hack );
+static libspectrum_error
+zlib_inflate_to_buffer( const libspectrum_byte *gzptr, size_t gzlength,
+			libspectrum_byte *outptr, size_t *outlength,
+			int gzip_hack );
+static libspectrum_error
+zlib_inflate_prefix( const libspectrum_byte *gzptr, size_t gzlength,
+		     libspectrum_byte **outptr, size_t *outlength,
+		     int gzip_hack );
+static libspectrum_error
+gzip_writer_deflate( libspectrum_gzip_writer *writer,
+		     const libspectrum_byte *data, size_t length, int flush );
+static libspectrum_error
+gzip_writer_sink( const libspectrum_byte *data, size_t length,
+		  void *user_data );
 
 libspectrum_error 
 libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
@@ -55,43 +132,100 @@ libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 /* Inflates a block of data.
  * Input:	gzptr		-> source (deflated) data
  *		*gzlength	== source data length
+ *		*outlength	== inflated length if known, or 0
  * Output:	*outptr		-> inflated data (malloced in this fn)
  *		*outlength	== length of the inflated data
  * Returns:	error flag (libspectrum_error)
  */
 {
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0, 0 );
+}
+
+libspectrum_error
+libspectrum_zlib_inflate_hinted( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength, size_t size_hint )
+{
+  *outlength = 0;
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, size_hint, 0 );
+}
+
+libspectrum_error
+libspectrum_zlib_inflate_to_buffer( const libspectrum_byte *gzptr,
+				    size_t gzlength, libspectrum_byte *outptr,
+				    size_t *outlength )
+/* Inflates a block of data into a buffer supplied by the caller.
+ * Input:	gzptr		-> source (deflated) data
+ *		*gzlength	== source data length
+ *		outptr		-> buffer for the inflated data
+ *		*outlength	== length of that buffer
+ * Output:	*outlength	== length of the inflated data
+ * Returns:	error flag (libspectrum_error)
+ */
+{
+  return zlib_inflate_to_buffer( gzptr, gzlength, outptr, outlength, 0 );
 }
 
 libspectrum_error
 libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength )
 {
+  size_t size_hint = 0;
   int error;
 
+  /* The last four bytes are the inflated length, modulo 2^32 */
+  if( gzlength >= 18 ) {
+    const libspectrum_byte *isize = gzptr + gzlength - 4;
+    size_hint = isize[0] | isize[1] << 8 | isize[2] << 16 |
+                (libspectrum_dword)isize[3] << 24;
+  }
+
   error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
 
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1 );
+  *outlength = 0;
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, size_hint, 1 );
+}
+
+libspectrum_error
+libspectrum_gzip_inflate_prefix( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength )
+{
+  int error;
+
+  error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
+
+  return zlib_inflate_prefix( gzptr, gzlength, outptr, outlength, 1 );
 }
 
 libspectrum_error
 libspectrum_zip_inflate( const libspectrum_byte *zipptr, size_t ziplength,
                          libspectrum_byte **outptr, size_t *outlength )
 {
-  return zlib_inflate( zipptr, ziplength, outptr, outlength, 1 );
+  size_t size_hint = *outlength;
+
+  *outlength = 0;
+  return zlib_inflate( zipptr, ziplength, outptr, outlength, size_hint, 1 );
+}
+
+libspectrum_error
+libspectrum_zip_inflate_prefix( const libspectrum_byte *zipptr,
+				size_t ziplength, libspectrum_byte **outptr,
+				size_t *outlength )
+{
+  return zlib_inflate_prefix( zipptr, ziplength, outptr, outlength, 1 );
 }
 
 static libspectrum_error
-zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack )
+zlib_init( z_stream *stream, const libspectrum_byte *gzptr, size_t gzlength,
+	   int gzip_hack )
 {
-  z_stream stream;
   int error;
 
   /* Use default memory management */
-  stream.zalloc = Z_NULL; stream.zfree = Z_NULL; stream.opaque = Z_NULL;
+  stream->zalloc = Z_NULL; stream->zfree = Z_NULL; stream->opaque = Z_NULL;
 
-  stream.next_in = gzptr; stream.avail_in = gzlength;
+  stream->next_in = gzptr; stream->avail_in = gzlength;
 
   if( gzip_hack ) { 
 
@@ -105,11 +239,11 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
      * are present after the compressed stream.
      *
      */
-    error = inflateInit2( &stream, -15 );
+    error = inflateInit2( stream, -15 );
 
   } else {
 
-    error = inflateInit( &stream );
+    error = inflateInit( stream );
 
   }
 
@@ -120,46 +254,24 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   case Z_MEM_ERROR: 
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "out of memory at %s:%d", __FILE__, __LINE__ );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
-			     "error from inflateInit2: %s", stream.msg );
-    inflateEnd( &stream );
+			     "error from inflateInit2: %s", stream->msg );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   }
 
-  if( *outlength ) {
-
-    *outptr = libspectrum_new( libspectrum_byte, *outlength );
-    stream.next_out = *outptr; stream.avail_out = *outlength;
-    error = inflate( &stream, Z_FINISH );
-
-  } else {
-
-    *outptr = stream.next_out = NULL;
-    *outlength = stream.avail_out = 0;
-
-    do {
-
-      libspectrum_byte *ptr;
-
-      *outlength += 16384; stream.avail_out += 16384;
-      ptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
-      stream.next_out = ptr + ( stream.next_out - *outptr );
-      *outptr = ptr;
-
-      error = inflate( &stream, 0 );
-
-    } while( error == Z_OK );
-
-  }
-
-  *outlength = stream.next_out - *outptr;
-  *outptr = libspectrum_renew( libspectrum_byte, *outptr, *outlength );
+  return LIBSPECTRUM_ERROR_NONE;
+}
 
+/* Check the result of the last call to inflate() and free the stream */
+static libspectrum_error
+zlib_finish( z_stream *stream, int error )
+{
   switch( error ) {
 
   case Z_STREAM_END: break;
@@ -167,52 +279,187 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
   case Z_NEED_DICT:
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
 			     "gzip inflation needs dictionary" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_UNKNOWN;
 
   case Z_DATA_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT, "corrupt gzip data" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
   case Z_MEM_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "out of memory at %s:%d", __FILE__, __LINE__ );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   case Z_BUF_ERROR:
     libspectrum_print_error( LIBSPECTRUM_ERROR_CORRUPT,
 			     "not enough space in gzip output buffer" );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_CORRUPT;
 
   default:
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "gzip error from inflate: %s",
-			     stream.msg );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+			     stream->msg );
+    inflateEnd( stream );
     return LIBSPECTRUM_ERROR_LOGIC;
 
   }
 
-  error = inflateEnd( &stream );
+  error = inflateEnd( stream );
   if( error != Z_OK ) {
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
-			     "gzip error from inflateEnd: %s", stream.msg );
-    libspectrum_free( *outptr );
-    inflateEnd( &stream );
+			     "gzip error from inflateEnd: %s", stream->msg );
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 
   return LIBSPECTRUM_ERROR_NONE;
 }
 
+static libspectrum_error
+zlib_inflate_to_buffer( const libspectrum_byte *gzptr, size_t gzlength,
+			libspectrum_byte *outptr, size_t *outlength,
+			int gzip_hack )
+{
+  z_stream stream;
+  libspectrum_error error;
+
+  error = zlib_init( &stream, gzptr, gzlength, gzip_hack );
+  if( error ) return error;
+
+  stream.next_out = outptr; stream.avail_out = *outlength;
+
+  error = zlib_finish( &stream, inflate( &stream, Z_FINISH ) );
+
+  *outlength = stream.next_out - outptr;
+
+  return error;
+}
+
+/* Inflate a block of data. If `*outlength' is non-zero, the data must
+   inflate to no more than that; otherwise the output buffer is grown as
+   needed, starting from `size_hint' (or as near it as is safe) if that is
+   non-zero, until the data ends or the decompression limit is reached */
+static libspectrum_error
+zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
+	      libspectrum_byte **outptr, size_t *outlength, size_t size_hint,
+	      int gzip_hack )
+{
+  z_stream stream;
+  libspectrum_byte *ptr;
+  size_t capacity, length, allowance;
+  libspectrum_error error;
+  int z_error;
+
+  if( *outlength ) {
+
+    error = libspectrum_inflate_check( *outlength );
+    if( error ) return error;
+
+    *outptr = libspectrum_new( libspectrum_byte, *outlength );
+    error = zlib_inflate_to_buffer( gzptr, gzlength, *outptr, outlength,
+				    gzip_hack );
+    if( error ) { libspectrum_free( *outptr ); return error; }
+
+    libspectrum_inflate_charge( *outlength );
+
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
+  error = zlib_init( &stream, gzptr, gzlength, gzip_hack );
+  if( error ) return error;
+
+  /* A hint which couldn't possibly be right is ignored. The extra byte
+     lets inflate() see the end of the stream without running out of space
+     when the hint is exact */
+  if( size_hint / DEFLATE_MAX_RATIO > gzlength ) size_hint = 0;
+  capacity = size_hint ? size_hint + 1 : INFLATE_MIN_BUFFER;
+
+  /* But a possible one may still be false, so start only part of the way
+     towards a large hint and let the buffer grow the rest */
+  if( capacity > INFLATE_MAX_HINT ) capacity = INFLATE_MAX_HINT;
+  if( capacity / INFLATE_HINT_RATIO > gzlength ) {
+    capacity = INFLATE_HINT_RATIO * gzlength;
+    if( capacity < INFLATE_MIN_BUFFER ) capacity = INFLATE_MIN_BUFFER;
+  }
+
+  /* Never need more than one byte past the limit to know it's been hit */
+  allowance = libspectrum_inflate_allowance();
+  if( capacity > allowance ) capacity = allowance + 1;
+
+  ptr = libspectrum_new( libspectrum_byte, capacity );
+  stream.next_out = ptr; stream.avail_out = capacity;
+
+  while( ( z_error = inflate( &stream, 0 ) ) == Z_OK ) {
+
+    if( stream.avail_out ) continue;
+
+    length = stream.next_out - ptr;
+    if( length > allowance ) break;
+
+    /* Out of space; double the buffer */
+    capacity = 2 * length;
+    if( capacity < INFLATE_MIN_BUFFER ) capacity = INFLATE_MIN_BUFFER;
+    if( capacity > allowance ) capacity = allowance + 1;
+    ptr = libspectrum_renew( libspectrum_byte, ptr, capacity );
+    stream.next_out = ptr + length; stream.avail_out = capacity - length;
+
+  }
+
+  length = stream.next_out - ptr;
+  if( length > allowance ) {
+    inflateEnd( &stream );
+    libspectrum_free( ptr );
+    return libspectrum_inflate_check( length );
+  }
+
+  error = zlib_finish( &stream, z_error );
+  if( error ) { libspectrum_free( ptr ); return error; }
+
+  /* Give back any large amount of unused space */
+  if( length < capacity - capacity / 4 )
+    ptr = libspectrum_renew( libspectrum_byte, ptr, length );
+
+  libspectrum_inflate_charge( length );
+
+  *outptr = ptr; *outlength = length;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Inflate no more than the first `*outlength' bytes of a block of data,
+   stopping as soon as the output buffer is full. The data may be
+   truncated, and nothing is checked beyond what's inflated */
+static libspectrum_error
+zlib_inflate_prefix( const libspectrum_byte *gzptr, size_t gzlength,
+		     libspectrum_byte **outptr, size_t *outlength,
+		     int gzip_hack )
+{
+  z_stream stream;
+  libspectrum_error error;
+  int z_error;
+
+  error = zlib_init( &stream, gzptr, gzlength, gzip_hack );
+  if( error ) return error;
+
+  *outptr = libspectrum_new( libspectrum_byte, *outlength );
+  stream.next_out = *outptr; stream.avail_out = *outlength;
+
+  /* Running out of either input or output space just means we've got as
+     much as we're going to get */
+  z_error = inflate( &stream, Z_SYNC_FLUSH );
+  if( z_error == Z_OK || z_error == Z_BUF_ERROR ) z_error = Z_STREAM_END;
+
+  error = zlib_finish( &stream, z_error );
+  if( error ) { libspectrum_free( *outptr ); return error; }
+
+  *outlength = stream.next_out - *outptr;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 static libspectrum_error
 skip_gzip_header( const libspectrum_byte **gzptr, size_t *gzlength )
 {
@@ -318,12 +565,28 @@ libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,
  *		*gzlength	== length of the deflated data
  * Returns:	error flag (libspectrum_error)
  */
+{
+  return libspectrum_zlib_compress_level( data, length, gzptr, gzlength,
+					  LIBSPECTRUM_COMPRESSION_BEST );
+}
+
+libspectrum_error
+libspectrum_zlib_compress_level( const libspectrum_byte *data, size_t length,
+				 libspectrum_byte **gzptr, size_t *gzlength,
+				 libspectrum_compression_level level )
 {
   uLongf gzl = (uLongf)( length * 1.001 ) + 12;
   int gzret;
 
+  if( length >= UNIFORM_MIN_LENGTH && !memcmp( data, data + 1, length - 1 ) ) {
+    compress_uniform( data[0], length, gzptr, gzlength );
+    return LIBSPECTRUM_ERROR_NONE;
+  }
+
   *gzptr = libspectrum_new( libspectrum_byte, gzl );
-  gzret = compress2( *gzptr, &gzl, data, length, Z_BEST_COMPRESSION );
+  gzret = compress2( *gzptr, &gzl, data, length,
+		     level == LIBSPECTRUM_COMPRESSION_FAST ?
+		       Z_BEST_SPEED : Z_BEST_COMPRESSION );
 
   switch (gzret) {
 
@@ -357,3 +620,310 @@ libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 }
+
+static void
+put_bits( bit_writer *writer, libspectrum_dword value, int count )
+{
+  writer->buffer |= value << writer->bits;
+  writer->bits += count;
+
+  while( writer->bits >= 8 ) {
+    *writer->ptr++ = writer->buffer & 0xff;
+    writer->buffer >>= 8; writer->bits -= 8;
+  }
+}
+
+/* Huffman codes go into the stream most significant bit first */
+static void
+put_code( bit_writer *writer, libspectrum_word code, int length )
+{
+  libspectrum_dword reversed = 0;
+  int i;
+
+  for( i = 0; i < length; i++ )
+    reversed |= ( ( code >> i ) & 1 ) << ( length - 1 - i );
+
+  put_bits( writer, reversed, length );
+}
+
+/* Assign the canonical Huffman codes for a set of code lengths */
+static void
+canonical_codes( const libspectrum_byte *lengths, size_t count,
+		 libspectrum_word *codes )
+{
+  libspectrum_word length_count[16], next_code[16], code = 0;
+  size_t i;
+
+  memset( length_count, 0, sizeof( length_count ) );
+  for( i = 0; i < count; i++ ) length_count[ lengths[i] ]++;
+  length_count[0] = 0;
+
+  for( i = 1; i < 16; i++ ) {
+    code = ( code + length_count[ i - 1 ] ) << 1;
+    next_code[i] = code;
+  }
+
+  for( i = 0; i < count; i++ )
+    if( lengths[i] ) codes[i] = next_code[ lengths[i] ]++;
+}
+
+/* The index into match_base[] for a match of `length' bytes */
+static int
+match_index( size_t length )
+{
+  int i = ARRAY_SIZE( match_base ) - 1;
+
+  while( match_base[i] > length ) i--;
+
+  return i;
+}
+
+/* Write a match of `length' bytes with the previous byte */
+static void
+put_match( bit_writer *writer, size_t length, const libspectrum_word *codes,
+	   const libspectrum_byte *lengths )
+{
+  int i = match_index( length );
+
+  put_code( writer, codes[ 257 + i ], lengths[ 257 + i ] );
+  put_bits( writer, length - match_base[i], match_extra_bits[i] );
+
+  /* Distance code 0, meaning a distance of 1 */
+  put_code( writer, codes[ 286 ], lengths[ 286 ] );
+}
+
+/* Build the zlib stream for `length' copies of `value' directly: the
+   first byte as a literal and the rest as matches with the byte before,
+   using Huffman codes fixed in advance for just those symbols */
+static void
+compress_uniform( libspectrum_byte value, size_t length,
+		  libspectrum_byte **gzptr, size_t *gzlength )
+{
+  /* The order in which the code length code lengths are sent */
+  static const int order[] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  static const unsigned long base = 65521;	/* For Adler-32 */
+  libspectrum_byte lengths[ 288 ], cl_lengths[ 19 ];
+  libspectrum_word codes[ 288 ], cl_codes[ 19 ];
+  size_t full, rest, last, i, run;
+  unsigned long a, b, sum;
+  bit_writer writer;
+
+  /* As many 258 byte matches as possible, then whatever is left; but no
+     match may be shorter than 3 bytes */
+  full = ( length - 1 ) / 258; rest = ( length - 1 ) % 258; last = 0;
+  if( rest && rest < 3 ) { full--; rest += 258 - 3; last = 3; }
+
+  /* Literal/length codes, with the 258 byte match the shortest, followed
+     by two distance codes as deflate needs a complete code */
+  memset( lengths, 0, sizeof( lengths ) );
+  lengths[ value ] = 2;
+  lengths[ 285 ] = 1;
+  if( !rest ) {
+    lengths[ 256 ] = 2;
+  } else if( !last ) {
+    lengths[ 256 ] = 3; lengths[ 257 + match_index( rest ) ] = 3;
+  } else {
+    lengths[ 256 ] = 3; lengths[ 257 + match_index( rest ) ] = 4;
+    lengths[ 257 + match_index( last ) ] = 4;
+  }
+  lengths[ 286 ] = lengths[ 287 ] = 1;
+
+  canonical_codes( lengths, 286, codes );
+  canonical_codes( lengths + 286, 2, codes + 286 );
+
+  /* Code length codes for the lengths used above and runs of zeros */
+  memset( cl_lengths, 0, sizeof( cl_lengths ) );
+  cl_lengths[ 0 ] = cl_lengths[ 1 ] = cl_lengths[ 2 ] = 3;
+  cl_lengths[ 3 ] = cl_lengths[ 4 ] = 4;
+  cl_lengths[ 17 ] = cl_lengths[ 18 ] = 2;
+  canonical_codes( cl_lengths, 19, cl_codes );
+
+  /* The header and Huffman codes take well under 100 bytes; each 258 byte
+     match takes 2 bits */
+  *gzptr = libspectrum_new( libspectrum_byte, 128 + length / 512 );
+  writer.ptr = *gzptr; writer.buffer = 0; writer.bits = 0;
+
+  /* zlib header, saying maximum compression */
+  *writer.ptr++ = 0x78; *writer.ptr++ = 0xda;
+
+  /* One final block with dynamic Huffman codes, 286 literal/length codes,
+     2 distance codes and 18 code length codes */
+  put_bits( &writer, 1, 1 ); put_bits( &writer, 2, 2 );
+  put_bits( &writer, 286 - 257, 5 ); put_bits( &writer, 2 - 1, 5 );
+  put_bits( &writer, 18 - 4, 4 );
+
+  for( i = 0; i < 18; i++ ) put_bits( &writer, cl_lengths[ order[i] ], 3 );
+
+  for( i = 0; i < 288; i += run ) {
+
+    run = 1;
+    if( !lengths[i] )
+      while( i + run < 288 && !lengths[ i + run ] && run < 138 ) run++;
+
+    if( run >= 11 ) {
+      put_code( &writer, cl_codes[ 18 ], cl_lengths[ 18 ] );
+      put_bits( &writer, run - 11, 7 );
+    } else if( run >= 3 ) {
+      put_code( &writer, cl_codes[ 17 ], cl_lengths[ 17 ] );
+      put_bits( &writer, run - 3, 3 );
+    } else {
+      run = 1;
+      put_code( &writer, cl_codes[ lengths[i] ], cl_lengths[ lengths[i] ] );
+    }
+
+  }
+
+  /* And the data itself */
+  put_code( &writer, codes[ value ], lengths[ value ] );
+  for( i = 0; i < full; i++ ) put_match( &writer, 258, codes, lengths );
+  if( rest ) put_match( &writer, rest, codes, lengths );
+  if( last ) put_match( &writer, last, codes, lengths );
+  put_code( &writer, codes[ 256 ], lengths[ 256 ] );
+
+  if( writer.bits ) put_bits( &writer, 0, 8 - writer.bits );
+
+  /* The Adler-32 checksum: a = 1 + the sum of the bytes, and b = the sum
+     of the successive values of a */
+  if( length % 2 ) {
+    sum = ( length % base ) * ( ( ( length + 1 ) / 2 ) % base ) % base;
+  } else {
+    sum = ( ( length / 2 ) % base ) * ( ( length + 1 ) % base ) % base;
+  }
+  a = ( 1 + ( length % base ) * value ) % base;
+  b = ( length % base + sum * value ) % base;
+
+  *writer.ptr++ = b >> 8; *writer.ptr++ = b & 0xff;
+  *writer.ptr++ = a >> 8; *writer.ptr++ = a & 0xff;
+
+  *gzlength = writer.ptr - *gzptr;
+}
+
+libspectrum_error
+libspectrum_gzip_writer_alloc( libspectrum_gzip_writer **writer,
+			       libspectrum_byte **buffer, size_t *length,
+			       libspectrum_compression_level level )
+{
+  libspectrum_gzip_writer *new_writer;
+  int error;
+
+  new_writer = libspectrum_new( libspectrum_gzip_writer, 1 );
+
+  new_writer->stream.zalloc = Z_NULL;
+  new_writer->stream.zfree = Z_NULL;
+  new_writer->stream.opaque = Z_NULL;
+  new_writer->stream.next_in = Z_NULL;
+  new_writer->stream.avail_in = 0;
+
+  /* 16 more than the window size gets a gzip header and trailer */
+  error = deflateInit2( &new_writer->stream,
+			level == LIBSPECTRUM_COMPRESSION_FAST ?
+			  Z_BEST_SPEED : Z_BEST_COMPRESSION,
+			Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY );
+  if( error != Z_OK ) {
+    libspectrum_free( new_writer );
+    if( error == Z_MEM_ERROR ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
+			       "out of memory at %s:%d", __FILE__, __LINE__ );
+      return LIBSPECTRUM_ERROR_MEMORY;
+    }
+    libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+			     "gzip error from deflateInit2: %d", error );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  /* Allow for uninitialised buffer on entry */
+  if( !*length ) *buffer = NULL;
+
+  new_writer->out = buffer;
+  new_writer->ptr = *buffer;
+  new_writer->length = length;
+  new_writer->error = LIBSPECTRUM_ERROR_NONE;
+  new_writer->buffer = libspectrum_buffer_alloc_sink( gzip_writer_sink,
+						      new_writer );
+
+  *writer = new_writer;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+libspectrum_buffer*
+libspectrum_gzip_writer_buffer( libspectrum_gzip_writer *writer )
+{
+  return writer->buffer;
+}
+
+libspectrum_error
+libspectrum_gzip_writer_free( libspectrum_gzip_writer *writer,
+			      libspectrum_error error )
+{
+  if( !error ) error = writer->error;
+  if( !error ) error = libspectrum_buffer_drain( writer->buffer );
+  if( !error ) error = gzip_writer_deflate( writer, NULL, 0, Z_FINISH );
+
+  /* On error, leave `*length' as the space allocated so the caller can
+     still reuse or free the buffer */
+  if( !error ) *writer->length = writer->ptr - *writer->out;
+
+  deflateEnd( &writer->stream );
+  libspectrum_buffer_free( writer->buffer );
+  libspectrum_free( writer );
+
+  return error;
+}
+
+/* Everything drained from the writer's buffer ends up here */
+static libspectrum_error
+gzip_writer_sink( const libspectrum_byte *data, size_t length,
+		  void *user_data )
+{
+  libspectrum_gzip_writer *writer = user_data;
+
+  /* Once something's gone wrong, there's no point compressing any more */
+  if( writer->error ) return writer->error;
+
+  return gzip_writer_deflate( writer, data, length, Z_NO_FLUSH );
+}
+
+static libspectrum_error
+gzip_writer_deflate( libspectrum_gzip_writer *writer,
+		     const libspectrum_byte *data, size_t length, int flush )
+{
+  z_stream *stream = &writer->stream;
+  size_t space;
+  int error;
+
+  stream->next_in = (Bytef*)data;
+
+  do {
+
+    /* avail_in and avail_out are only unsigned ints, so very large blocks
+       are passed in several goes */
+    if( !stream->avail_in ) {
+      stream->avail_in = length > 0x40000000 ? 0x40000000 : length;
+      length -= stream->avail_in;
+    }
+
+    libspectrum_make_room( writer->out, GZIP_WRITER_CHUNK, &writer->ptr,
+			   writer->length );
+    space = *writer->length - ( writer->ptr - *writer->out );
+    stream->next_out = writer->ptr;
+    stream->avail_out = space > 0x40000000 ? 0x40000000 : space;
+
+    error = deflate( stream, length ? Z_NO_FLUSH : flush );
+    writer->ptr = stream->next_out;
+
+    if( error == Z_STREAM_ERROR ) {
+      libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
+			       "gzip error from deflate: %s",
+			       stream->msg ? stream->msg : "unknown error" );
+      writer->error = LIBSPECTRUM_ERROR_LOGIC;
+      return writer->error;
+    }
+
+  } while( stream->avail_in || length || !stream->avail_out ||
+	   ( flush == Z_FINISH && error != Z_STREAM_END ) );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}